@@ -0,0 +1,62 @@
+// Checkpoints of a sequential run, to resume it after a crash or a preemption.
+// The only state carried between frames is the previous input and the previous solution ; the input is read again
+// from the input video when resuming, so the file holds the solution of the last frame written and the output progress.
+// Binary layout (little-endian) : "BVTCCKPT", int32 version, W, H, frames_done, then W*H*3 floats.
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+
+#define CHECKPOINT_MAGIC "BVTCCKPT"
+
+struct Checkpoint {
+	Checkpoint() : W(0), H(0), frames_done(0) {}
+
+	int W, H;
+	int frames_done;                  // frames solved and written by the recorder ; the run resumes at this frame
+	std::vector<float> prevSolution;  // solution of frame frames_done-1
+
+	// written to a temporary file first, so that a crash while saving keeps the previous checkpoint.
+	bool save(const std::string &filename) const {
+		std::string tmp = filename + ".tmp";
+		FILE* f = fopen(tmp.c_str(), "wb");
+		if (!f) return false;
+		int header[4] = { VERSION, W, H, frames_done };
+		bool ok = fwrite(CHECKPOINT_MAGIC, 1, 8, f)==8 && fwrite(header, sizeof(int), 4, f)==4
+			&& fwrite(&prevSolution[0], sizeof(float), prevSolution.size(), f)==prevSolution.size();
+		ok = (fclose(f)==0) && ok;
+		if (!ok) {
+			std::remove(tmp.c_str());
+			return false;
+		}
+#ifdef _WIN32
+		std::remove(filename.c_str()); // rename does not replace existing files
+#endif
+		return std::rename(tmp.c_str(), filename.c_str())==0;
+	}
+
+	// false if the file is missing or is not a checkpoint.
+	bool load(const std::string &filename) {
+		FILE* f = fopen(filename.c_str(), "rb");
+		if (!f) return false;
+		char magic[8];
+		int header[4];
+		bool ok = fread(magic, 1, 8, f)==8 && memcmp(magic, CHECKPOINT_MAGIC, 8)==0 && fread(header, sizeof(int), 4, f)==4 && header[0]==VERSION
+			&& header[1]>0 && header[2]>0 && header[3]>0;
+		if (ok) {
+			W = header[1];
+			H = header[2];
+			frames_done = header[3];
+			prevSolution.resize((size_t)W*H*3);
+			ok = fread(&prevSolution[0], sizeof(float), prevSolution.size(), f)==prevSolution.size();
+		}
+		fclose(f);
+		return ok;
+	}
+
+private:
+	enum { VERSION = 1 };
+};
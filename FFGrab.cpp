@@ -41,6 +41,7 @@ This file is part of mmread.
 #include <sys/types.h>
 #include <sys/stat.h>
 //#include <unistd.h>
+#include <mutex>
 
 
 
@@ -54,8 +55,8 @@ static inline T1 min(T1 a, T2 b) {
 }
 
 bool file_exists(const char* filename) {
-	std::ifstream ifile(filename);
-	return ifile.good();
+	struct stat st;
+	return stat(filename, &st) == 0;
 }
 
 bool increment_file_number(std::string &path) {
@@ -255,7 +256,11 @@ FFGrabber::FFGrabber()
 #ifdef DEBUG
 	FFprintf("avbin_init\n");
 #endif
- 	if (avbin_init()) FFprintf("avbin_init init failed!!!\n");
+	// registers the codecs : only once per process, several grabbers may be created concurrently
+	static std::once_flag avbin_init_once;
+	std::call_once(avbin_init_once, []() {
+		if (avbin_init()) FFprintf("avbin_init init failed!!!\n");
+	});
 
 	av_log_set_level(AV_LOG_QUIET);
 }
@@ -539,6 +544,9 @@ void FFGrabber::runMatlabCommand(Grabber* G)
 
 int FFGrabber::build(const char* filename, char* format, bool disableVideo, bool disableAudio, bool tryseeking)
 {
+	// opening streams opens their decoders
+	std::lock_guard<std::mutex> lock(avcodec_open_mutex());
+
 #ifdef DEBUG
 	FFprintf("avbin_open_filename\n");
 #endif
@@ -1400,3 +1408,238 @@ void display_format(AVPixelFormat p) {
 }
 
 
+
+
+
+// list of files of an image sequence. Either a printf-style pattern (e.g. "frame_%05d.png", starting at
+// the first existing index in 0..first_index_max), or the first file of the sequence, numbers being incremented in place.
+std::vector<std::string> resolve_image_sequence(const std::string &first_file, int first_index_max) {
+
+	std::vector<std::string> files;
+	if (first_file.find('%') != std::string::npos) {
+		char name[4096];
+		int start = 0;
+		for (; start <= first_index_max; start++) {
+			snprintf(name, sizeof(name), first_file.c_str(), start);
+			if (file_exists(name)) break;
+		}
+		for (int i = start; ; i++) {
+			snprintf(name, sizeof(name), first_file.c_str(), i);
+			if (!file_exists(name)) break;
+			files.push_back(name);
+		}
+		return files;
+	}
+
+	std::string filename = first_file;
+	while (file_exists(filename.c_str())) {
+		files.push_back(filename);
+		if (!increment_file_number(filename)) break;
+	}
+	return files;
+}
+
+AVCodecID image_codec_id(const std::string &filename) {
+	std::string ext = filename.substr(filename.find_last_of(".") + 1);
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+	if (ext == "png") return AV_CODEC_ID_PNG;
+	if (ext == "jpg" || ext == "jpeg") return AV_CODEC_ID_MJPEG;
+	if (ext == "tga") return AV_CODEC_ID_TARGA;
+	if (ext == "bmp") return AV_CODEC_ID_BMP;
+	return AV_CODEC_ID_NONE;
+}
+
+// avcodec_open2 / avcodec_close must not run concurrently (no lock manager registered).
+std::mutex& avcodec_open_mutex() {
+	static std::mutex m;
+	return m;
+}
+
+static bool decode_image_cimg(const std::string &filename, std::vector<unsigned char> &rgb, int &W, int &H) {
+	try {
+		cimg_library::CImg<unsigned char> cimg(filename.c_str());
+		W = cimg.width();
+		H = cimg.height();
+		rgb.resize(W*H*3);
+		const int c1 = cimg.spectrum()>1 ? 1 : 0, c2 = cimg.spectrum()>2 ? 2 : 0;
+		for (int j = 0; j < W*H; j++) {
+			rgb[j*3 + 0] = cimg.data()[j];
+			rgb[j*3 + 1] = cimg.data()[j + W*H*c1];
+			rgb[j*3 + 2] = cimg.data()[j + W*H*c2];
+		}
+	} catch (cimg_library::CImgException &) {
+		std::cout << "cannot read " << filename << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// decodes an image file to interleaved RGB24 in the calling thread, with the libavcodec image decoders.
+// Formats whose decoder is not part of the ffmpeg build (e.g. png without zlib) go through CImg.
+bool decode_image(const std::string &filename, std::vector<unsigned char> &rgb, int &W, int &H) {
+
+	AVCodecID id = image_codec_id(filename);
+	AVCodec* codec = (id != AV_CODEC_ID_NONE) ? avcodec_find_decoder(id) : NULL;
+	if (!codec)
+		return decode_image_cimg(filename, rgb, W, H);
+
+	FILE* f = fopen(filename.c_str(), "rb");
+	if (!f) {
+		std::cout << "cannot open " << filename << std::endl;
+		return false;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	std::vector<uint8_t> data(size + FF_INPUT_BUFFER_PADDING_SIZE, 0);
+	size_t nread = fread(&data[0], 1, size, f);
+	fclose(f);
+
+	AVCodecContext* ctx = avcodec_alloc_context3(codec);
+	ctx->thread_count = 1;
+	{
+		std::lock_guard<std::mutex> lock(avcodec_open_mutex());
+		if (avcodec_open2(ctx, codec, NULL) < 0) {
+			av_free(ctx);
+			return decode_image_cimg(filename, rgb, W, H);
+		}
+	}
+
+	AVFrame* frame = avcodec_alloc_frame();
+	AVPacket pkt;
+	av_init_packet(&pkt);
+	pkt.data = &data[0];
+	pkt.size = (int)nread;
+	int got_picture = 0;
+	bool success = avcodec_decode_video2(ctx, frame, &got_picture, &pkt) >= 0 && got_picture;
+	if (success) {
+		W = ctx->width;
+		H = ctx->height;
+		rgb.resize(W*H*3);
+		SwsContext* sws = sws_getContext(W, H, ctx->pix_fmt, W, H, AV_PIX_FMT_RGB24, SWS_POINT, NULL, NULL, NULL);
+		uint8_t* dst[4] = { &rgb[0], NULL, NULL, NULL };
+		int dst_linesize[4] = { 3*W, 0, 0, 0 };
+		success = sws && sws_scale(sws, frame->data, frame->linesize, 0, H, dst, dst_linesize) > 0;
+		sws_freeContext(sws);
+	}
+	avcodec_free_frame(&frame);
+	{
+		std::lock_guard<std::mutex> lock(avcodec_open_mutex());
+		avcodec_close(ctx);
+	}
+	av_free(ctx);
+
+	if (!success) {
+		std::cout << "libavcodec failed on " << filename << ", trying CImg" << std::endl;
+		return decode_image_cimg(filename, rgb, W, H);
+	}
+	return true;
+}
+
+// PFM : uncompressed float RGB, bottom-up rows. Used for high dynamic range / full precision outputs.
+bool write_pfm(const std::string &filename, const float* rgb, int W, int H) {
+	FILE* f = fopen(filename.c_str(), "wb");
+	if (!f) {
+		std::cout << "cannot write " << filename << std::endl;
+		return false;
+	}
+	fprintf(f, "PF\n%d %d\n-1.0\n", W, H); // negative scale : little endian
+	bool ok = true;
+	for (int i = H - 1; i >= 0; i--)
+		ok &= fwrite(rgb + (size_t)i*W*3, sizeof(float), W*3, f) == (size_t)W*3;
+	fclose(f);
+	return ok;
+}
+
+static bool encode_image_cimg(const std::string &filename, const unsigned char* rgb, int W, int H) {
+	cimg_library::CImg<unsigned char> cimg(W, H, 1, 3);
+	for (int i = 0; i < W*H; i++) {
+		cimg.data()[i] = rgb[i*3];
+		cimg.data()[i + W*H] = rgb[i*3 + 1];
+		cimg.data()[i + 2*W*H] = rgb[i*3 + 2];
+	}
+	try {
+		cimg.save(filename.c_str());
+	} catch (cimg_library::CImgException &) {
+		std::cout << "cannot write " << filename << std::endl;
+		return false;
+	}
+	return true;
+}
+
+// encodes an RGB24 image to a file in the calling thread, with the libavcodec image encoders.
+// compression_level (png, 0..9, -1 = default) and png_filter (prediction : 0 none, 1 sub, 2 up, 3 avg, 4 paeth, 5 mixed)
+// trade size for speed ; jpeg_quality is 1..31 (qscale, lower is better).
+// Formats without an encoder in the ffmpeg build (e.g. png without zlib) go through CImg.
+bool encode_image(const std::string &filename, const unsigned char* rgb, int W, int H, const ImageEncodeOptions &opts) {
+
+	AVCodecID id = image_codec_id(filename);
+	AVCodec* codec = (id != AV_CODEC_ID_NONE) ? avcodec_find_encoder(id) : NULL;
+	if (!codec)
+		return encode_image_cimg(filename, rgb, W, H);
+
+	std::vector<AVPixelFormat> formats;
+	for (int k = 0; codec->pix_fmts && codec->pix_fmts[k] != AV_PIX_FMT_NONE; k++) formats.push_back(codec->pix_fmts[k]);
+	formats.push_back(AV_PIX_FMT_NONE);
+	AVPixelFormat fmt = (formats.size() > 1) ? avcodec_find_best_pix_fmt_of_list(&formats[0], AV_PIX_FMT_RGB24, 0, NULL) : AV_PIX_FMT_RGB24;
+
+	AVCodecContext* ctx = avcodec_alloc_context3(codec);
+	ctx->width = W;
+	ctx->height = H;
+	ctx->pix_fmt = fmt;
+	ctx->time_base.num = 1;
+	ctx->time_base.den = 25;
+	ctx->thread_count = 1;
+	if (id == AV_CODEC_ID_PNG) {
+		if (opts.compression_level >= 0) ctx->compression_level = opts.compression_level;
+		ctx->prediction_method = opts.png_filter;
+	}
+	if (id == AV_CODEC_ID_MJPEG) {
+		ctx->flags |= CODEC_FLAG_QSCALE;
+		ctx->global_quality = FF_QP2LAMBDA * opts.jpeg_quality;
+	}
+	{
+		std::lock_guard<std::mutex> lock(avcodec_open_mutex());
+		if (avcodec_open2(ctx, codec, NULL) < 0) {
+			av_free(ctx);
+			return encode_image_cimg(filename, rgb, W, H);
+		}
+	}
+
+	AVFrame* frame = avcodec_alloc_frame();
+	std::vector<uint8_t> converted;
+	if (fmt == AV_PIX_FMT_RGB24) {
+		avpicture_fill((AVPicture*)frame, (uint8_t*)rgb, AV_PIX_FMT_RGB24, W, H);
+	} else {
+		converted.resize(avpicture_get_size(fmt, W, H));
+		avpicture_fill((AVPicture*)frame, &converted[0], fmt, W, H);
+		SwsContext* sws = sws_getContext(W, H, AV_PIX_FMT_RGB24, W, H, fmt, SWS_POINT, NULL, NULL, NULL);
+		const uint8_t* src[4] = { rgb, NULL, NULL, NULL };
+		int src_linesize[4] = { 3*W, 0, 0, 0 };
+		sws_scale(sws, src, src_linesize, 0, H, frame->data, frame->linesize);
+		sws_freeContext(sws);
+	}
+	frame->pts = 0;
+	if (id == AV_CODEC_ID_MJPEG) frame->quality = ctx->global_quality;
+
+	AVPacket pkt;
+	av_init_packet(&pkt);
+	pkt.data = NULL;
+	pkt.size = 0;
+	int got_packet = 0;
+	bool success = avcodec_encode_video2(ctx, &pkt, frame, &got_packet) >= 0 && got_packet;
+	if (success) {
+		FILE* f = fopen(filename.c_str(), "wb");
+		success = f && fwrite(pkt.data, 1, pkt.size, f) == (size_t)pkt.size;
+		if (f) fclose(f);
+		if (!success) std::cout << "cannot write " << filename << std::endl;
+	}
+	av_free_packet(&pkt);
+	avcodec_free_frame(&frame);
+	{
+		std::lock_guard<std::mutex> lock(avcodec_open_mutex());
+		avcodec_close(ctx);
+	}
+	av_free(ctx);
+	return success;
+}
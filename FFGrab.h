@@ -5,7 +5,12 @@
 #include <iostream>
 #include <fstream> 
 #include "CImg.h"
+#include "YUVIO.h"
+#include "ThreadPool.h"
+#include "Profiler.h"
+#include <deque>
 #include <algorithm>
+#include <climits>
 
 template<typename T>
 void readVideo(char* filename, double scale, size_t &W, size_t &H, size_t &nb_frames, std::vector<T> &video, int max_frames);
@@ -13,6 +18,17 @@ template<typename T>
 void writeVideo(const char* filename, double scale, size_t W, size_t H, size_t nb_frames, std::vector<T> &video, int codec = 2, bool swapRedBlue = false); // 1 = mpeg1
 std::string codec_id_to_str(int id);
 bool increment_file_number(std::string &path);
+std::vector<std::string> resolve_image_sequence(const std::string &first_file, int first_index_max = 1);
+bool decode_image(const std::string &filename, std::vector<unsigned char> &rgb, int &W, int &H);
+
+struct ImageEncodeOptions {
+	ImageEncodeOptions() : compression_level(-1), png_filter(0), jpeg_quality(2) {}
+	int compression_level;  // png zlib level 0..9, -1 : default
+	int png_filter;         // png row filter : 0 none, 1 sub, 2 up, 3 avg, 4 paeth, 5 mixed (smallest files, slowest)
+	int jpeg_quality;       // jpeg qscale 1..31, lower is better
+};
+bool encode_image(const std::string &filename, const unsigned char* rgb, int W, int H, const ImageEncodeOptions &opts);
+bool write_pfm(const std::string &filename, const float* rgb, int W, int H);
 
 using namespace std;
 using namespace cimg_library;
@@ -35,6 +51,7 @@ extern "C" {
     #include <libavcodec/avcodec.h>	
 	#include <libavformat/avio.h>
 	#include <libswscale/swscale.h>
+	#include <libavutil/opt.h>
 
 	struct _AVbinFile {
 	    AVFormatContext *context;
@@ -51,6 +68,8 @@ extern "C" {
 
 void display_format(AVPixelFormat p);
 bool file_exists(const char* filename);
+AVCodecID image_codec_id(const std::string &filename);
+std::mutex& avcodec_open_mutex();
 
 class FFGrabber;
 
@@ -146,8 +165,27 @@ template<typename T>
 class VideoStreamer {
 public:
 	VideoStreamer() {};
+	virtual ~VideoStreamer() {};
 	virtual bool get_next_frame(T* frame) = 0;
 
+	// next frame as a planar 4:2:0 frame (planar420_size(W, H) values, see YUVIO.h) ; converted from RGB unless the
+	// stream is 4:2:0.
+	virtual bool get_next_frame_yuv420(T* frame) {
+		std::vector<T> rgb(W*H*3);
+		if (!get_next_frame(&rgb[0])) return false;
+		ProfileTimer timer(PROF_CONVERT);
+		rgb_to_planar420(&rgb[0], W, H, frame);
+		return true;
+	}
+
+	// moves n frames forward (resuming a run) ; false if the stream ends before.
+	virtual bool skip_frames(int n) {
+		std::vector<T> tmp(W*H*3);
+		for (int i=0; i<n; i++)
+			if (!get_next_frame(&tmp[0])) return false;
+		return true;
+	}
+
 	int W, H, nbframes;
 	int cur_frame;
 };
@@ -158,93 +196,225 @@ template<typename T>
 class VideoStreamerImage: public VideoStreamer<T> {
 public:
 
-	VideoStreamerImage(const std::string &filename) {
+	// filename : first file of the sequence, or a printf-style pattern ("frame_%05d.png").
+	// the next 'prefetch' frames are decoded in advance, in parallel, on the scheduler.
+	VideoStreamerImage(const std::string &filename, int prefetch = 8) {
+		avcodec_register_all();
 		cur_frame = 0;
-		nbframes = 10000;
-		cimg_library::CImg<unsigned char> cimg(filename.c_str());		
-		W = cimg.width();
-		H = cimg.height();
-		this->filename = filename;
+		this->W = this->H = 0;
+		this->prefetch = std::max(1, prefetch);
+		files = resolve_image_sequence(filename);
+		nbframes = (int)files.size();
+		if (nbframes==0) {
+			std::cout<<"no image found for "<<filename<<std::endl;
+			return;
+		}
+		std::cout<<nbframes<<" images in sequence "<<filename<<std::endl;
+		for (int i=0; i<this->prefetch; i++) request(i);
+		W = pending.front().get().W;
+		H = pending.front().get().H;
 	}
 
 	bool get_next_frame(T* frame) {
 
-		cimg_library::CImg<unsigned char> cimg(filename.c_str());
-		for (int j=0; j<W*H; j++) {
-			frame[j*3 + 0] = cimg.data()[j]/255.;
-			frame[j*3 + 1] = cimg.data()[j+W*H]/255.;
-			frame[j*3 + 2] = cimg.data()[j+W*H*2]/255.;
-		}
+		if (cur_frame>=nbframes || pending.empty()) return false;
+		std::shared_future<DecodedImage> next = pending.front();
+		pending.pop_front();
+		request(cur_frame + this->prefetch);
+		const DecodedImage &img = next.get();
 		cur_frame++;
-		bool success = increment_file_number(filename);		
-		success &= file_exists(filename.c_str());
-		return success;
+
+		if (!img.success) return false;
+		if (img.W!=W || img.H!=H) {
+			std::cout<<"image size changed within the sequence"<<std::endl;
+			return false;
+		}
+		const unsigned char* rgb = &img.rgb[0];
+		ProfileTimer timer(PROF_CONVERT);
+		Scheduler::instance().parallel_for(0, W*H*3, [&](int j) {
+			frame[j] = rgb[j]/(T)255.;
+		}, STAGE_DECODE);
+		return true;
 	}
-	std::string filename;
+
+	bool skip_frames(int n) {
+		for (size_t i=0; i<pending.size(); i++) pending[i].wait();
+		pending.clear();
+		cur_frame += n;
+		for (int i=0; i<this->prefetch; i++) request(cur_frame + i);
+		return cur_frame<=nbframes;
+	}
+
+	~VideoStreamerImage() {
+		for (size_t i=0; i<pending.size(); i++) pending[i].wait();
+	}
+
+	struct DecodedImage {
+		DecodedImage() : W(0), H(0), success(false) {}
+		std::vector<unsigned char> rgb;
+		int W, H;
+		bool success;
+	};
+
+	std::vector<std::string> files;
+	int prefetch;
+
+private:
+	void request(int i) {
+		if (i>=nbframes) return;
+		std::string name = files[i];
+		pending.push_back(Scheduler::instance().enqueue([name]() {
+			DecodedImage img;
+			img.success = decode_image(name, img.rgb, img.W, img.H);
+			return img;
+		}, STAGE_DECODE).share());
+	}
+	std::deque<std::shared_future<DecodedImage> > pending;
 };
 
 template<typename T>
 class VideoStreamerYUV: public VideoStreamer<T> {
 public:
-	VideoStreamerYUV(const std::string &filename, int W, int H) {
+	// raw I420 files need W and H ; for .y4m files they are read from the stream header (pass 0).
+	// bilinear_chroma : bilinear chroma upsampling instead of pixel replication.
+	VideoStreamerYUV(const std::string &filename, int W, int H, bool bilinear_chroma = true) {
 		cur_frame = 0;
-		nbframes = 10000;
-		this->W = W;
-		this->H = H;		
+		nbframes = 0;
+		this->bilinear_chroma = bilinear_chroma;
+		offset = 0;
+
+		if (!file.open(filename.c_str())) {
+			std::cout<<"cannot open "<<filename<<std::endl;
+			this->W = this->H = 0;
+			return;
+		}
+		if (file.size>=strlen(Y4M_MAGIC) && memcmp(file.data, Y4M_MAGIC, strlen(Y4M_MAGIC))==0) {
+			is_y4m = true;
+			offset = parse_y4m_header(file.data, file.size, fmt);
+		} else {
+			is_y4m = false;
+			fmt.W = W;
+			fmt.H = H;
+		}
+		this->W = fmt.W;
+		this->H = fmt.H;
+		if (fmt.W<=0 || fmt.H<=0 || (is_y4m && offset==0)) {
+			std::cout<<"YUV input "<<filename<<" : unknown frame size (give W and H for raw .yuv files)"<<std::endl;
+			this->W = this->H = 0;
+			return;
+		}
 
-		FFG = cimg::fopen(filename.c_str(), "rb");
+		// frame markers in y4m files are usually just "FRAME\n", so this is exact in practice ; get_next_frame still checks each marker.
+		size_t frame_header = is_y4m ? strlen(Y4M_FRAME_MAGIC)+1 : 0;
+		nbframes = (int)((file.size - offset) / (fmt.frame_size() + frame_header));
 	}
 
+	// zero-copy access to the next frame : plane pointers point into the file mapping and stay valid while the streamer lives.
+	bool get_next_planes(YUVPlanes &planes) {
+
+		if (!file.data) return false;
+		size_t pos = offset;
+		if (is_y4m) {
+			size_t header = parse_y4m_frame_header(file.data + pos, file.size - pos);
+			if (header==0) {
+				if (pos<file.size) std::cout<<"bad frame marker in y4m stream"<<std::endl;
+				return false;
+			}
+			pos += header;
+		}
+		if (pos + fmt.frame_size() > file.size) {
+			if (pos<file.size) std::cout<<"size bug in YUV frame"<<std::endl;
+			return false;
+		}
+
+		planes.fmt = fmt;
+		planes.plane[0] = file.data + pos;
+		planes.plane[1] = planes.plane[0] + fmt.luma_size();
+		planes.plane[2] = planes.plane[1] + fmt.chroma_size();
+		planes.stride[0] = fmt.W;
+		planes.stride[1] = planes.stride[2] = fmt.chroma_W();
+
+		// the previous frame is not needed anymore
+		if (cur_frame>0) file.release(prev_offset, offset-prev_offset);
+		prev_offset = offset;
+		offset = pos + fmt.frame_size();
+		cur_frame++;
+		return true;
+	}
 
 	bool get_next_frame(T* frame) {
 
-		CImg<unsigned char> tmp(W, H, 1, 3), UV(W/2, H/2, 1, 2);
-		tmp.fill(0);
-		bool stopflag = false;
+		YUVPlanes planes;
+		if (!get_next_planes(planes)) return false;
+		ProfileTimer timer(PROF_CONVERT);
+		yuv420_to_rgb(planes, frame, bilinear_chroma);
+		return true;
+	}
 
-		// *TRY* to read the luminance part, do not replace by cimg::fread !
-		int err = (int)std::fread((void*)(tmp._data), 1, (size_t)(tmp._width*tmp._height), FFG);
-		if (err!=(int)(tmp._width*tmp._height)) {
-			stopflag = true;
-			if (err>0) {
-				std::cout<<"size bug in YUV luminance"<<std::endl; 
-			}
-			
-		} else {
-			UV.fill(0);
-			// *TRY* to read the luminance part, do not replace by cimg::fread !
-			err = (int)std::fread((void*)(UV._data), 1, (size_t)(UV.size()), FFG);
-			if (err!=(int)(UV.size())) {
-				stopflag = true;
-				if (err>0) {
-					std::cout<<"size bug in YUV chrominance"<<std::endl;
-				}
-			} else {
-				cimg_forXY(UV, x, y) {
-					const int x2 = x*2, y2 = y*2;
-					tmp(x2, y2, 1) = tmp(x2+1, y2, 1) = tmp(x2, y2+1, 1) = tmp(x2+1, y2+1, 1) = UV(x, y, 0);
-					tmp(x2, y2, 2) = tmp(x2+1, y2, 2) = tmp(x2, y2+1, 2) = tmp(x2+1, y2+1, 2) = UV(x, y, 1);
-				}
-				tmp.YCbCrtoRGB();
+	bool get_next_frame_yuv420(T* frame) {
 
-				for (int j=0; j<W*H; j++) {
-					frame[j*3+0] = tmp[j]/255.;
-					frame[j*3+1] = tmp[j+W*H]/255.;
-					frame[j*3+2] = tmp[j+2*W*H]/255.;
-				}
-			}
-		}		
+		YUVPlanes planes;
+		if (!get_next_planes(planes)) return false;
+		ProfileTimer timer(PROF_CONVERT);
+		yuv420_to_planar(planes, frame);
+		return true;
+	}
+
+	bool skip_frames(int n) {
+		YUVPlanes planes;
+		for (int i=0; i<n; i++)
+			if (!get_next_planes(planes)) return false;
+		return true;
+	}
+
+	MappedFile file;
+	YUVFormat fmt;
+	bool is_y4m, bilinear_chroma;
+	size_t offset, prev_offset;
+};
+
+template<typename T>
+class VideoStreamerPipe: public VideoStreamer<T> {
+public:
+	// frames from a pipe ; the number of frames is not known in advance.
+	VideoStreamerPipe(std::shared_ptr<YUVPipeSource> source, bool bilinear_chroma = true) : source(source), bilinear_chroma(bilinear_chroma) {
+		cur_frame = 0;
+		this->W = source->fmt.W;
+		this->H = source->fmt.H;
+		nbframes = INT_MAX;
+	}
+
+	bool get_next_frame(T* frame) {
+
+		YUVPlanes planes;
+		if (!source->next_frame(planes)) return false;
+		ProfileTimer timer(PROF_CONVERT);
+		yuv420_to_rgb(planes, frame, bilinear_chroma);
 		cur_frame++;
-		return !stopflag;
+		return true;
 	}
 
-	~VideoStreamerYUV() {	
-		cimg::fclose(FFG);
-		
+	bool get_next_frame_yuv420(T* frame) {
+
+		YUVPlanes planes;
+		if (!source->next_frame(planes)) return false;
+		ProfileTimer timer(PROF_CONVERT);
+		yuv420_to_planar(planes, frame);
+		cur_frame++;
+		return true;
 	}
 
-	std::FILE* FFG;
+	bool skip_frames(int n) {
+		YUVPlanes planes;
+		for (int i=0; i<n; i++) {
+			if (!source->next_frame(planes)) return false;
+			cur_frame++;
+		}
+		return true;
+	}
 
+	std::shared_ptr<YUVPipeSource> source;
+	bool bilinear_chroma;
 };
 
 template<typename T>
@@ -285,8 +455,11 @@ public:
 		unsigned int nrb;
 		double time;
 		FFG->getVideoFrame(0, cur_frame, &tmp, &nrb, &time);
-		for (int k=0; k<W*H*3; k++) {
-			frame[k] = (T)tmp[k] / 255.;
+		{
+			ProfileTimer timer(PROF_CONVERT);
+			for (int k=0; k<W*H*3; k++) {
+				frame[k] = (T)tmp[k] / 255.;
+			}
 		}
 		delete[] tmp;
 		
@@ -294,8 +467,13 @@ public:
 		return (cur_frame<nbframes);
 	}
 
+	bool skip_frames(int n) { // frames are decoded by index
+		cur_frame += n;
+		return (cur_frame<nbframes);
+	}
+
 	~VideoStreamerMPG() {
-		delete FFG[i];
+		delete FFG;
 	}
 
 	FFGrabber* FFG;
@@ -820,78 +998,220 @@ void writeVideo(const char* filename, double scaleValues, size_t W, size_t H, si
 		 av_free(video_outbuf);
 }
 
+struct EncoderOptions {
+	EncoderOptions() : threads(0), slices(0), crf(-1), lookahead(-1), queue_depth(8) {}
+	int threads;         // encoder threads, 0 : the scheduler budget (--threads)
+	int slices;          // slices per frame, 0 : encoder default
+	float crf;           // x264 constant quality (e.g. 18), -1 : bitrate based
+	int lookahead;       // x264 rc-lookahead in frames, -1 : preset default
+	std::string preset;  // x264 preset (ultrafast ... veryslow), empty : medium
+	int queue_depth;     // frames waiting for the encoder thread
+};
+
 template<typename T>
 class VideoRecorder {
 public:
 	VideoRecorder() {};
+	virtual ~VideoRecorder() {};
 	virtual void addFrame(const T* frame) = 0;
+	// planar 4:2:0 frame of W x H pixels (see YUVIO.h) ; converted to RGB unless the output is 4:2:0.
+	virtual void addFrameYUV420(const T* frame, int W, int H) {
+		std::vector<T> rgb(W*H*3);
+		{
+			ProfileTimer timer(PROF_CONVERT);
+			planar420_to_rgb(frame, W, H, &rgb[0]);
+		}
+		addFrame(&rgb[0]);
+	}
 	virtual void finalize_video() = 0;
+	// makes the frames added so far persistent (before a checkpoint).
+	virtual void sync() {}
+	// some frames could not be written : the output is incomplete.
+	virtual bool failed() const { return false; }
 };
 
 template<typename T>
 class VideoRecorderImage: public VideoRecorder<T> {
 public:
 
-	VideoRecorderImage(const char* filename, size_t W, size_t H) {
+	// filename : first file name (numbers are incremented for each frame) or a printf-style pattern ("out_%05d.png").
+	// images are encoded in process, on the scheduler ; at most 'max_queued' frames wait for encoding.
+	// .pfm outputs keep the full float precision. first_frame : number of the first image written (resuming a run).
+	VideoRecorderImage(const char* filename, size_t W, size_t H, int max_queued = 8, const ImageEncodeOptions &opts = ImageEncodeOptions(), int first_frame = 0) {
+		avcodec_register_all();
 		this->W = W;
 		this->H = H;
 		this->filename = std::string(filename);
+		this->opts = opts;
+		this->max_queued = std::max(1, max_queued);
+		nb_frames = 0;
+		write_failed = false;
+		std::string ext = this->filename.substr(this->filename.find_last_of(".")+1);
+		is_pfm = (ext=="pfm" || ext=="PFM");
+		while (nb_frames<first_frame) {
+			next_filename();
+			nb_frames++;
+		}
 	}
 	void addFrame(const T* frame) {
 
-		std::vector<unsigned char> deinterleaved(W*H * 3);
-		for (int i = 0; i < W*H; i++) {
-			deinterleaved[i] = min(255., max(0., frame[i*3]*255.));
-			deinterleaved[i + W*H] = min(255., max(0., frame[i*3+1]*255.));
-			deinterleaved[i + 2 * W*H] = min(255., max(0., frame[i*3+2]*255.));
+		while ((int)pending.size() >= max_queued) wait_oldest();
+
+		std::string name = next_filename();
+		const int n = (int)(W*H*3);
+		const int w = (int)W, h = (int)H;
+		if (is_pfm) {
+			std::shared_ptr<std::vector<float> > data(new std::vector<float>(frame, frame+n));
+			pending.push_back(Scheduler::instance().enqueue([name, data, w, h]() { return write_pfm(name, &(*data)[0], w, h); }, STAGE_ENCODE));
+		} else {
+			std::shared_ptr<std::vector<unsigned char> > data(new std::vector<unsigned char>(n));
+			unsigned char* rgb = &(*data)[0];
+			{
+				ProfileTimer timer(PROF_CONVERT);
+				Scheduler::instance().parallel_for(0, n, [&](int i) {
+					rgb[i] = (unsigned char)(min(255., max(0., frame[i]*255.)));
+				}, STAGE_ENCODE);
+			}
+			ImageEncodeOptions o = opts;
+			pending.push_back(Scheduler::instance().enqueue([name, data, w, h, o]() { return encode_image(name, &(*data)[0], w, h, o); }, STAGE_ENCODE));
 		}
-		cimg_library::CImg<unsigned char> cimg(&deinterleaved[0], W, H, 1, 3);
-		cimg.save(filename.c_str());
-		increment_file_number(filename);
+		nb_frames++;
 	}
 	void finalize_video() {
-
+		while (!pending.empty()) wait_oldest();
+	}
+	void sync() {
+		finalize_video();
+	}
+	bool failed() const {
+		return write_failed;
 	}
 	~VideoRecorderImage() {
+		finalize_video();
 	}
 
 	size_t W, H;
 	std::string filename;
+	ImageEncodeOptions opts;
+	int max_queued, nb_frames;
+	bool is_pfm, write_failed;
+
+private:
+	std::string next_filename() {
+		if (filename.find('%')!=std::string::npos) {
+			char name[4096];
+			snprintf(name, sizeof(name), filename.c_str(), nb_frames);
+			return std::string(name);
+		}
+		std::string name = filename;
+		increment_file_number(filename);
+		return name;
+	}
+	void wait_oldest() {
+		if (!pending.front().get()) {
+			std::cout<<"failed to write frame "<<nb_frames-(int)pending.size()<<std::endl;
+			write_failed = true;
+		}
+		pending.pop_front();
+	}
+
+	std::deque<std::future<bool> > pending;
 };
 
 template<typename T>
 class VideoRecorderYUV: public VideoRecorder<T> {
 public:
 
-	VideoRecorderYUV(const char* filename, size_t W, size_t H) {
+	// writes raw I420 (.yuv) or YUV4MPEG2 (.y4m, chosen by extension). bitdepth > 8 writes 16 bit little-endian samples (e.g. yuv420p10le).
+	// first_frame > 0 : appends to an existing output, after its first 'first_frame' frames (resuming a run).
+	VideoRecorderYUV(const char* filename, size_t W, size_t H, int bitdepth = 8, int fps_num = 25, int fps_den = 1, bool direct_io = false, int first_frame = 0) {
 		this->W = W;
 		this->H = H;
 		this->filename = std::string(filename);
-		f = cimg::fopen(filename, "wb");
-		fclose(f);
+		fmt.W = (int)W;
+		fmt.H = (int)H;
+		fmt.bitdepth = bitdepth;
+		fmt.fps_num = fps_num;
+		fmt.fps_den = fps_den;
+
+		std::string ext = this->filename.substr(this->filename.find_last_of(".")+1);
+		is_y4m = (ext.find("y4m")!=std::string::npos);
+
+		// room for a few frames, so that the OS gets large writes
+		size_t bufsize = std::max((size_t)32<<20, 4*(fmt.frame_size()+16));
+		if (first_frame>0) {
+			size_t marker = is_y4m ? strlen(Y4M_FRAME_MAGIC)+1 : 0;
+			long long size = (is_y4m ? (long long)y4m_header(fmt).size() : 0) + (long long)first_frame*(marker + fmt.frame_size());
+			if (!truncate_file(filename, size)) {
+				std::cout<<"cannot resume "<<filename<<" after frame "<<first_frame<<" (missing or too short)"<<std::endl;
+				return;
+			}
+			out.open(filename, bufsize, direct_io, true);
+			return;
+		}
+		if (out.open(filename, bufsize, direct_io) && is_y4m)
+			out.write(y4m_header(fmt).c_str(), y4m_header(fmt).size());
+	}
+	// same, to an open descriptor (pipe, stdout) ; the buffer only holds a couple of frames.
+	VideoRecorderYUV(int fd, size_t W, size_t H, bool y4m, int bitdepth = 8, int fps_num = 25, int fps_den = 1) {
+		this->W = W;
+		this->H = H;
+		this->filename = "pipe";
+		fmt.W = (int)W;
+		fmt.H = (int)H;
+		fmt.bitdepth = bitdepth;
+		fmt.fps_num = fps_num;
+		fmt.fps_den = fps_den;
+		is_y4m = y4m;
+
+		if (out.open_fd(fd, 2*(fmt.frame_size()+16)) && is_y4m)
+			out.write(y4m_header(fmt).c_str(), y4m_header(fmt).size());
 	}
 	void addFrame(const T* frame) {
 
-		CImg<unsigned char> YCbCr(W, H, 1, 3);
-		for (int i=0; i<W*H; i++) {
-			YCbCr[i] = min(255., max(0., frame[i*3]*255.));
-			YCbCr[i+W*H] = min(255., max(0., frame[i*3+1]*255.));
-			YCbCr[i+W*H*2] = min(255., max(0., frame[i*3+2]*255.));
+		if (!out.is_open() || out.failed()) return;
+		const size_t marker = is_y4m ? strlen(Y4M_FRAME_MAGIC)+1 : 0;
+		unsigned char* dst = out.reserve(marker + fmt.frame_size());
+		if (is_y4m) {
+			memcpy(dst, Y4M_FRAME_MAGIC "\n", marker);
+		}
+		{
+			ProfileTimer timer(PROF_CONVERT);
+			rgb_to_yuv420(frame, fmt, dst + marker);
+		}
+		out.commit(marker + fmt.frame_size());
+	}
+	void addFrameYUV420(const T* frame, int, int) { // the size is the one of the output format
+
+		if (!out.is_open() || out.failed()) return;
+		const size_t marker = is_y4m ? strlen(Y4M_FRAME_MAGIC)+1 : 0;
+		unsigned char* dst = out.reserve(marker + fmt.frame_size());
+		if (is_y4m) {
+			memcpy(dst, Y4M_FRAME_MAGIC "\n", marker);
+		}
+		{
+			ProfileTimer timer(PROF_CONVERT);
+			planar_to_yuv420(frame, fmt, dst + marker);
 		}
-		YCbCr.RGBtoYCbCr();
-		f = cimg::fopen(filename.c_str(), "a+b");
-		cimg::fwrite(YCbCr._data, YCbCr._width*YCbCr._height, f);
-		cimg::fwrite(YCbCr.get_resize(YCbCr._width/2, YCbCr._height/2, 1, 3, 3).data(0, 0, 0, 1), YCbCr._width*YCbCr._height/2, f);
-		cimg::fclose(f);
+		out.commit(marker + fmt.frame_size());
 	}
 	void finalize_video() {
-		
+		out.close();
+	}
+	void sync() {
+		out.sync();
+	}
+	bool failed() const {
+		return out.failed();
 	}
 	~VideoRecorderYUV() {
+		out.close();
 	}
 
 	size_t W, H;
-	std::FILE* f;
+	YUVFormat fmt;
+	bool is_y4m;
+	BufferedWriter out;
 	std::string filename;
 };
 
@@ -917,8 +1237,13 @@ public:
 	int codec_id;
 	AVFormatContext *oc;
 
-	VideoRecorderMPG(const char* filename, size_t W, size_t H, int pcodec_id = 2) {
+	VideoRecorderMPG(const char* filename, size_t W, size_t H, int pcodec_id = 2, const EncoderOptions &options = EncoderOptions()) {
 		codec_id = pcodec_id;
+		this->options = options;
+		encoder_running = false;
+		write_failed = false;
+		finalized = false;
+		img_convert_context = 0;
 		nb_recorded_frames = 0;
 		std::cout << "using codec " << codec_id << std::endl;
 
@@ -1067,6 +1392,10 @@ public:
 			c->flags2 |= CODEC_FLAG2_SKIP_RD;
 		}
 
+		// encoder threading (frame threads + lookahead for x264, slice threads for the native encoders)
+		c->thread_count = options.threads>0 ? options.threads : Scheduler::instance().size();
+		if (options.slices>0) c->slices = options.slices;
+
 
 
 		/*if (av_set_parameters(oc,0)<0) { // Parameters not properly set.
@@ -1126,10 +1455,27 @@ public:
 		}
 		std::cout << c->time_base.num << "  " << c->time_base.den << std::endl;
 
-		if (avcodec_open2(c, codec, NULL) < 0) { // Failed to open codec. 
+		if (c->codec_id == AV_CODEC_ID_H264 && c->priv_data) {
+			if (!options.preset.empty()) av_opt_set(c->priv_data, "preset", options.preset.c_str(), 0);
+			if (options.crf>=0) {
+				av_opt_set_double(c->priv_data, "crf", options.crf, 0);
+				c->bit_rate = 0;
+				c->qmin = -1; // let crf choose the quantizers
+				c->qmax = -1;
+			}
+			if (options.lookahead>=0) av_opt_set_int(c->priv_data, "rc-lookahead", options.lookahead, 0);
+		}
+
+		int open_err;
+		{
+			std::lock_guard<std::mutex> lock(avcodec_open_mutex());
+			open_err = avcodec_open2(c, codec, NULL);
+		}
+		if (open_err < 0) { // Failed to open codec. 
 			std::cout << "save_ffmpeg() : Failed to open codec for file " << filename << std::endl;
 			return;
 		}
+		std::cout << "encoder threads: " << c->thread_count << ", slices: " << c->slices << std::endl;
 
 		tmp_pict = avcodec_alloc_frame();
 		if (!tmp_pict) { // Failed to allocate memory for tmp_pict frame.
@@ -1226,17 +1572,71 @@ public:
 	uint8_t *video_outbuf;
 	int video_outbuf_size;
 
+	// conversion to 8 bit BGR happens on the caller's thread ; scaling, encoding and muxing run on the encoder thread,
+	// with at most options.queue_depth frames waiting.
 	void addFrame(const T* frame) {
 
-		double video_pts;
-		std::vector<unsigned char> resized_frame(initial_W* initial_H * 3);
-		for (int i=0; i<initial_W*initial_H*3; i++) {
-			resized_frame[i] = min(255., max(0., frame[i]*255.));
+		if (!img_convert_context || write_failed) return;
+		if (!encoder_running) {
+			encoder_running = true;
+			encoder_thread = std::thread(&VideoRecorderMPG<T>::encoder_loop, this);
 		}
-		for (int i=0; i<initial_W*initial_H; i++) {
-			std::swap(resized_frame[i*3], resized_frame[i*3+2]);
+
+		std::vector<unsigned char> bgr;
+		{
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			while ((int)queue.size() >= std::max(1, options.queue_depth)) queue_cond.wait(lock);
+			if (!free_buffers.empty()) {
+				bgr.swap(free_buffers.back());
+				free_buffers.pop_back();
+			}
 		}
-		
+
+		const int n = (int)(initial_W*initial_H);
+		bgr.resize(n*3);
+		unsigned char* dst = &bgr[0];
+		{
+			ProfileTimer timer(PROF_CONVERT);
+			Scheduler::instance().parallel_for(0, n, [&](int i) {
+				dst[i*3] = min(255., max(0., frame[i*3+2]*255.));
+				dst[i*3+1] = min(255., max(0., frame[i*3+1]*255.));
+				dst[i*3+2] = min(255., max(0., frame[i*3]*255.));
+			}, STAGE_ENCODE);
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			queue.push_back(std::vector<unsigned char>());
+			queue.back().swap(bgr);
+		}
+		queue_cond.notify_all();
+	}
+
+	EncoderOptions options;
+
+private:
+	void encoder_loop() {
+		for (;;) {
+			std::vector<unsigned char> resized_frame;
+			{
+				std::unique_lock<std::mutex> lock(queue_mutex);
+				while (queue.empty() && encoder_running) queue_cond.wait(lock);
+				if (queue.empty()) return;
+				resized_frame.swap(queue.front());
+				queue.pop_front();
+			}
+			queue_cond.notify_all();
+
+			encode_frame(resized_frame);
+
+			std::unique_lock<std::mutex> lock(queue_mutex);
+			free_buffers.push_back(std::vector<unsigned char>());
+			free_buffers.back().swap(resized_frame);
+		}
+	}
+
+	void encode_frame(std::vector<unsigned char> &resized_frame) {
+
 		new_W = initial_W;
 		new_H = initial_H;
 
@@ -1260,33 +1660,77 @@ public:
 
 		tmp_pict->data[0] = &resized_frame[0];
 
-		if (video_str) video_pts = (video_str->pts.val * video_str->time_base.num) / (video_str->time_base.den);
-		else video_pts = 0.0;
-		if (!video_str) return;
-
-		if (sws_scale(img_convert_context, tmp_pict->data, tmp_pict->linesize, 0, c->height, picture->data, picture->linesize)<0) return;
-		int out_size = avcodec_encode_video(c, video_outbuf, video_outbuf_size, picture);
-		int ret = 0;
-		if (out_size>0) {
-			AVPacket pkt;
-			av_init_packet(&pkt);
-			pkt.pts = av_rescale_q(c->coded_frame->pts, c->time_base, video_str->time_base);
-
-			if (c->coded_frame->key_frame) pkt.flags |= AV_PKT_FLAG_KEY;
-			pkt.stream_index = video_str->index;
-			pkt.data = video_outbuf;
-			pkt.size = out_size;
-			ret = av_write_frame(oc, &pkt);
+		if (!video_str || sws_scale(img_convert_context, tmp_pict->data, tmp_pict->linesize, 0, c->height, picture->data, picture->linesize)<0) {
+			fail("conversion");
+			return;
+		}
+		picture->pts = nb_recorded_frames;
+		if (write_packet(picture)<0) {
+			fail("encoding or writing");
+			return;
 		}
-		else if (out_size < 0) return;
-		if (ret) return; // Error occured in writing frame.
 
 		nb_recorded_frames++;
+	}
+
+	// the first error is reported ; the following frames are dropped
+	void fail(const char* what) {
+		if (!write_failed) std::cout << "video output : " << what << " of frame " << nb_recorded_frames << " failed" << std::endl;
+		write_failed = true;
+	}
 
+	// encodes a frame (or flushes delayed frames when picture is NULL) ; returns 1 if a packet was written.
+	int write_packet(AVFrame* pict) {
+		AVPacket pkt;
+		av_init_packet(&pkt);
+		pkt.data = NULL; // allocated by the encoder
+		pkt.size = 0;
+		int got_packet = 0;
+		if (avcodec_encode_video2(c, &pkt, pict, &got_packet)<0) return -1;
+		if (!got_packet) return 0;
+		if (pkt.pts != AV_NOPTS_VALUE) pkt.pts = av_rescale_q(pkt.pts, c->time_base, video_str->time_base);
+		if (pkt.dts != AV_NOPTS_VALUE) pkt.dts = av_rescale_q(pkt.dts, c->time_base, video_str->time_base);
+		pkt.stream_index = video_str->index;
+		int ret = av_write_frame(oc, &pkt);
+		av_free_packet(&pkt);
+		return ret<0 ? -1 : 1;
 	}
 
+	bool encoder_running, finalized;
+	std::atomic<bool> write_failed; // set by the encoder thread
+	std::thread encoder_thread;
+	std::deque<std::vector<unsigned char> > queue, free_buffers;
+	std::mutex queue_mutex;
+	std::condition_variable queue_cond;
+
+public:
+
+	~VideoRecorderMPG() {
+		finalize_video();
+	}
+
+	// an encoder that could not be opened, or a frame that could not be encoded or written
+	bool failed() const {
+		return !img_convert_context || write_failed;
+	}
 
 	void finalize_video() {
+		if (finalized) return;
+		finalized = true;
+		if (encoder_running) {
+			{
+				std::unique_lock<std::mutex> lock(queue_mutex);
+				encoder_running = false;
+			}
+			queue_cond.notify_all();
+			encoder_thread.join();
+		}
+		// frames delayed by the encoder (B-frames, lookahead, frame threads)
+		if (img_convert_context && !write_failed && (codec->capabilities & CODEC_CAP_DELAY)) {
+			int ret;
+			while ((ret = write_packet(NULL))>0);
+			if (ret<0) fail("flushing");
+		}
 #if 0   // should work, but it practice, makes everything crash ; so our files will probably be corrupted.
 		// Close codec.
 		if (video_str) {
@@ -0,0 +1,197 @@
+// Job server : a long-running process that handles the jobs dropped in a spool directory, several at a time.
+// A job is a text file "<name>.job" holding the arguments of one run, as given to the command line (positional arguments, then options).
+// The server claims it by renaming it to <name>.running, then renames it to <name>.done or <name>.failed ;
+// <name>.progress holds the number of frames written and the number of frames of the job.
+// All jobs share the server's thread budget : each one runs with threads/max_jobs OpenMP threads.
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <future>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <cstdio>
+#include <omp.h>
+#include "ThreadPool.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+
+struct JobStatus {
+	JobStatus() : frame(0), nbframes(0), threads(0) {}
+	std::atomic<int> frame, nbframes;
+	int threads; // share of the thread budget of the job (0 : all of it)
+};
+
+// runs one job ; argv[0] is the program name. status may be NULL.
+typedef std::function<int(int argc, const char* argv[], JobStatus* status)> JobFunction;
+
+// splits a job line into arguments ; double quotes group arguments with spaces.
+inline std::vector<std::string> split_command_line(const std::string &line) {
+	std::vector<std::string> args;
+	std::string cur;
+	bool quoted = false, has_arg = false;
+	for (size_t i=0; i<line.size(); i++) {
+		char c = line[i];
+		if (c=='"') {
+			quoted = !quoted;
+			has_arg = true;
+		} else if (!quoted && (c==' ' || c=='\t' || c=='\r' || c=='\n')) {
+			if (has_arg) args.push_back(cur);
+			cur.clear();
+			has_arg = false;
+		} else {
+			cur += c;
+			has_arg = true;
+		}
+	}
+	if (has_arg) args.push_back(cur);
+	return args;
+}
+
+// names (without directory) of the files of 'dir' ending with 'ext', sorted.
+inline std::vector<std::string> list_files(const std::string &dir, const std::string &ext) {
+	std::vector<std::string> files;
+#ifdef _WIN32
+	WIN32_FIND_DATAA fd;
+	HANDLE h = FindFirstFileA((dir + "\\*" + ext).c_str(), &fd);
+	if (h!=INVALID_HANDLE_VALUE) {
+		do {
+			if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) files.push_back(fd.cFileName);
+		} while (FindNextFileA(h, &fd));
+		FindClose(h);
+	}
+#else
+	DIR* d = opendir(dir.c_str());
+	if (d) {
+		while (struct dirent* e = readdir(d)) {
+			std::string name(e->d_name);
+			if (name.size()>ext.size() && name.compare(name.size()-ext.size(), ext.size(), ext)==0) files.push_back(name);
+		}
+		closedir(d);
+	}
+#endif
+	std::sort(files.begin(), files.end());
+	return files;
+}
+
+
+class JobServer {
+public:
+	// threads : total OpenMP thread budget shared by the max_jobs concurrent jobs.
+	JobServer(const std::string &spool_dir, int max_jobs, int threads, JobFunction run) : spool_dir(spool_dir), run(run) {
+		this->max_jobs = std::max(1, max_jobs);
+		threads_per_job = std::max(1, threads/this->max_jobs);
+	}
+
+	// polls the spool directory every poll_ms milliseconds ; returns when it is empty if exit_when_idle is set.
+	void serve(int poll_ms = 500, bool exit_when_idle = false) {
+
+		ThreadPool pool(max_jobs);
+		std::cout<<"serving jobs from "<<spool_dir<<" : "<<max_jobs<<" concurrent jobs, "<<threads_per_job<<" threads each"<<std::endl;
+
+		for (;;) {
+			// finished jobs
+			for (std::map<std::string, std::shared_ptr<RunningJob> >::iterator it = running.begin(); it!=running.end();) {
+				RunningJob &job = *it->second;
+				if (job.result.wait_for(std::chrono::seconds(0))!=std::future_status::ready) {
+					write_progress(it->first, job);
+					++it;
+					continue;
+				}
+				int ret = job.result.get();
+				write_progress(it->first, job);
+				std::rename(path(it->first, ".running").c_str(), path(it->first, ret==0 ? ".done" : ".failed").c_str());
+				std::cout<<"job "<<it->first<<(ret==0 ? " done" : " failed")<<std::endl;
+				running.erase(it++);
+			}
+
+			// new jobs
+			std::vector<std::string> jobs = list_files(spool_dir, ".job");
+			for (size_t i=0; i<jobs.size() && (int)running.size()<max_jobs; i++) {
+				std::string name = jobs[i].substr(0, jobs[i].size()-4);
+				if (running.count(name)) continue;
+				// the rename claims the job, in case several servers share the spool directory
+				if (std::rename(path(name, ".job").c_str(), path(name, ".running").c_str())!=0) continue;
+				start(pool, name);
+			}
+
+			if (exit_when_idle && running.empty() && list_files(spool_dir, ".job").empty()) break;
+			std::this_thread::sleep_for(std::chrono::milliseconds(poll_ms));
+		}
+	}
+
+private:
+	struct RunningJob {
+		RunningJob() : last_written(-1) {}
+		JobStatus status;
+		std::future<int> result;
+		int last_written;
+	};
+
+	std::string path(const std::string &name, const char* ext) const {
+#ifdef _WIN32
+		return spool_dir + "\\" + name + ext;
+#else
+		return spool_dir + "/" + name + ext;
+#endif
+	}
+
+	void start(ThreadPool &pool, const std::string &name) {
+
+		std::ifstream f(path(name, ".running").c_str());
+		std::string line, all;
+		while (std::getline(f, line)) all += line + " ";
+		std::vector<std::string> args = split_command_line(all);
+		args.insert(args.begin(), std::string("stabilize"));
+
+		std::shared_ptr<RunningJob> job(new RunningJob());
+		JobFunction run = this->run;
+		int nthreads = threads_per_job;
+		JobStatus* status = &job->status;
+		status->threads = nthreads;
+		job->result = pool.enqueue([args, run, nthreads, status]() -> int {
+			omp_set_num_threads(nthreads);
+			std::vector<const char*> argv(args.size());
+			for (size_t i=0; i<args.size(); i++) argv[i] = args[i].c_str();
+			if (args.size()<6) {
+				std::cout<<"job needs at least 5 arguments"<<std::endl;
+				return 1;
+			}
+			return run((int)argv.size(), &argv[0], status);
+		});
+		running[name] = job;
+		std::cout<<"job "<<name<<" started"<<std::endl;
+	}
+
+	void write_progress(const std::string &name, RunningJob &job) {
+		int frame = job.status.frame;
+		if (frame==job.last_written) return;
+		std::ofstream f(path(name, ".progress").c_str());
+		f<<frame<<" "<<job.status.nbframes<<std::endl;
+		job.last_written = frame;
+	}
+
+	std::string spool_dir;
+	int max_jobs, threads_per_job;
+	JobFunction run;
+	std::map<std::string, std::shared_ptr<RunningJob> > running;
+};
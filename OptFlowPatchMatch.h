@@ -1,15 +1,30 @@
 #pragma once
 
-#include "patchmatch\nn.h"
+#include "patchmatch/nn.h"
+#include "Profiler.h"
+#include "ThreadPool.h"
 
+// seed : key of the random streams of the search (e.g. the frame index) ; the field only depends on it and the images,
+// not on the number of threads (except with ALGO_CPUTILED, whose tiles follow p.cores).
+// nthreads : OpenMP team of the search (0 : the whole scheduler budget) ; these threads are reserved from the scheduler
+// while it runs, so that the search and the scheduler tasks stay within the budget.
 template<typename T, typename Tflow>
-void opt_flow_patchmatch(const T* imgA, const T* imgB, int W, int H, Tflow* optflow) { // images in the range 0..1
+void opt_flow_patchmatch(const T* imgA, const T* imgB, int W, int H, Tflow* optflow, int nn_iters = 5, int patch_w = 7, int algo = ALGO_CPU, unsigned int seed = 0, int nthreads = 0) { // images in the range 0..1
 
 	Params p;
 	RecomposeParams rp;
+	if (nthreads<=0) nthreads = Scheduler::instance().size();
+	ThreadReservation reservation(nthreads);
+	const int previous_threads = omp_get_max_threads(); // init_params overwrites the calling thread's OpenMP settings
 	init_params(&p);
-	p.cores = omp_get_max_threads();
+	p.cores = nthreads;
+	p.nn_iters = nn_iters;
+	p.patch_w = patch_w;
+	p.algo = algo;
+	p.seed = seed;
+	omp_set_num_threads(nthreads);
 
+	ProfileTimer init_timer(PROF_FLOW_INIT);
 	PATCHBITMAP* a = create_bitmap(W, H);
 	PATCHBITMAP* b = create_bitmap(W, H);
 
@@ -36,8 +51,14 @@ void opt_flow_patchmatch(const T* imgA, const T* imgB, int W, int H, Tflow* optf
 
 	
 	PATCHBITMAP *annd = init_dist(&p, a, b, ann, NULL, NULL, NULL);
-	nn(&p, a, b, ann, annd, NULL, NULL, 0, 0, &rp, 0, 0, 0, NULL, p.cores, NULL, NULL); 
+	{
+		ProfileTimer search_timer(PROF_FLOW_SEARCH);
+		nn(&p, a, b, ann, annd, NULL, NULL, 0, 0, &rp, 0, 0, 0, NULL, p.cores, NULL, NULL); 
+	}
 	annd_final = annd;
+	Profiler::instance().add_count(PROF_PATCH_DIST_INIT, p.evals_init);
+	Profiler::instance().add_count(PROF_PATCH_DIST_PROPAGATE, p.evals_propagate);
+	Profiler::instance().add_count(PROF_PATCH_DIST_SEARCH, p.evals_search);
 
 	for (int y = 0; y < H; y++) {
 		int *ann_row = (int *) ann->line[y];
@@ -54,5 +75,5 @@ void opt_flow_patchmatch(const T* imgA, const T* imgB, int W, int H, Tflow* optf
 	destroy_bitmap(ann);
 	destroy_bitmap(ann_sim_final);
 	destroy_bitmap(annd);
-
+	omp_set_num_threads(previous_threads);
 }
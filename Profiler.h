@@ -0,0 +1,213 @@
+// Per-stage timing and counters (--profile file.jsonl|file.csv, --profile-summary 1).
+// ProfileTimer measures a scope ; timers are exclusive : the time of a nested timer is only counted in its own stage.
+// Samples go to the frame set with ProfileFrame on the calling thread (-1 : not attributed to a frame, only in the totals).
+// A frame record is written once the frame is encoded (frame_done) ; the summary adds up all samples.
+// When profiling is off, a timer costs one test.
+
+#pragma once
+
+#include <vector>
+#include <map>
+#include <string>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+#ifdef _MSC_VER
+#define PROFILER_TLS __declspec(thread)
+#else
+#define PROFILER_TLS __thread
+#endif
+
+#define PROFILE_MAX_LEVELS 8
+
+class ProfileTimer;
+
+enum ProfileStage {
+	PROF_DECODE, PROF_CONVERT, PROF_FLOW_INIT, PROF_FLOW_SEARCH, PROF_RHS,
+	PROF_SOLVE_LEVEL0, // + pyramid level (0 : full resolution)
+	PROF_ENCODE = PROF_SOLVE_LEVEL0 + PROFILE_MAX_LEVELS,
+	NB_PROFILE_STAGES
+};
+
+enum ProfileCounter {
+	PROF_PATCH_DIST_INIT, PROF_PATCH_DIST_PROPAGATE, PROF_PATCH_DIST_SEARCH, // patch distances (propagation ones are incremental)
+	PROF_SOLVER_SWEEPS, PROF_SOLVER_PIXELS,                                 // solver passes, and pixels updated by them
+	PROF_WINDOW_SOLVES, PROF_WINDOW_RESIDUAL_PPM,                           // window solves, and their final relative residuals (1e-6 units, summed)
+	NB_PROFILE_COUNTERS
+};
+
+class Profiler {
+public:
+	static Profiler& instance() {
+		static Profiler p;
+		return p;
+	}
+
+	// filename : per-frame records, CSV if it ends with ".csv", JSON lines otherwise ; empty for the summary only.
+	void enable(const std::string &filename) {
+		std::lock_guard<std::mutex> lock(mutex);
+		enabled = true;
+		start = std::chrono::high_resolution_clock::now();
+		if (filename.empty()) return;
+		csv = filename.size()>4 && filename.compare(filename.size()-4, 4, ".csv")==0;
+		out.open(filename.c_str());
+		if (!out) std::cout<<"cannot open "<<filename<<std::endl;
+		else if (csv) {
+			out<<"frame";
+			for (int i=0; i<NB_PROFILE_STAGES; i++) out<<","<<stage_name(i)<<"_ms";
+			for (int i=0; i<NB_PROFILE_COUNTERS; i++) out<<","<<counter_name(i);
+			out<<"\n";
+		}
+	}
+
+	bool is_enabled() const { return enabled; }
+
+	void add_time(int stage, double ms) {
+		std::lock_guard<std::mutex> lock(mutex);
+		int f = current_frame();
+		total.ms[stage] += ms;
+		if (f>=0) frames[f].ms[stage] += ms;
+	}
+
+	void add_count(int counter, long long n) {
+		if (!enabled) return;
+		std::lock_guard<std::mutex> lock(mutex);
+		int f = current_frame();
+		total.counts[counter] += n;
+		if (f>=0) frames[f].counts[counter] += n;
+	}
+
+	// frame 'f' went through all stages : its record is written and released.
+	void frame_done(int f) {
+		if (!enabled) return;
+		std::lock_guard<std::mutex> lock(mutex);
+		nb_frames++;
+		std::map<int, Record>::iterator it = frames.find(f);
+		if (it==frames.end()) return;
+		if (out.is_open()) write_record(f, it->second);
+		frames.erase(it);
+	}
+
+	void print_summary(std::ostream &os) {
+		std::lock_guard<std::mutex> lock(mutex);
+		double wall = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		double busy = 0;
+		for (int i=0; i<NB_PROFILE_STAGES; i++) busy += total.ms[i];
+		os<<"profile: "<<nb_frames<<" frames in "<<wall/1000.<<" s ("<<(wall>0 ? nb_frames*1000./wall : 0.)<<" fps)"<<std::endl;
+		for (int i=0; i<NB_PROFILE_STAGES; i++) {
+			if (total.ms[i]==0) continue;
+			os<<"  "<<std::setw(22)<<std::left<<stage_name(i)<<std::right<<std::setw(12)<<std::fixed<<std::setprecision(1)<<total.ms[i]<<" ms "
+				<<std::setw(6)<<100.*total.ms[i]/std::max(busy, 1e-9)<<" %  "<<(nb_frames ? total.ms[i]/nb_frames : 0.)<<" ms/frame"<<std::endl;
+		}
+		os.unsetf(std::ios::fixed);
+		for (int i=0; i<NB_PROFILE_COUNTERS; i++)
+			if (total.counts[i]) os<<"  "<<std::setw(22)<<std::left<<counter_name(i)<<std::right<<std::setw(12)<<total.counts[i]<<std::endl;
+		os<<std::setprecision(6);
+		if (out.is_open() && !csv) {
+			out<<"{\"summary\":{\"frames\":"<<nb_frames<<",\"wall_ms\":"<<wall;
+			write_fields(total);
+			out<<"}}\n";
+		}
+		out.flush();
+	}
+
+	static const char* stage_name(int stage) {
+		static const char* names[NB_PROFILE_STAGES] = { "decode", "convert", "flow_init", "flow_search", "rhs",
+			"solve_l0", "solve_l1", "solve_l2", "solve_l3", "solve_l4", "solve_l5", "solve_l6", "solve_l7", "encode" };
+		return names[stage];
+	}
+	static const char* counter_name(int counter) {
+		static const char* names[NB_PROFILE_COUNTERS] = { "patch_dist_init", "patch_dist_propagate", "patch_dist_search", "solver_sweeps", "solver_pixels",
+			"window_solves", "window_residual_ppm" };
+		return names[counter];
+	}
+
+	// frame of the calling thread
+	static int& current_frame() { static PROFILER_TLS int frame = -1; return frame; }
+	// innermost running timer of the calling thread
+	static ProfileTimer*& current_timer() { static PROFILER_TLS ProfileTimer* timer = NULL; return timer; }
+
+private:
+	struct Record {
+		Record() {
+			std::fill(ms, ms+NB_PROFILE_STAGES, 0.);
+			std::fill(counts, counts+NB_PROFILE_COUNTERS, 0LL);
+		}
+		double ms[NB_PROFILE_STAGES];
+		long long counts[NB_PROFILE_COUNTERS];
+	};
+
+	Profiler() : enabled(false), csv(false), nb_frames(0) {}
+
+	void write_fields(const Record &r) {
+		for (int i=0; i<NB_PROFILE_STAGES; i++) out<<",\""<<stage_name(i)<<"_ms\":"<<r.ms[i];
+		for (int i=0; i<NB_PROFILE_COUNTERS; i++) out<<",\""<<counter_name(i)<<"\":"<<r.counts[i];
+	}
+
+	void write_record(int f, const Record &r) {
+		if (csv) {
+			out<<f;
+			for (int i=0; i<NB_PROFILE_STAGES; i++) out<<","<<r.ms[i];
+			for (int i=0; i<NB_PROFILE_COUNTERS; i++) out<<","<<r.counts[i];
+			out<<"\n";
+		} else {
+			out<<"{\"frame\":"<<f;
+			write_fields(r);
+			out<<"}\n";
+		}
+	}
+
+	volatile bool enabled;
+	bool csv;
+	int nb_frames;
+	std::chrono::high_resolution_clock::time_point start;
+	std::map<int, Record> frames;
+	Record total;
+	std::ofstream out;
+	std::mutex mutex;
+};
+
+class ProfileTimer {
+public:
+	ProfileTimer(int stage) : stage(stage), children_ms(0) {
+		active = Profiler::instance().is_enabled();
+		if (!active) return;
+		parent = Profiler::current_timer();
+		Profiler::current_timer() = this;
+		t0 = std::chrono::high_resolution_clock::now();
+	}
+	~ProfileTimer() {
+		stop();
+	}
+	// ends the measure before the end of the scope
+	void stop() {
+		if (!active) return;
+		active = false;
+		double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+		Profiler::current_timer() = parent;
+		if (parent) parent->children_ms += ms;
+		Profiler::instance().add_time(stage, ms - children_ms);
+	}
+private:
+	int stage;
+	bool active;
+	double children_ms;
+	ProfileTimer* parent;
+	std::chrono::high_resolution_clock::time_point t0;
+
+	ProfileTimer(const ProfileTimer&);
+	ProfileTimer& operator=(const ProfileTimer&);
+};
+
+// sets the frame of the samples of the calling thread, for the scope.
+class ProfileFrame {
+public:
+	ProfileFrame(int frame) : previous(Profiler::current_frame()) { Profiler::current_frame() = frame; }
+	~ProfileFrame() { Profiler::current_frame() = previous; }
+private:
+	int previous;
+};
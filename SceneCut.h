@@ -0,0 +1,67 @@
+// Scene cut detection, with the same score as the "scene" variable of ffmpeg's select filter (libavfilter/vf_select.c) :
+// mean absolute frame difference (MAFD) summed over 8x8 blocks, compared to the MAFD of the previous frame pair.
+// Scores are in 0..1 ; a cut is usually detected above 0.3-0.4.
+
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
+
+class SceneCutDetector {
+public:
+	// channels : 3 for RGB frames, 1 for a luma plane (the 4:2:0 solve).
+	SceneCutDetector(int W, int H, double threshold, int channels = 3) : W(W), H(H), threshold(threshold), channels(channels), prev_mafd(0), has_prev(false), prev(W*H*channels), cur(W*H*channels) {}
+
+	// frame : W*H*channels values in 0..1. The first frame is never a cut.
+	template<typename T>
+	double score(const T* frame) {
+
+		const int n = W*H*channels;
+#pragma omp parallel for
+		for (int i=0; i<n; i++) {
+			cur[i] = (unsigned char)std::min(255., std::max(0., frame[i]*255.+0.5));
+		}
+
+		double ret = 0;
+		if (has_prev) {
+			// 8x8 blocks on the packed RGB rows, as vf_select does on the first plane
+			const int bw = (W*channels) & ~7, bh = H & ~7;
+			long long sad = 0;
+#pragma omp parallel for reduction(+:sad)
+			for (int y=0; y<bh; y+=8) {
+				for (int yy=y; yy<y+8; yy++) {
+					const unsigned char* p1 = &cur[yy*W*channels];
+					const unsigned char* p2 = &prev[yy*W*channels];
+					for (int x=0; x<bw; x++) {
+						sad += abs((int)p1[x] - (int)p2[x]);
+					}
+				}
+			}
+			long long nb_sad = (long long)bw*bh;
+			double mafd = nb_sad ? (double)(sad / nb_sad) : 0.;
+			double diff = fabs(mafd - prev_mafd);
+			ret = std::min(1., std::max(0., std::min(mafd, diff)/100.));
+			prev_mafd = mafd;
+		}
+		has_prev = true;
+		std::swap(prev, cur);
+		return ret;
+	}
+
+	template<typename T>
+	bool is_cut(const T* frame) {
+		return score(frame) > threshold;
+	}
+
+	int W, H;
+	double threshold;
+	int channels;
+
+private:
+	double prev_mafd;
+	bool has_prev;
+	std::vector<unsigned char> prev, cur;
+};
@@ -0,0 +1,164 @@
+// Reduced precision storage for frames and solver buffers (--solver-storage, --frame-storage).
+// Values are always computed in float ; they are only stored as IEEE half floats (about 3 significant digits, range
+// +-65504) or as 16 bit fixed point with 1/8192 steps in [-4, 4) (frames only : the right-hand sides exceed that range).
+// Conversions use F16C when the compiler targets it (-mf16c, or /arch:AVX2 with MSVC, which has no F16C macro), a
+// software conversion otherwise.
+
+#pragma once
+
+#include <vector>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <stdint.h>
+#include "ThreadPool.h"
+
+// gcc/clang define __F16C__ (-mf16c, or -march= of a CPU that has it ; -mavx2 alone does not) ; MSVC has no F16C macro,
+// its /arch:AVX2 implies F16C
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define STORAGE_USE_F16C 1
+#include <immintrin.h>
+#else
+#define STORAGE_USE_F16C 0
+#endif
+
+enum StorageType { STORAGE_FLOAT, STORAGE_HALF, STORAGE_FIXED16 };
+
+// "float", "half" or "int16" ; false for an unknown name.
+inline bool parse_storage(const char* name, StorageType &type) {
+	if (strcmp(name, "float")==0) type = STORAGE_FLOAT;
+	else if (strcmp(name, "half")==0) type = STORAGE_HALF;
+	else if (strcmp(name, "int16")==0) type = STORAGE_FIXED16;
+	else return false;
+	return true;
+}
+
+struct float16 {
+	uint16_t bits;
+};
+
+struct fixed16 {
+	int16_t v;
+};
+
+#define FIXED16_ONE 8192.f
+
+// round to nearest even ; overflows go to infinity, values below the half range to zero or subnormals.
+inline uint16_t float_to_half_bits(float f) {
+	uint32_t x;
+	memcpy(&x, &f, 4);
+	const uint16_t sign = (uint16_t)((x >> 16) & 0x8000);
+	const uint32_t absx = x & 0x7fffffff;
+	if (absx >= 0x7f800000) return sign | 0x7c00 | (absx > 0x7f800000 ? 0x200 : 0); // inf, nan
+	if (absx >= 0x477ff000) return sign | 0x7c00;                                  // rounds above 65504
+	if (absx < 0x38800000) {                                                         // subnormal half
+		if (absx < 0x33000000) return sign;
+		const uint32_t m = (absx & 0x7fffff) | 0x800000;
+		const int shift = 126 - (int)(absx >> 23); // the mantissa in units of 2^-24
+		uint32_t h = m >> shift;
+		const uint32_t rem = m & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+		if (rem > halfway || (rem == halfway && (h & 1))) h++;
+		return sign | (uint16_t)h;
+	}
+	uint32_t h = ((absx - 0x38000000) >> 13);
+	const uint32_t rem = absx & 0x1fff;
+	if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+	return sign | (uint16_t)h;
+}
+
+inline float half_bits_to_float(uint16_t h) {
+	const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t e = (h >> 10) & 0x1f, m = h & 0x3ff, x;
+	if (e == 0x1f) {
+		x = sign | 0x7f800000 | (m << 13);
+	} else if (e == 0) {
+		if (m == 0) {
+			x = sign;
+		} else { // subnormal : normalize
+			int k = -1;
+			do { k++; m <<= 1; } while (!(m & 0x400));
+			x = sign | ((uint32_t)(112 - k) << 23) | ((m & 0x3ff) << 13);
+		}
+	} else {
+		x = sign | ((e + 112) << 23) | (m << 13);
+	}
+	float f;
+	memcpy(&f, &x, 4);
+	return f;
+}
+
+// stored value -> float (float and double are kept as they are)
+template<typename V>
+inline V load_value(V v) { return v; }
+inline float load_value(float16 h) {
+#if STORAGE_USE_F16C
+	return _mm_cvtss_f32(_mm_cvtph_ps(_mm_cvtsi32_si128(h.bits)));
+#else
+	return half_bits_to_float(h.bits);
+#endif
+}
+inline float load_value(fixed16 x) { return x.v*(1.f/FIXED16_ONE); }
+
+// float -> stored value
+template<typename S>
+inline S store_value(double v) { return (S)v; }
+template<>
+inline float16 store_value<float16>(double v) {
+	float16 h;
+#if STORAGE_USE_F16C
+	h.bits = (uint16_t)_mm_cvtsi128_si32(_mm_cvtps_ph(_mm_set_ss((float)v), 0));
+#else
+	h.bits = float_to_half_bits((float)v);
+#endif
+	return h;
+}
+template<>
+inline fixed16 store_value<fixed16>(double v) {
+	fixed16 x;
+	x.v = (int16_t)std::min(32767., std::max(-32768., floor(v*FIXED16_ONE + 0.5)));
+	return x;
+}
+
+// n values between a stored buffer and floats
+template<typename S>
+void load_values(const S* src, size_t n, float* dst) {
+	for (size_t i = 0; i < n; i++) dst[i] = (float)load_value(src[i]);
+}
+template<typename S>
+void store_values(const float* src, size_t n, S* dst) {
+	for (size_t i = 0; i < n; i++) dst[i] = store_value<S>(src[i]);
+}
+#if STORAGE_USE_F16C
+template<>
+inline void load_values<float16>(const float16* src, size_t n, float* dst) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(src + i))));
+	for (; i < n; i++) dst[i] = load_value(src[i]);
+}
+template<>
+inline void store_values<float16>(const float* src, size_t n, float16* dst) {
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) _mm_storeu_si128((__m128i*)(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), 0));
+	for (; i < n; i++) dst[i] = store_value<float16>(src[i]);
+}
+#endif
+
+// frames held in a 16 bit storage chosen at run time (STORAGE_HALF or STORAGE_FIXED16), converted by blocks on the Scheduler.
+inline void pack_values(const float* src, size_t n, StorageType type, std::vector<uint16_t> &dst) {
+	dst.resize(n);
+	const int nblocks = (int)((n + 65535) / 65536);
+	Scheduler::instance().parallel_for(0, nblocks, [&](int b) {
+		const size_t i = (size_t)b*65536, m = std::min((size_t)65536, n - i);
+		if (type == STORAGE_HALF) store_values(src + i, m, (float16*)&dst[i]);
+		else store_values(src + i, m, (fixed16*)&dst[i]);
+	}, STAGE_OTHER, 1);
+}
+inline void unpack_values(const std::vector<uint16_t> &src, StorageType type, float* dst) {
+	const size_t n = src.size();
+	const int nblocks = (int)((n + 65535) / 65536);
+	Scheduler::instance().parallel_for(0, nblocks, [&](int b) {
+		const size_t i = (size_t)b*65536, m = std::min((size_t)65536, n - i);
+		if (type == STORAGE_HALF) load_values((const float16*)&src[i], m, dst + i);
+		else load_values((const fixed16*)&src[i], m, dst + i);
+	}, STAGE_OTHER, 1);
+}
@@ -0,0 +1,89 @@
+// Deterministic synthetic videos for the benchmark and regression tools : a noisy texture seen by a camera
+// that translates and rotates, with a cut, and a "processed" version of it that flickers as frame-by-frame
+// processing does (per-frame gain, offset and tint).
+
+#pragma once
+
+#include <cmath>
+#include <algorithm>
+
+
+// Deterministic synthetic video : frame t is the same for every run and every thread count.
+class SyntheticVideo {
+public:
+	SyntheticVideo(int W, int H, int cut) : W(W), H(H), cut(cut) {}
+
+	void frame(int t, float* rgb) const {
+		int scene = t>=cut ? 1 : 0;
+		float a, dx, dy;
+		motion(t, a, dx, dy);
+		const float ca = cos(a), sa = sin(a), cx = W*0.5f, cy = H*0.5f;
+		#pragma omp parallel for
+		for (int i=0; i<H; i++) {
+			for (int j=0; j<W; j++) {
+				float x = ca*(j-cx) - sa*(i-cy) + cx + dx;
+				float y = sa*(j-cx) + ca*(i-cy) + cy + dy;
+				for (int k=0; k<3; k++) {
+					float v = texture(x, y, scene, k) + 0.03f*(hash(j, i, 1000+3*t+k)-0.5f); // sensor noise
+					rgb[(i*W+j)*3+k] = std::min(1.f, std::max(0.f, v));
+				}
+			}
+		}
+	}
+
+	// exact backward flow of frame t (positions in frame t-1), as computed by opt_flow_patchmatch.
+	void backward_flow(int t, float* flow) const {
+		float a0, dx0, dy0, a1, dx1, dy1;
+		motion(t, a1, dx1, dy1);
+		motion(t-1, a0, dx0, dy0);
+		const float cx = W*0.5f, cy = H*0.5f;
+		#pragma omp parallel for
+		for (int i=0; i<H; i++) {
+			for (int j=0; j<W; j++) {
+				float x = cos(a1)*(j-cx) - sin(a1)*(i-cy) + dx1 - dx0; // texture position, relative to the camera of frame t-1
+				float y = sin(a1)*(j-cx) + cos(a1)*(i-cy) + dy1 - dy0;
+				flow[(i*W+j)*2] = cos(a0)*x + sin(a0)*y + cx;
+				flow[(i*W+j)*2+1] = -sin(a0)*x + cos(a0)*y + cy;
+			}
+		}
+	}
+
+	// frame t of the processed video : the frame with a gain, an offset and a tint that change from frame to frame.
+	void processed_frame(int t, float* rgb) const {
+		frame(t, rgb);
+		float gain = 0.75f + 0.5f*hash(t, 0, 77);
+		float offset = 0.1f*(hash(t, 1, 77)-0.5f);
+		float tint[3];
+		for (int k=0; k<3; k++) tint[k] = 0.9f + 0.2f*hash(t, 2+k, 77);
+		const int n = W*H;
+		#pragma omp parallel for
+		for (int i=0; i<n; i++) {
+			for (int k=0; k<3; k++)
+				rgb[i*3+k] = std::min(1.f, std::max(0.f, rgb[i*3+k]*gain*tint[k] + offset));
+		}
+	}
+
+	int W, H, cut;
+
+private:
+	static void motion(int t, float &a, float &dx, float &dy) {
+		a = 0.004f*t;
+		dx = 2.5f*t;
+		dy = 1.f*t;
+	}
+
+	static float hash(int x, int y, int seed) {
+		unsigned int h = (unsigned int)x*374761393u + (unsigned int)y*668265263u + (unsigned int)seed*2246822519u;
+		h = (h ^ (h >> 13))*1274126177u;
+		return ((h ^ (h >> 16)) & 0xffffff)/16777216.f;
+	}
+
+	// smooth gradients, edges and 4x4 pixel blocks of noise (PatchMatch needs texture to lock on)
+	static float texture(float x, float y, int scene, int c) {
+		float f = 0.03f + 0.01f*c + 0.02f*scene;
+		float v = 0.5f + 0.2f*sin(f*x + 1.3f*scene)*cos(0.7f*f*y + c);
+		v += ((int)floor(x/32) + (int)floor(y/32) + scene) % 2 ? 0.1f : -0.1f;
+		v += 0.2f*(hash((int)floor(x/4), (int)floor(y/4), 3*scene+c)-0.5f);
+		return v;
+	}
+};
@@ -0,0 +1,418 @@
+// Embeddable streaming interface to the temporal consistency filter.
+// Push (input, processed) frame pairs in display order, pop the regularized frames in the same order.
+// The solve runs on an internal thread, so push() returns as soon as the frame is queued ;
+// frames are W*H*3 interleaved RGB floats in [0,1], or planar 4:2:0 frames with opts.yuv420 (see YUVIO.h).
+//
+//	TemporalConsistencyEngine engine(W, H, opts);
+//	for each frame : engine.push(input, processed) ; while (engine.try_pop(out)) use(out);
+//	engine.finish() ; while (engine.pop(out)) use(out);
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <iostream>
+#include <algorithm>
+#include <omp.h>
+#include "CImg.h"
+#include "regularization.h"
+#include "SceneCut.h"
+#include "YUVIO.h"
+#include "Storage.h"
+#include "ThreadPool.h"
+
+
+// FRAME_COPY : push() copies the frames.
+// FRAME_BORROW : the engine keeps the pointers ; they must stay valid until the *next* frame has been popped
+// (the following frame is regularized against this one) ; with opts.window > 1, until opts.window more frames have been popped.
+enum FrameOwnership { FRAME_COPY, FRAME_BORROW };
+
+struct EngineOptions {
+	EngineOptions() : lambda_t(1.), flow_lookahead(0), flow_threads(0), scene_threshold(0.), max_latency(8), yuv420(false), frame_storage(STORAGE_FLOAT), window(1), window_overlap(1) {}
+	double lambda_t;        // temporal weight
+	std::vector<double> lambdas; // several temporal weights (sweep) : one solution per value from the same flow, lambda_t is ignored
+	int flow_lookahead;     // flows of up to that many following frames are computed on worker threads while a frame is solved
+	int flow_threads;       // OpenMP threads per look-ahead flow task, reserved from the budget (0 : budget/(flow_lookahead+1))
+	double scene_threshold; // scene cut score above which the recurrence restarts (0 : no detection)
+	int max_latency;        // frames pushed and not solved yet before push() blocks (at least flow_lookahead+1)
+	bool yuv420;            // frames are planar 4:2:0 (planar420_size(W, H) floats) : luma and chroma are solved at their own resolution
+	StorageType frame_storage; // copied frames waiting in the queues, and the previous input and solution, are held as 16 bit values
+	int window;             // > 1 : frames are solved jointly by windows of that many frames (solve_window), not with yuv420
+	int window_overlap;     // frames of a window solved again in the next one, which then starts window - window_overlap frames later
+	SolverParams solver;    // flow and solver presets
+};
+
+class TemporalConsistencyEngine {
+public:
+	TemporalConsistencyEngine(int W, int H, const EngineOptions &opts = EngineOptions()) : W(W), H(H), opts(opts), nb_pushed(0), nb_popped(0), input_done(false), output_done(false) {
+		// threads of the engine : opts.solver.flow_threads (its share of the budget), or the whole scheduler budget
+		solver_threads = opts.solver.flow_threads>0 ? opts.solver.flow_threads : Scheduler::instance().size();
+		this->opts.flow_lookahead = std::max(0, opts.flow_lookahead);
+		this->opts.max_latency = std::max(opts.max_latency, this->opts.flow_lookahead+1);
+		if (this->opts.flow_threads<=0) this->opts.flow_threads = std::max(1, solver_threads/(this->opts.flow_lookahead+1));
+		if (this->opts.lambdas.empty()) this->opts.lambdas.push_back(opts.lambda_t);
+		if (opts.scene_threshold>0) detector.reset(new SceneCutDetector(W, H, opts.scene_threshold, opts.yuv420 ? 1 : 3)); // 4:2:0 : on the luma plane
+		if (this->opts.window>1 && !opts.yuv420) {
+			// the window solve needs full resolution flows and float systems
+			this->opts.window_overlap = std::min(std::max(opts.window_overlap, 0), opts.window-1);
+			this->opts.solver.scale = 1.f;
+			this->opts.solver.tile_pixels = 0;
+			solver = std::thread(&TemporalConsistencyEngine::window_loop, this);
+		} else {
+			solver = std::thread(&TemporalConsistencyEngine::solver_loop, this);
+		}
+	}
+
+	~TemporalConsistencyEngine() {
+		finish();
+		solver.join();
+	}
+
+	// continues an interrupted run : the next pushed frame is frame 'frames_done', regularized against the previous input
+	// and solution (see Checkpoint.h), used for all the lambdas. Call before the first push.
+	void resume(const float* prevInput, const float* prevSolution, int frames_done) {
+		std::shared_ptr<Frame> frame(new Frame());
+		store_input(*frame, prevInput);
+		frame->processed = NULL;
+		frame->index = frames_done-1;
+		frame->new_shot = false;
+		if (detector) detector->score(prevInput);
+		lastPushed = frame;
+		nb_pushed = nb_popped = frames_done;
+		std::unique_lock<std::mutex> lock(mutex);
+		seed = frame;
+		seedSolution.resize(frame_size()*nb_outputs());
+		for (int s=0; s<nb_outputs(); s++) memcpy(&seedSolution[s*frame_size()], prevSolution, frame_size()*sizeof(float));
+	}
+
+	// blocks while max_latency frames wait to be solved.
+	void push(const float* input, const float* processed, FrameOwnership ownership = FRAME_COPY) {
+
+		std::shared_ptr<Frame> frame(new Frame());
+		frame->index = nb_pushed;
+		// every frame is scored, including the first one : the next frame is compared to it
+		const bool cut = detector && detector->is_cut(input);
+		frame->new_shot = !lastPushed || cut;
+		if (ownership==FRAME_COPY) {
+			store_input(*frame, input);
+			if (opts.frame_storage==STORAGE_FLOAT) {
+				frame->processed_copy.assign(processed, processed+frame_size());
+				frame->processed = &frame->processed_copy[0];
+			} else {
+				pack_values(processed, frame_size(), opts.frame_storage, frame->processed_packed);
+				frame->processed = NULL;
+			}
+		} else {
+			frame->input = input;
+			frame->processed = processed;
+		}
+
+		// look-ahead flows are scheduler tasks ; their PatchMatch teams of opts.flow_threads hold as many threads of the budget
+		if (opts.flow_lookahead>0 && !frame->new_shot) {
+			std::shared_ptr<Frame> before = lastPushed;
+			int W = this->W, H = this->H;
+			SolverParams params = opts.solver;
+			params.flow_threads = opts.flow_threads;
+			bool yuv420 = opts.yuv420;
+			StorageType storage = input_storage();
+			frame->flow.resize(W*H*2);
+			frame->flow_ready = Scheduler::instance().enqueue([frame, before, W, H, params, yuv420, storage]() {
+				ProfileFrame profile_frame(frame->index);
+				std::vector<float> beforeInput, frameInput;
+				const float* prevIn = before->get_input(beforeInput, storage);
+				const float* curIn = frame->get_input(frameInput, storage);
+				if (yuv420) compute_backward_flow_420<float>(prevIn, curIn, &frame->flow[0], W, H, params, frame->index);
+				else compute_backward_flow<float>(prevIn, curIn, &frame->flow[0], W, H, params, frame->index);
+			}, STAGE_FLOW).share();
+		}
+		lastPushed = frame;
+		nb_pushed++;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while ((int)input_queue.size()>=opts.max_latency) cond.wait(lock);
+			input_queue.push_back(frame);
+		}
+		cond.notify_all();
+	}
+
+	// no more frames will be pushed.
+	void finish() {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			input_done = true;
+		}
+		cond.notify_all();
+	}
+
+	// next regularized frame (frame_size() floats per lambda, in the order of opts.lambdas) ; waits for it. Returns false once finish() was called and all frames were popped.
+	bool pop(float* solution) {
+		std::vector<float> out;
+		if (!pop(out, true)) return false;
+		memcpy(solution, &out[0], out.size()*sizeof(float));
+		return true;
+	}
+
+	// same, without waiting : false if the next frame is not solved yet.
+	bool try_pop(float* solution) {
+		std::vector<float> out;
+		if (!pop(out, false)) return false;
+		memcpy(solution, &out[0], out.size()*sizeof(float));
+		return true;
+	}
+
+	// swaps the solved frame into 'solution' (no copy).
+	bool pop(std::vector<float> &solution, bool wait = true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (wait && output_queue.empty() && !output_done) cond.wait(lock);
+			if (output_queue.empty()) return false;
+			solution.swap(output_queue.front());
+			output_queue.pop_front();
+			nb_popped++;
+		}
+		cond.notify_all();
+		return true;
+	}
+
+	// solutions per frame : the number of lambdas
+	int nb_outputs() const { return (int)opts.lambdas.size(); }
+
+	// floats per frame : W*H*3, or planar420_size(W, H) with opts.yuv420
+	int frame_size() const { return opts.yuv420 ? (int)planar420_size(W, H) : W*H*3; }
+
+	// frames pushed and not popped yet
+	int latency() const { return nb_pushed - nb_popped; }
+
+	const int W, H;
+
+private:
+	struct Frame {
+		std::vector<float> input_copy, processed_copy, flow;
+		std::vector<uint16_t> input_packed, processed_packed; // copies in input_storage() and opts.frame_storage
+		const float *input, *processed;                      // NULL when packed
+		std::shared_future<void> flow_ready;
+		bool new_shot;
+		int index;
+
+		// the frame as floats : in place, or unpacked into 'tmp'
+		const float* get_input(std::vector<float> &tmp, StorageType storage) const {
+			if (input) return input;
+			tmp.resize(input_packed.size());
+			unpack_values(input_packed, storage, &tmp[0]);
+			return &tmp[0];
+		}
+		const float* get_processed(std::vector<float> &tmp, StorageType storage) const {
+			if (processed) return processed;
+			tmp.resize(processed_packed.size());
+			unpack_values(processed_packed, storage, &tmp[0]);
+			return &tmp[0];
+		}
+	};
+
+	// inputs drive the flow and the weights : PatchMatch compares them as 8 bit values, and half floats (11 bit mantissa)
+	// move many of them to the next 8 bit level down. They are held in fixed point instead, which is exact enough in [0, 1].
+	StorageType input_storage() const {
+		return opts.frame_storage==STORAGE_HALF ? STORAGE_FIXED16 : opts.frame_storage;
+	}
+
+	// copy of an input frame, in input_storage()
+	void store_input(Frame &frame, const float* input) const {
+		if (opts.frame_storage==STORAGE_FLOAT) {
+			frame.input_copy.assign(input, input+frame_size());
+			frame.input = &frame.input_copy[0];
+		} else {
+			pack_values(input, frame_size(), input_storage(), frame.input_packed);
+			frame.input = NULL;
+		}
+	}
+
+	void solver_loop() {
+
+		omp_set_num_threads(solver_threads);
+		std::shared_ptr<Frame> prev;
+		const int n = nb_outputs(), size = frame_size();
+		const bool packed = opts.frame_storage!=STORAGE_FLOAT;
+		std::vector<float> prevSolution(size*n);
+		std::vector<uint16_t> prevSolutionPacked; // prevSolution between two frames, when packed
+		std::vector<float> prevInput, curInput, curProcessed;
+
+		for (;;) {
+			std::shared_ptr<Frame> cur;
+			if (!next_frame(cur, prev, prevSolution)) break;
+			if (cur->flow_ready.valid()) cur->flow_ready.wait();
+
+			ProfileFrame profile_frame(cur->index);
+			const float* input = cur->get_input(curInput, input_storage());
+			const float* processed = cur->get_processed(curProcessed, opts.frame_storage);
+			const float* previous = prev && !cur->new_shot ? prev->get_input(prevInput, input_storage()) : NULL;
+			if (packed && !prevSolutionPacked.empty()) unpack_values(prevSolutionPacked, opts.frame_storage, &prevSolution[0]);
+
+			std::vector<float> curSolution(size*n);
+			std::vector<const float*> prevPtr(n);
+			std::vector<float*> curPtr(n);
+			for (int s=0; s<n; s++) {
+				memcpy(&curSolution[s*size], processed, size*sizeof(float));
+				prevPtr[s] = &prevSolution[s*size];
+				curPtr[s] = &curSolution[s*size];
+			}
+			if (opts.yuv420) solve_frames_420<float>(previous, input, processed, &prevPtr[0], &curPtr[0], W, H, &opts.lambdas[0], n, cur->new_shot, cur->flow.empty() ? NULL : &cur->flow[0], opts.solver, cur->index);
+			else solve_frames<float>(previous, input, processed, &prevPtr[0], &curPtr[0], W, H, &opts.lambdas[0], n, cur->new_shot, cur->flow.empty() ? NULL : &cur->flow[0], opts.solver, cur->index);
+			if (packed) pack_values(&curSolution[0], curSolution.size(), opts.frame_storage, prevSolutionPacked);
+			else prevSolution = curSolution;
+			prev = cur;
+
+			emit(curSolution);
+		}
+		finish_output();
+	}
+
+	// waits for the next pushed frame ; false once finish() was called and all frames were taken. A resume() seed
+	// becomes 'prev' and 'prevSolution'.
+	bool next_frame(std::shared_ptr<Frame> &cur, std::shared_ptr<Frame> &prev, std::vector<float> &prevSolution) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (input_queue.empty() && !input_done) cond.wait(lock);
+			if (input_queue.empty()) return false;
+			cur = input_queue.front();
+			input_queue.pop_front();
+			if (seed) {
+				prev = seed;
+				prevSolution.swap(seedSolution);
+				seed.reset();
+			}
+		}
+		cond.notify_all();
+		if (cur->new_shot && cur->index>0) std::cout<<"scene cut at frame "<<cur->index<<std::endl;
+		return true;
+	}
+
+	// queues the solutions of the next frame (swapped out of 'solution')
+	void emit(std::vector<float> &solution) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			output_queue.push_back(std::vector<float>());
+			output_queue.back().swap(solution);
+		}
+		cond.notify_all();
+	}
+
+	void finish_output() {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			output_done = true;
+		}
+		cond.notify_all();
+	}
+
+	// a frame of the window of window_loop, unpacked, with its current solutions (the initial guess before the solve)
+	struct WindowFrame {
+		std::shared_ptr<Frame> frame;
+		std::vector<float> input_tmp, processed_tmp, solution;
+		const float *input, *processed;
+	};
+
+	// sliding window mode : frames are gathered until the window is full, solved jointly against the anchor (the last
+	// solution given out), and the first window - window_overlap of them are given out ; the others stay in the window,
+	// with their solution as initial guess. A scene cut or the end of the input solves and gives out the whole window ;
+	// the first frame of a shot keeps its processed frame and becomes the anchor.
+	void window_loop() {
+
+		omp_set_num_threads(solver_threads);
+		const int n = nb_outputs(), size = frame_size(), K = opts.window;
+		std::shared_ptr<Frame> anchor, cur;
+		std::vector<float> anchorSolution(size*n);
+		std::deque<WindowFrame> window;
+
+		for (;;) {
+			const bool more = next_frame(cur, anchor, anchorSolution);
+			if (!window.empty() && (!more || cur->new_shot)) solve_window_frames(anchor, anchorSolution, window, (int)window.size());
+			if (!more) break;
+
+			window.push_back(WindowFrame());
+			WindowFrame &wf = window.back(); // input and processed may point into it : filled in place
+			wf.frame = cur;
+			wf.input = cur->get_input(wf.input_tmp, input_storage());
+			wf.processed = cur->get_processed(wf.processed_tmp, opts.frame_storage);
+			wf.solution.resize(size*n);
+			for (int s=0; s<n; s++) memcpy(&wf.solution[s*size], wf.processed, size*sizeof(float));
+			if (cur->new_shot) {
+				anchor = cur;
+				anchorSolution = wf.solution;
+				emit(wf.solution);
+				window.pop_back();
+				continue;
+			}
+			if ((int)window.size()==K) solve_window_frames(anchor, anchorSolution, window, K - opts.window_overlap);
+		}
+		finish_output();
+	}
+
+	// solves the window, gives out its first 'count' frames and makes the last of them the anchor.
+	void solve_window_frames(std::shared_ptr<Frame> &anchor, std::vector<float> &anchorSolution, std::deque<WindowFrame> &window, int count) {
+
+		const int K = (int)window.size(), n = nb_outputs(), size = frame_size();
+		ProfileFrame profile_frame(window[0].frame->index);
+		std::vector<float> anchorInputTmp;
+		const float* anchorInput = anchor->get_input(anchorInputTmp, input_storage());
+
+		// flows that the lookahead did not compute, in parallel
+		std::vector<int> missing;
+		for (int f=0; f<K; f++) {
+			if (window[f].frame->flow_ready.valid()) window[f].frame->flow_ready.wait();
+			else if (window[f].frame->flow.empty()) missing.push_back(f);
+		}
+		SolverParams flow_params = opts.solver;
+		flow_params.flow_threads = std::max(1, solver_threads/std::max(1, (int)missing.size()));
+		Scheduler::instance().parallel_for(0, (int)missing.size(), [&](int m) {
+			const int f = missing[m];
+			ProfileFrame profile_flow(window[f].frame->index);
+			std::vector<float> &flow = window[f].frame->flow;
+			flow.resize(W*H*2);
+			compute_backward_flow<float>(f>0 ? window[f-1].input : anchorInput, window[f].input, &flow[0], W, H, flow_params, window[f].frame->index);
+		}, STAGE_FLOW, 1);
+
+		std::vector<const float*> inputs(K), processed(K), flows(K);
+		for (int f=0; f<K; f++) {
+			inputs[f] = window[f].input;
+			processed[f] = window[f].processed;
+			flows[f] = &window[f].frame->flow[0];
+		}
+		// one system per lambda, solved in parallel
+		Scheduler::instance().parallel_for(0, n, [&](int s) {
+			ProfileFrame profile_solve(window[0].frame->index);
+			std::vector<float*> solutions(K);
+			for (int f=0; f<K; f++) solutions[f] = &window[f].solution[s*size];
+			solve_window<float>(anchorInput, &anchorSolution[s*size], &inputs[0], &processed[0], &flows[0], &solutions[0], K, W, H, opts.lambdas[s], opts.solver);
+		}, STAGE_SOLVE, 1);
+
+		anchor = window[count-1].frame;
+		anchorSolution = window[count-1].solution;
+		for (int f=0; f<count; f++) {
+			emit(window.front().solution);
+			window.pop_front();
+		}
+	}
+
+	EngineOptions opts;
+	int solver_threads;
+	std::unique_ptr<SceneCutDetector> detector;
+	std::shared_ptr<Frame> lastPushed, seed;
+	std::vector<float> seedSolution;
+	int nb_pushed, nb_popped;
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<std::shared_ptr<Frame> > input_queue;
+	std::deque<std::vector<float> > output_queue;
+	bool input_done, output_done;
+	std::thread solver;
+
+	TemporalConsistencyEngine(const TemporalConsistencyEngine&);
+	TemporalConsistencyEngine& operator=(const TemporalConsistencyEngine&);
+};
@@ -0,0 +1,377 @@
+// Thread pools.
+// ThreadPool : minimal fixed-size pool with dedicated threads, for long-running or blocking tasks (shots, jobs, flow look-ahead).
+// Scheduler : work-stealing scheduler with a global thread budget, shared by the compute stages (decode, solver, encode).
+// Tasks are std::function<void()> ; enqueue() returns a std::future for the task result.
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <algorithm>
+
+
+class ThreadPool {
+public:
+	ThreadPool(int nthreads) : stopping(false) {
+		if (nthreads < 1) nthreads = 1;
+		for (int i = 0; i < nthreads; i++)
+			workers.push_back(std::thread(&ThreadPool::worker_loop, this));
+	}
+
+	~ThreadPool() {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		cond.notify_all();
+		for (size_t i = 0; i < workers.size(); i++)
+			workers[i].join();
+	}
+
+	template<typename F>
+	std::future<typename std::result_of<F()>::type> enqueue(F f) {
+		typedef typename std::result_of<F()>::type R;
+		std::shared_ptr<std::packaged_task<R()> > task(new std::packaged_task<R()>(f));
+		std::future<R> result = task->get_future();
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			tasks.push_back([task]() { (*task)(); });
+		}
+		cond.notify_one();
+		return result;
+	}
+
+	int size() const { return (int)workers.size(); }
+
+private:
+	void worker_loop() {
+		for (;;) {
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while (!stopping && tasks.empty()) cond.wait(lock);
+				if (stopping && tasks.empty()) return;
+				task = tasks.front();
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()> > tasks;
+	std::mutex mutex;
+	std::condition_variable cond;
+	bool stopping;
+
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+};
+
+
+
+// stages, used for affinity hints and statistics.
+enum TaskStage { STAGE_DECODE, STAGE_FLOW, STAGE_SOLVE, STAGE_ENCODE, STAGE_OTHER, NB_STAGES };
+
+#ifdef _MSC_VER
+#define SCHEDULER_TLS __declspec(thread)
+#else
+#define SCHEDULER_TLS __thread
+#endif
+
+struct SchedulerStats {
+	int threads;
+	long long tasks[NB_STAGES];
+	double busy_ms[NB_STAGES];
+	long long steals;
+};
+
+// Each worker owns a task deque : it pops its own tasks from the front, and idle workers steal from the back of the others.
+// Tasks submitted from outside the scheduler go to the workers of their stage (see set_affinity), round-robin.
+// parallel_for() can be called from any thread, including from inside a task : the caller runs chunks of its own loop
+// while it waits, never other tasks (a long decode or encode task would delay the loop).
+// OpenMP teams (PatchMatch) are part of the budget : while one runs, reserve() keeps as many workers from starting tasks.
+class Scheduler {
+public:
+	// process-wide scheduler ; call set_budget() from main before other threads use it.
+	static Scheduler& instance() {
+		static Scheduler s((int)std::thread::hardware_concurrency());
+		return s;
+	}
+
+	Scheduler(int nthreads) : stopping(false), pending(0), busy(0), reserved(0), steals(0) {
+		start(nthreads);
+	}
+
+	~Scheduler() {
+		stop();
+	}
+
+	// global thread budget ; the scheduler must be idle.
+	void set_budget(int nthreads) {
+		if (nthreads<1) nthreads = 1;
+		if (nthreads==size()) return;
+		stop();
+		start(nthreads);
+	}
+
+	// hint : tasks of 'stage' submitted from outside the scheduler are queued on workers first..first+count-1 (they can still be stolen).
+	void set_affinity(int stage, int first, int count) {
+		int n = size();
+		first = std::max(0, std::min(first, n-1));
+		affinity_first[stage] = first;
+		affinity_count[stage] = std::max(1, std::min(count, n-first));
+	}
+
+	template<typename F>
+	std::future<typename std::result_of<F()>::type> enqueue(F f, int stage = STAGE_OTHER) {
+		typedef typename std::result_of<F()>::type R;
+		std::shared_ptr<std::packaged_task<R()> > task(new std::packaged_task<R()>(f));
+		std::future<R> result = task->get_future();
+		push([task]() { (*task)(); }, stage);
+		return result;
+	}
+
+	// f(i) for i in [begin, end), in chunks of 'grain' indices (0 : about 4 chunks per worker).
+	// Chunks are claimed from a counter by the caller and by at most size() helper tasks ; a helper that starts after the
+	// last chunk was claimed returns at once, without touching f (the loop state is shared, f is only used before 'done').
+	template<typename F>
+	void parallel_for(int begin, int end, const F &f, int stage = STAGE_OTHER, int grain = 0) {
+		int n = end - begin;
+		if (n<=0) return;
+		if (grain<=0) grain = std::max(1, n/(4*size()));
+		int nchunks = (n + grain - 1)/grain;
+		if (nchunks==1) {
+			run_range(f, begin, end, stage);
+			return;
+		}
+		std::shared_ptr<LoopState> loop(new LoopState(nchunks));
+		const F* fp = &f;
+		std::function<void()> run_chunks = [loop, fp, begin, end, grain]() {
+			for (int c = loop->next++; c < loop->nchunks; c = loop->next++) {
+				int b = begin + c*grain, e = std::min(end, b + grain);
+				for (int i=b; i<e; i++) (*fp)(i);
+				loop->done++;
+			}
+		};
+		int helpers = std::min(nchunks-1, size());
+		for (int h=0; h<helpers; h++) push(run_chunks, stage);
+		std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+		run_chunks();
+		account(stage, t0);
+		while (loop->done < nchunks) std::this_thread::yield();
+	}
+
+	int size() const { return nworkers; }
+
+	// a team of 'team' threads started by the calling thread : as many threads of the budget are held until release(), the
+	// caller's own worker (when it is one) counting for one. Returns the count to pass to release().
+	int reserve(int team) {
+		int n = std::max(0, std::min(team - (current_worker()>=0 ? 1 : 0), size()));
+		reserved += n;
+		return n;
+	}
+	void release(int n) {
+		if (n<=0) return;
+		{
+			std::lock_guard<std::mutex> lock(sleep_mutex);
+			reserved -= n;
+		}
+		sleep_cond.notify_all();
+	}
+
+	SchedulerStats stats() const {
+		SchedulerStats st;
+		st.threads = size();
+		for (int i=0; i<NB_STAGES; i++) {
+			st.tasks[i] = stage_tasks[i];
+			st.busy_ms[i] = stage_busy_us[i]/1000.;
+		}
+		st.steals = steals;
+		return st;
+	}
+
+	void print_stats(std::ostream &out) const {
+		static const char* names[NB_STAGES] = { "decode", "flow", "solve", "encode", "other" };
+		SchedulerStats st = stats();
+		out<<"scheduler: "<<st.threads<<" threads, "<<st.steals<<" steals"<<std::endl;
+		for (int i=0; i<NB_STAGES; i++) {
+			if (st.tasks[i]) out<<"  "<<names[i]<<": "<<st.tasks[i]<<" tasks, "<<st.busy_ms[i]<<" ms"<<std::endl;
+		}
+	}
+
+private:
+	struct Task {
+		std::function<void()> fn;
+		int stage;
+	};
+	struct WorkerQueue {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+	struct LoopState {
+		LoopState(int nchunks) : next(0), done(0), nchunks(nchunks) {}
+		std::atomic<int> next, done;
+		int nchunks;
+	};
+
+	void start(int nthreads) {
+		if (nthreads<1) nthreads = 1;
+		stopping = false;
+		nworkers = nthreads; // set before the workers start : they read it while 'workers' grows
+		queues.clear();
+		for (int i=0; i<nthreads; i++) queues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue()));
+		for (int i=0; i<NB_STAGES; i++) {
+			affinity_first[i] = 0;
+			affinity_count[i] = nthreads;
+			stage_tasks[i] = 0;
+			stage_busy_us[i] = 0;
+			next_worker[i] = 0;
+		}
+		for (int i=0; i<nthreads; i++)
+			workers.push_back(std::thread(&Scheduler::worker_loop, this, i));
+	}
+
+	void stop() {
+		{
+			std::unique_lock<std::mutex> lock(sleep_mutex);
+			stopping = true;
+		}
+		sleep_cond.notify_all();
+		for (size_t i=0; i<workers.size(); i++)
+			workers[i].join();
+		workers.clear();
+	}
+
+	// index of the calling worker of this scheduler, -1 for other threads
+	int current_worker() const {
+		return (tls_owner()==this) ? tls_index() : -1;
+	}
+	static const Scheduler*& tls_owner() { static SCHEDULER_TLS const Scheduler* owner = NULL; return owner; }
+	static int& tls_index() { static SCHEDULER_TLS int index = -1; return index; }
+
+	void push(const std::function<void()> &fn, int stage) {
+		Task t;
+		t.fn = fn;
+		t.stage = stage;
+		int w = current_worker();
+		if (w<0) w = affinity_first[stage] + (next_worker[stage]++ % affinity_count[stage]);
+		pending++;
+		{
+			std::lock_guard<std::mutex> lock(queues[w]->mutex);
+			queues[w]->tasks.push_back(t);
+		}
+		{
+			std::lock_guard<std::mutex> lock(sleep_mutex);
+		}
+		sleep_cond.notify_one();
+	}
+
+	// takes a task from worker w's queue, or steals one ; w<0 : any queue.
+	bool try_get(int w, Task &t) {
+		int n = size();
+		if (w>=0) {
+			std::lock_guard<std::mutex> lock(queues[w]->mutex);
+			if (!queues[w]->tasks.empty()) {
+				t = queues[w]->tasks.front();
+				queues[w]->tasks.pop_front();
+				pending--;
+				return true;
+			}
+		}
+		for (int k=1; k<=n; k++) {
+			int victim = ((w<0 ? 0 : w) + k) % n;
+			if (victim==w) continue;
+			std::lock_guard<std::mutex> lock(queues[victim]->mutex);
+			if (!queues[victim]->tasks.empty()) {
+				t = queues[victim]->tasks.back();
+				queues[victim]->tasks.pop_back();
+				pending--;
+				steals++;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// workers running a task, and threads reserved by OpenMP teams, stay within the budget
+	bool admitted() const { return busy < nworkers - reserved; }
+
+	bool run_one(int w) {
+		if (++busy > nworkers - reserved) {
+			busy--;
+			return false;
+		}
+		Task t;
+		if (!try_get(w, t)) {
+			busy--;
+			return false;
+		}
+		std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+		t.fn();
+		account(t.stage, t0);
+		busy--;
+		return true;
+	}
+
+	template<typename F>
+	void run_range(const F &f, int b, int e, int stage) {
+		std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+		for (int i=b; i<e; i++) f(i);
+		account(stage, t0);
+	}
+
+	void account(int stage, std::chrono::high_resolution_clock::time_point t0) {
+		stage_tasks[stage]++;
+		stage_busy_us[stage] += (long long)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - t0).count();
+	}
+
+	void worker_loop(int w) {
+		tls_owner() = this;
+		tls_index() = w;
+		for (;;) {
+			if (run_one(w)) continue;
+			std::unique_lock<std::mutex> lock(sleep_mutex);
+			while (!stopping && (pending==0 || !admitted())) {
+				if (pending==0) sleep_cond.wait(lock);
+				else sleep_cond.wait_for(lock, std::chrono::milliseconds(1)); // held by a reservation, or all the budget is busy
+			}
+			if (stopping && pending==0) return;
+		}
+	}
+
+	std::vector<std::thread> workers;
+	int nworkers;
+	std::vector<std::unique_ptr<WorkerQueue> > queues;
+	std::mutex sleep_mutex;
+	std::condition_variable sleep_cond;
+	bool stopping;
+	std::atomic<int> pending, busy, reserved;
+	std::atomic<long long> steals;
+	std::atomic<long long> stage_tasks[NB_STAGES], stage_busy_us[NB_STAGES];
+	std::atomic<unsigned int> next_worker[NB_STAGES];
+	int affinity_first[NB_STAGES], affinity_count[NB_STAGES];
+
+	Scheduler(const Scheduler&);
+	Scheduler& operator=(const Scheduler&);
+};
+
+// holds the threads of an OpenMP team from the scheduler budget for its lifetime (see Scheduler::reserve).
+class ThreadReservation {
+public:
+	ThreadReservation(int team) : n(Scheduler::instance().reserve(team)) {}
+	~ThreadReservation() { Scheduler::instance().release(n); }
+private:
+	int n;
+	ThreadReservation(const ThreadReservation&);
+	ThreadReservation& operator=(const ThreadReservation&);
+};
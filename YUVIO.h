@@ -0,0 +1,1008 @@
+// Raw YUV (I420) and YUV4MPEG2 (.y4m) helpers used by VideoStreamerYUV / VideoRecorderYUV.
+// Input frames are memory-mapped and handed out as plane pointers ; colour conversion and
+// chroma resampling are done in a single pass per row (SSE2 when available), blocks of rows in parallel on the Scheduler.
+// Output frames are converted directly into a large write buffer.
+// Colour conversion uses the same BT.601 "studio range" coefficients as CImg::YCbCrtoRGB().
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include "ThreadPool.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define YUVIO_USE_SSE2 1
+#include <emmintrin.h>
+#else
+#define YUVIO_USE_SSE2 0
+#endif
+
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+public:
+	MappedFile() : data(NULL), size(0) {
+#ifdef _WIN32
+		hFile = INVALID_HANDLE_VALUE;
+		hMap = NULL;
+#else
+		fd = -1;
+#endif
+	}
+	~MappedFile() { close(); }
+
+	bool open(const char* filename) {
+		close();
+#ifdef _WIN32
+		hFile = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (hFile == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER li;
+		if (!GetFileSizeEx(hFile, &li)) { close(); return false; }
+		size = (size_t)li.QuadPart;
+		if (size == 0) return true;
+		hMap = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!hMap) { close(); return false; }
+		data = (const unsigned char*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+		if (!data) { close(); return false; }
+#else
+		fd = ::open(filename, O_RDONLY);
+		if (fd < 0) return false;
+		struct stat st;
+		if (fstat(fd, &st) != 0) { close(); return false; }
+		size = (size_t)st.st_size;
+		if (size == 0) return true;
+		void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) { close(); return false; }
+		data = (const unsigned char*)p;
+		madvise(p, size, MADV_SEQUENTIAL);
+#endif
+		return true;
+	}
+
+	void close() {
+#ifdef _WIN32
+		if (data) UnmapViewOfFile(data);
+		if (hMap) CloseHandle(hMap);
+		if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+		hMap = NULL;
+		hFile = INVALID_HANDLE_VALUE;
+#else
+		if (data) munmap((void*)data, size);
+		if (fd >= 0) ::close(fd);
+		fd = -1;
+#endif
+		data = NULL;
+		size = 0;
+	}
+
+	// tells the OS we are done with a range (frames already consumed), so that long videos do not fill the page cache.
+	void release(size_t offset, size_t len) {
+#ifndef _WIN32
+		const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		size_t start = (offset / page) * page;
+		if (data && len > 0 && start < offset + len)
+			madvise((void*)(data + start), offset + len - start, MADV_DONTNEED);
+#endif
+	}
+
+	const unsigned char* data;
+	size_t size;
+
+private:
+#ifdef _WIN32
+	HANDLE hFile, hMap;
+#else
+	int fd;
+#endif
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+};
+
+
+enum ChromaSiting {
+	CHROMA_CENTER = 0,  // 420jpeg (and raw I420 files, as written by most tools)
+	CHROMA_LEFT,        // 420mpeg2 : horizontally co-sited with the left luma sample
+	CHROMA_TOPLEFT      // 420paldv : co-sited with the top-left luma sample
+};
+
+// Description of a 4:2:0 planar stream.
+struct YUVFormat {
+	YUVFormat() : W(0), H(0), bitdepth(8), fps_num(25), fps_den(1), siting(CHROMA_CENTER) {}
+
+	int W, H;
+	int bitdepth;      // 8, or 9..16 stored as little-endian 16 bit words
+	int fps_num, fps_den;
+	ChromaSiting siting;
+
+	int bytes_per_sample() const { return bitdepth > 8 ? 2 : 1; }
+	int chroma_W() const { return (W + 1) / 2; }
+	int chroma_H() const { return (H + 1) / 2; }
+	size_t luma_size() const { return (size_t)W*H*bytes_per_sample(); }
+	size_t chroma_size() const { return (size_t)chroma_W()*chroma_H()*bytes_per_sample(); }
+	size_t frame_size() const { return luma_size() + 2 * chroma_size(); }
+};
+
+// Zero-copy view on one frame. Strides are in samples.
+struct YUVPlanes {
+	const unsigned char* plane[3];
+	int stride[3];
+	YUVFormat fmt;
+};
+
+
+#define Y4M_MAGIC "YUV4MPEG2"
+#define Y4M_FRAME_MAGIC "FRAME"
+
+// Parses a YUV4MPEG2 stream header (same tags as libavformat/yuv4mpeg.c). Only 4:2:0 streams are supported.
+// Returns the header length including the trailing '\n', or 0 on error.
+inline size_t parse_y4m_header(const unsigned char* data, size_t size, YUVFormat &fmt) {
+
+	const size_t magic_len = strlen(Y4M_MAGIC);
+	if (size < magic_len || memcmp(data, Y4M_MAGIC, magic_len) != 0) {
+		std::cout << "not a YUV4MPEG2 stream" << std::endl;
+		return 0;
+	}
+	size_t end = magic_len;
+	while (end < size && data[end] != '\n') end++;
+	if (end == size) {
+		std::cout << "truncated YUV4MPEG2 header" << std::endl;
+		return 0;
+	}
+
+	std::string header((const char*)data + magic_len, (const char*)data + end);
+	header += ' ';
+	fmt.W = fmt.H = -1;
+	size_t i = 0;
+	while (i < header.size()) {
+		if (header[i] == ' ') { i++; continue; }
+		size_t tokend = header.find(' ', i);
+		char tag = header[i];
+		std::string val = header.substr(i + 1, tokend - i - 1);
+		switch (tag) {
+		case 'W':
+			fmt.W = atoi(val.c_str());
+			break;
+		case 'H':
+			fmt.H = atoi(val.c_str());
+			break;
+		case 'F':
+			sscanf(val.c_str(), "%d:%d", &fmt.fps_num, &fmt.fps_den);
+			break;
+		case 'C':
+			if (val == "420jpeg" || val == "420") {
+				fmt.bitdepth = 8; fmt.siting = CHROMA_CENTER;
+			} else if (val == "420mpeg2") {
+				fmt.bitdepth = 8; fmt.siting = CHROMA_LEFT;
+			} else if (val == "420paldv") {
+				fmt.bitdepth = 8; fmt.siting = CHROMA_TOPLEFT;
+			} else if (val.compare(0, 4, "420p") == 0) {
+				fmt.bitdepth = atoi(val.c_str() + 4);
+			} else {
+				std::cout << "unsupported YUV4MPEG2 colour space C" << val << " (only 4:2:0 is handled)" << std::endl;
+				return 0;
+			}
+			break;
+		case 'I':
+			if (val != "p" && val != "?")
+				std::cout << "warning: interlaced YUV4MPEG2 stream, processed as progressive" << std::endl;
+			break;
+		default: // A (aspect), X (comments) : ignored
+			break;
+		}
+		i = tokend;
+	}
+	if (fmt.W <= 0 || fmt.H <= 0 || fmt.bitdepth < 8 || fmt.bitdepth > 16) {
+		std::cout << "invalid YUV4MPEG2 header" << std::endl;
+		return 0;
+	}
+	return end + 1;
+}
+
+// Length of a "FRAME[ params]\n" marker at data, or 0 if there is none.
+inline size_t parse_y4m_frame_header(const unsigned char* data, size_t size) {
+	const size_t magic_len = strlen(Y4M_FRAME_MAGIC);
+	if (size < magic_len || memcmp(data, Y4M_FRAME_MAGIC, magic_len) != 0) return 0;
+	size_t end = magic_len;
+	while (end < size && data[end] != '\n') end++;
+	if (end == size) return 0;
+	return end + 1;
+}
+
+
+// loads one row of samples (8 bit, or 16 bit little endian) as floats in 8-bit units.
+inline void load_row(const unsigned char* src, int n, int bitdepth, float* dst) {
+	if (bitdepth <= 8) {
+		int i = 0;
+#if YUVIO_USE_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 16 <= n; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i*)(src + i));
+			__m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+			_mm_storeu_ps(dst + i, _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)));
+			_mm_storeu_ps(dst + i + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)));
+			_mm_storeu_ps(dst + i + 8, _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)));
+			_mm_storeu_ps(dst + i + 12, _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)));
+		}
+#endif
+		for (; i < n; i++) dst[i] = src[i];
+	} else {
+		const float scale = 1.f / (float)(1 << (bitdepth - 8));
+		for (int i = 0; i < n; i++) dst[i] = (src[2 * i] | (src[2 * i + 1] << 8))*scale;
+	}
+}
+
+// upsamples one chroma row (in 8-bit units) to luma width.
+inline void upsample_chroma_row(const float* c, int Wc, int W, bool bilinear, ChromaSiting siting, float* dst) {
+	if (!bilinear) {
+		for (int x = 0; x < W; x++) dst[x] = c[x >> 1];
+		return;
+	}
+	if (siting == CHROMA_LEFT || siting == CHROMA_TOPLEFT) { // co-sited with the even luma samples
+		for (int k = 0; 2 * k < W; k++) {
+			dst[2 * k] = c[k];
+			if (2 * k + 1 < W) dst[2 * k + 1] = 0.5f*(c[k] + c[std::min(k + 1, Wc - 1)]);
+		}
+	} else {
+		for (int k = 0; 2 * k < W; k++) {
+			dst[2 * k] = 0.75f*c[k] + 0.25f*c[std::max(k - 1, 0)];
+			if (2 * k + 1 < W) dst[2 * k + 1] = 0.75f*c[k] + 0.25f*c[std::min(k + 1, Wc - 1)];
+		}
+	}
+}
+
+// Y, Cb, Cr rows (8-bit units) -> interleaved RGB in [0,1].
+inline void ycbcr_row_to_rgb(const float* Y, const float* Cb, const float* Cr, int W, float* rgb) {
+	const float ky = 298.f / (256.f*255.f), krv = 409.f / (256.f*255.f), kgu = -100.f / (256.f*255.f), kgv = -208.f / (256.f*255.f), kbu = 516.f / (256.f*255.f);
+	int x = 0;
+#if YUVIO_USE_SSE2
+	const __m128 vky = _mm_set1_ps(ky), vkrv = _mm_set1_ps(krv), vkgu = _mm_set1_ps(kgu), vkgv = _mm_set1_ps(kgv), vkbu = _mm_set1_ps(kbu);
+	const __m128 v16 = _mm_set1_ps(16.f), v128 = _mm_set1_ps(128.f), zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+	for (; x + 4 <= W; x += 4) {
+		__m128 y = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(Y + x), v16), vky);
+		__m128 u = _mm_sub_ps(_mm_loadu_ps(Cb + x), v128);
+		__m128 v = _mm_sub_ps(_mm_loadu_ps(Cr + x), v128);
+		__m128 R = _mm_min_ps(one, _mm_max_ps(zero, _mm_add_ps(y, _mm_mul_ps(v, vkrv))));
+		__m128 G = _mm_min_ps(one, _mm_max_ps(zero, _mm_add_ps(y, _mm_add_ps(_mm_mul_ps(u, vkgu), _mm_mul_ps(v, vkgv)))));
+		__m128 B = _mm_min_ps(one, _mm_max_ps(zero, _mm_add_ps(y, _mm_mul_ps(u, vkbu))));
+
+		// RRRR GGGG BBBB -> RGBR GBRG BRGB
+		__m128 t0 = _mm_unpacklo_ps(R, G), t1 = _mm_unpackhi_ps(R, G);
+		__m128 a = _mm_shuffle_ps(B, t0, _MM_SHUFFLE(2, 2, 0, 0));
+		__m128 b = _mm_shuffle_ps(t0, B, _MM_SHUFFLE(1, 1, 3, 3));
+		__m128 c = _mm_shuffle_ps(B, t1, _MM_SHUFFLE(2, 2, 2, 2));
+		__m128 d = _mm_shuffle_ps(t1, B, _MM_SHUFFLE(3, 3, 3, 3));
+		_mm_storeu_ps(rgb + 3 * x, _mm_shuffle_ps(t0, a, _MM_SHUFFLE(2, 0, 1, 0)));
+		_mm_storeu_ps(rgb + 3 * x + 4, _mm_shuffle_ps(b, t1, _MM_SHUFFLE(1, 0, 2, 0)));
+		_mm_storeu_ps(rgb + 3 * x + 8, _mm_shuffle_ps(c, d, _MM_SHUFFLE(2, 0, 2, 0)));
+	}
+#endif
+	for (; x < W; x++) {
+		const float y = (Y[x] - 16.f)*ky, u = Cb[x] - 128.f, v = Cr[x] - 128.f;
+		rgb[3 * x] = std::min(1.f, std::max(0.f, y + krv*v));
+		rgb[3 * x + 1] = std::min(1.f, std::max(0.f, y + kgu*u + kgv*v));
+		rgb[3 * x + 2] = std::min(1.f, std::max(0.f, y + kbu*u));
+	}
+}
+
+// same, for non-float frames (goes through a float row).
+template<typename T>
+inline void ycbcr_row_to_rgb(const float* Y, const float* Cb, const float* Cr, int W, T* rgb, float* tmp) {
+	ycbcr_row_to_rgb(Y, Cb, Cr, W, tmp);
+	for (int j = 0; j < 3 * W; j++) rgb[j] = (T)tmp[j];
+}
+inline void ycbcr_row_to_rgb(const float* Y, const float* Cb, const float* Cr, int W, float* rgb, float*) { // no conversion buffer
+	ycbcr_row_to_rgb(Y, Cb, Cr, W, rgb);
+}
+
+// f(first, last) for blocks of rows covering [0, n), on the scheduler ; row buffers are allocated once per block.
+#define YUV_ROW_BLOCK 16
+template<typename F>
+void for_row_blocks(int n, int stage, const F &f) {
+	const int nblocks = (n + YUV_ROW_BLOCK - 1) / YUV_ROW_BLOCK;
+	Scheduler::instance().parallel_for(0, nblocks, [&](int b) {
+		f(b * YUV_ROW_BLOCK, std::min(n, (b + 1) * YUV_ROW_BLOCK));
+	}, stage, 1);
+}
+
+// 4:2:0 planes -> interleaved RGB frame in [0,1], chroma upsampling and colour conversion fused per row.
+template<typename T>
+void yuv420_to_rgb(const YUVPlanes &src, T* frame, bool bilinear) {
+
+	const YUVFormat &fmt = src.fmt;
+	const int W = fmt.W, H = fmt.H, Wc = fmt.chroma_W(), Hc = fmt.chroma_H();
+	const int bps = fmt.bytes_per_sample();
+
+	for_row_blocks(H, STAGE_DECODE, [&](int first, int last) {
+		std::vector<float> Y(W + 4), Cb(W + 4), Cr(W + 4), rowc0(Wc), rowc1(Wc), chroma(Wc), rgb(3 * W + 12);
+		for (int i = first; i < last; i++) {
+			load_row(src.plane[0] + (size_t)i*src.stride[0] * bps, W, fmt.bitdepth, &Y[0]);
+
+			for (int k = 1; k < 3; k++) {
+				const unsigned char* plane = src.plane[k];
+				const size_t stride = (size_t)src.stride[k] * bps;
+				int r0 = i >> 1, r1 = r0;
+				float w1 = 0.f;
+				if (bilinear && fmt.siting == CHROMA_TOPLEFT) { // co-sited with the even luma rows
+					if (i & 1) {
+						r1 = std::min(r0 + 1, Hc - 1);
+						w1 = 0.5f;
+					}
+				} else if (bilinear) { // vertically centered chroma
+					r1 = (i & 1) ? std::min(r0 + 1, Hc - 1) : std::max(r0 - 1, 0);
+					w1 = 0.25f;
+				}
+				load_row(plane + r0*stride, Wc, fmt.bitdepth, &rowc0[0]);
+				if (w1 > 0.f) {
+					load_row(plane + r1*stride, Wc, fmt.bitdepth, &rowc1[0]);
+					for (int x = 0; x < Wc; x++) chroma[x] = (1.f - w1)*rowc0[x] + w1*rowc1[x];
+				} else {
+					chroma = rowc0;
+				}
+				upsample_chroma_row(&chroma[0], Wc, W, bilinear, fmt.siting, k == 1 ? &Cb[0] : &Cr[0]);
+			}
+
+			ycbcr_row_to_rgb(&Y[0], &Cb[0], &Cr[0], W, frame + (size_t)i*W * 3, &rgb[0]);
+		}
+	});
+}
+
+
+// RGB in [0,1] (interleaved) -> 4:2:0 planes, in one pass over pairs of rows.
+// Chroma is computed from the 2x2 box-filtered RGB (centered siting, as 420jpeg), which is
+// equivalent to box filtering Cb/Cr since the conversion is linear.
+// Same BT.601 coefficients as CImg::RGBtoYCbCr(). Output samples are 8 bit, or little-endian 16 bit words if bitdepth > 8.
+
+inline void store_samples(const float* v, int n, int bitdepth, unsigned char* dst) {
+	const float maxval = (float)((1 << bitdepth) - 1);
+	int i = 0;
+#if YUVIO_USE_SSE2
+	// rounds half up, as the scalar loop : truncation of the clamped value + 0.5
+	const __m128 zero = _mm_setzero_ps(), vmax = _mm_set1_ps(maxval), half = _mm_set1_ps(0.5f);
+	if (bitdepth <= 8) {
+		for (; i + 8 <= n; i += 8) {
+			__m128i a = _mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(vmax, _mm_max_ps(zero, _mm_loadu_ps(v + i))), half));
+			__m128i b = _mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(vmax, _mm_max_ps(zero, _mm_loadu_ps(v + i + 4))), half));
+			__m128i s = _mm_packs_epi32(a, b);
+			_mm_storel_epi64((__m128i*)(dst + i), _mm_packus_epi16(s, s));
+		}
+	} else if (bitdepth <= 15) {
+		for (; i + 8 <= n; i += 8) {
+			__m128i a = _mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(vmax, _mm_max_ps(zero, _mm_loadu_ps(v + i))), half));
+			__m128i b = _mm_cvttps_epi32(_mm_add_ps(_mm_min_ps(vmax, _mm_max_ps(zero, _mm_loadu_ps(v + i + 4))), half));
+			_mm_storeu_si128((__m128i*)(dst + 2 * i), _mm_packs_epi32(a, b));
+		}
+	}
+#endif
+	for (; i < n; i++) {
+		int s = (int)(std::min(maxval, std::max(0.f, v[i])) + 0.5f);
+		if (bitdepth <= 8) {
+			dst[i] = (unsigned char)s;
+		} else {
+			dst[2 * i] = (unsigned char)(s & 255);
+			dst[2 * i + 1] = (unsigned char)(s >> 8);
+		}
+	}
+}
+
+#if YUVIO_USE_SSE2
+// RGBR GBRG BRGB -> RRRR GGGG BBBB, clamped to [0,1]
+inline void load_rgb4(const float* rgb, __m128 &R, __m128 &G, __m128 &B) {
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.f);
+	__m128 in0 = _mm_loadu_ps(rgb), in1 = _mm_loadu_ps(rgb + 4), in2 = _mm_loadu_ps(rgb + 8);
+	__m128 lo = _mm_shuffle_ps(in0, in0, _MM_SHUFFLE(3, 0, 3, 0)), hi = _mm_shuffle_ps(in1, in2, _MM_SHUFFLE(1, 1, 2, 2));
+	R = _mm_min_ps(one, _mm_max_ps(zero, _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 1, 0))));
+	lo = _mm_shuffle_ps(in0, in1, _MM_SHUFFLE(0, 0, 1, 1)); hi = _mm_shuffle_ps(in1, in2, _MM_SHUFFLE(2, 2, 3, 3));
+	G = _mm_min_ps(one, _mm_max_ps(zero, _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))));
+	lo = _mm_shuffle_ps(in0, in1, _MM_SHUFFLE(1, 1, 2, 2)); hi = _mm_shuffle_ps(in2, in2, _MM_SHUFFLE(3, 3, 0, 0));
+	B = _mm_min_ps(one, _mm_max_ps(zero, _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))));
+}
+#endif
+
+template<typename T>
+inline float clamp01(T v) { return std::min(1.f, std::max(0.f, (float)v)); }
+
+// Y = 16 + (66R + 129G + 25B)*255/256, Cb = 128 + (-38R - 74G + 112B)*255/256, Cr = 128 + (112R - 94G - 18B)*255/256 (R,G,B in [0,1]),
+// all scaled by 2^(bitdepth-8).
+struct RGBtoYUVCoefs {
+	RGBtoYUVCoefs(float scale) {
+		const float k = scale*255.f / 256.f;
+		yr = 66 * k; yg = 129 * k; yb = 25 * k;
+		ur = -38 * k; ug = -74 * k; ub = 112 * k;
+		vr = 112 * k; vg = -94 * k; vb = -18 * k;
+		off_y = 16 * scale; off_c = 128 * scale;
+	}
+	float yr, yg, yb, ur, ug, ub, vr, vg, vb, off_y, off_c;
+};
+
+// converts rows i and i+1 from column x on (row1==row0 for the last row of an odd-height frame).
+template<typename T>
+void rgb_rows_to_yuv420(const T* row0, const T* row1, int W, const RGBtoYUVCoefs &k, float* Y0, float* Y1, float* Cb, float* Cr, int x = 0) {
+
+	for (; x < W; x += 2) {
+		float R = 0, G = 0, B = 0;
+		for (int dx = x; dx <= x + 1; dx++) {
+			const int xx = std::min(dx, W - 1);
+			const float r0 = clamp01(row0[3 * xx]), g0 = clamp01(row0[3 * xx + 1]), b0 = clamp01(row0[3 * xx + 2]);
+			const float r1 = clamp01(row1[3 * xx]), g1 = clamp01(row1[3 * xx + 1]), b1 = clamp01(row1[3 * xx + 2]);
+			if (dx < W) {
+				Y0[dx] = k.off_y + k.yr*r0 + k.yg*g0 + k.yb*b0;
+				Y1[dx] = k.off_y + k.yr*r1 + k.yg*g1 + k.yb*b1;
+			}
+			R += r0 + r1; G += g0 + g1; B += b0 + b1;
+		}
+		Cb[x / 2] = k.off_c + 0.25f*(k.ur*R + k.ug*G + k.ub*B);
+		Cr[x / 2] = k.off_c + 0.25f*(k.vr*R + k.vg*G + k.vb*B);
+	}
+}
+
+#if YUVIO_USE_SSE2
+inline void rgb_rows_to_yuv420(const float* row0, const float* row1, int W, const RGBtoYUVCoefs &k, float* Y0, float* Y1, float* Cb, float* Cr, int x = 0) {
+
+	const __m128 vyr = _mm_set1_ps(k.yr), vyg = _mm_set1_ps(k.yg), vyb = _mm_set1_ps(k.yb), voy = _mm_set1_ps(k.off_y);
+	const __m128 vur = _mm_set1_ps(k.ur*0.25f), vug = _mm_set1_ps(k.ug*0.25f), vub = _mm_set1_ps(k.ub*0.25f);
+	const __m128 vvr = _mm_set1_ps(k.vr*0.25f), vvg = _mm_set1_ps(k.vg*0.25f), vvb = _mm_set1_ps(k.vb*0.25f), voc = _mm_set1_ps(k.off_c);
+	for (; x + 8 <= W; x += 8) {
+		__m128 Ra0, Ga0, Ba0, Rb0, Gb0, Bb0, Ra1, Ga1, Ba1, Rb1, Gb1, Bb1;
+		load_rgb4(row0 + 3 * x, Ra0, Ga0, Ba0);
+		load_rgb4(row0 + 3 * x + 12, Rb0, Gb0, Bb0);
+		load_rgb4(row1 + 3 * x, Ra1, Ga1, Ba1);
+		load_rgb4(row1 + 3 * x + 12, Rb1, Gb1, Bb1);
+		_mm_storeu_ps(Y0 + x, _mm_add_ps(voy, _mm_add_ps(_mm_mul_ps(vyr, Ra0), _mm_add_ps(_mm_mul_ps(vyg, Ga0), _mm_mul_ps(vyb, Ba0)))));
+		_mm_storeu_ps(Y0 + x + 4, _mm_add_ps(voy, _mm_add_ps(_mm_mul_ps(vyr, Rb0), _mm_add_ps(_mm_mul_ps(vyg, Gb0), _mm_mul_ps(vyb, Bb0)))));
+		_mm_storeu_ps(Y1 + x, _mm_add_ps(voy, _mm_add_ps(_mm_mul_ps(vyr, Ra1), _mm_add_ps(_mm_mul_ps(vyg, Ga1), _mm_mul_ps(vyb, Ba1)))));
+		_mm_storeu_ps(Y1 + x + 4, _mm_add_ps(voy, _mm_add_ps(_mm_mul_ps(vyr, Rb1), _mm_add_ps(_mm_mul_ps(vyg, Gb1), _mm_mul_ps(vyb, Bb1)))));
+
+		// 2x2 box sums
+		__m128 Ra = _mm_add_ps(Ra0, Ra1), Rb = _mm_add_ps(Rb0, Rb1), Ga = _mm_add_ps(Ga0, Ga1), Gb = _mm_add_ps(Gb0, Gb1), Ba = _mm_add_ps(Ba0, Ba1), Bb = _mm_add_ps(Bb0, Bb1);
+		__m128 R = _mm_add_ps(_mm_shuffle_ps(Ra, Rb, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(Ra, Rb, _MM_SHUFFLE(3, 1, 3, 1)));
+		__m128 G = _mm_add_ps(_mm_shuffle_ps(Ga, Gb, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(Ga, Gb, _MM_SHUFFLE(3, 1, 3, 1)));
+		__m128 B = _mm_add_ps(_mm_shuffle_ps(Ba, Bb, _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_ps(Ba, Bb, _MM_SHUFFLE(3, 1, 3, 1)));
+		_mm_storeu_ps(Cb + x / 2, _mm_add_ps(voc, _mm_add_ps(_mm_mul_ps(vur, R), _mm_add_ps(_mm_mul_ps(vug, G), _mm_mul_ps(vub, B)))));
+		_mm_storeu_ps(Cr + x / 2, _mm_add_ps(voc, _mm_add_ps(_mm_mul_ps(vvr, R), _mm_add_ps(_mm_mul_ps(vvg, G), _mm_mul_ps(vvb, B)))));
+	}
+	rgb_rows_to_yuv420<float>(row0, row1, W, k, Y0, Y1, Cb, Cr, x);
+}
+#endif
+
+// interleaved RGB frame in [0,1] -> contiguous Y, U, V planes written at dst (fmt.frame_size() bytes).
+template<typename T>
+void rgb_to_yuv420(const T* frame, const YUVFormat &fmt, unsigned char* dst) {
+
+	const int W = fmt.W, H = fmt.H, Wc = fmt.chroma_W(), Hc = fmt.chroma_H();
+	const int bps = fmt.bytes_per_sample();
+	const RGBtoYUVCoefs k((float)(1 << (fmt.bitdepth - 8)));
+	unsigned char* planeY = dst;
+	unsigned char* planeU = dst + fmt.luma_size();
+	unsigned char* planeV = planeU + fmt.chroma_size();
+
+	for_row_blocks(Hc, STAGE_ENCODE, [&](int first, int last) {
+		std::vector<float> Y0(W + 8), Y1(W + 8), Cb(Wc + 4), Cr(Wc + 4);
+		for (int j = first; j < last; j++) {
+			const int i = 2 * j;
+			const T* row0 = frame + (size_t)i*W * 3;
+			const T* row1 = (i + 1 < H) ? row0 + W * 3 : row0;
+			rgb_rows_to_yuv420(row0, row1, W, k, &Y0[0], &Y1[0], &Cb[0], &Cr[0]);
+			store_samples(&Y0[0], W, fmt.bitdepth, planeY + (size_t)i*W*bps);
+			if (i + 1 < H) store_samples(&Y1[0], W, fmt.bitdepth, planeY + (size_t)(i + 1)*W*bps);
+			store_samples(&Cb[0], Wc, fmt.bitdepth, planeU + (size_t)j*Wc*bps);
+			store_samples(&Cr[0], Wc, fmt.bitdepth, planeV + (size_t)j*Wc*bps);
+		}
+	});
+}
+
+// Frames of the 4:2:0 solve : the Y plane (W*H values), then Cb and Cr interleaved at chroma resolution
+// ((W+1)/2 x (H+1)/2 pairs), in [0,1] (8-bit units / 255). No resampling nor colour conversion from the 4:2:0 planes.
+inline size_t planar420_size(int W, int H) {
+	return (size_t)W*H + 2 * (size_t)((W + 1) / 2)*((H + 1) / 2);
+}
+
+// 4:2:0 planes -> planar 4:2:0 frame.
+template<typename T>
+void yuv420_to_planar(const YUVPlanes &src, T* frame) {
+
+	const YUVFormat &fmt = src.fmt;
+	const int W = fmt.W, H = fmt.H, Wc = fmt.chroma_W(), Hc = fmt.chroma_H();
+	const int bps = fmt.bytes_per_sample();
+	T* chroma = frame + (size_t)W*H;
+
+	for_row_blocks(H + Hc, STAGE_DECODE, [&](int first, int last) {
+		std::vector<float> row(std::max(W, Wc)), cb(Wc);
+		for (int i = first; i < last; i++) {
+			if (i < H) {
+				load_row(src.plane[0] + (size_t)i*src.stride[0] * bps, W, fmt.bitdepth, &row[0]);
+				for (int x = 0; x < W; x++) frame[(size_t)i*W + x] = (T)(row[x] * (1.f / 255.f));
+			} else {
+				const int j = i - H;
+				load_row(src.plane[1] + (size_t)j*src.stride[1] * bps, Wc, fmt.bitdepth, &cb[0]);
+				load_row(src.plane[2] + (size_t)j*src.stride[2] * bps, Wc, fmt.bitdepth, &row[0]);
+				T* dst = chroma + (size_t)j*Wc * 2;
+				for (int x = 0; x < Wc; x++) {
+					dst[2 * x] = (T)(cb[x] * (1.f / 255.f));
+					dst[2 * x + 1] = (T)(row[x] * (1.f / 255.f));
+				}
+			}
+		}
+	});
+}
+
+// planar 4:2:0 frame -> contiguous Y, U, V planes written at dst (fmt.frame_size() bytes).
+template<typename T>
+void planar_to_yuv420(const T* frame, const YUVFormat &fmt, unsigned char* dst) {
+
+	const int W = fmt.W, H = fmt.H, Wc = fmt.chroma_W(), Hc = fmt.chroma_H();
+	const int bps = fmt.bytes_per_sample();
+	const float scale = 255.f * (float)(1 << (fmt.bitdepth - 8));
+	const T* chroma = frame + (size_t)W*H;
+	unsigned char* planeU = dst + fmt.luma_size();
+	unsigned char* planeV = planeU + fmt.chroma_size();
+
+	for_row_blocks(H + Hc, STAGE_ENCODE, [&](int first, int last) {
+		std::vector<float> row(std::max(W, Wc)), cr(Wc);
+		for (int i = first; i < last; i++) {
+			if (i < H) {
+				for (int x = 0; x < W; x++) row[x] = (float)frame[(size_t)i*W + x] * scale;
+				store_samples(&row[0], W, fmt.bitdepth, dst + (size_t)i*W*bps);
+			} else {
+				const int j = i - H;
+				const T* src = chroma + (size_t)j*Wc * 2;
+				for (int x = 0; x < Wc; x++) {
+					row[x] = (float)src[2 * x] * scale;
+					cr[x] = (float)src[2 * x + 1] * scale;
+				}
+				store_samples(&row[0], Wc, fmt.bitdepth, planeU + (size_t)j*Wc*bps);
+				store_samples(&cr[0], Wc, fmt.bitdepth, planeV + (size_t)j*Wc*bps);
+			}
+		}
+	});
+}
+
+// interleaved RGB frame in [0,1] -> planar 4:2:0 frame (inputs that are not 4:2:0 streams), as rgb_to_yuv420.
+template<typename T>
+void rgb_to_planar420(const T* rgb, int W, int H, T* frame) {
+
+	const int Wc = (W + 1) / 2, Hc = (H + 1) / 2;
+	const RGBtoYUVCoefs k(1.f);
+	T* chroma = frame + (size_t)W*H;
+
+	for_row_blocks(Hc, STAGE_DECODE, [&](int first, int last) {
+		std::vector<float> Y0(W + 8), Y1(W + 8), Cb(Wc + 4), Cr(Wc + 4);
+		for (int j = first; j < last; j++) {
+			const int i = 2 * j;
+			const T* row0 = rgb + (size_t)i*W * 3;
+			const T* row1 = (i + 1 < H) ? row0 + W * 3 : row0;
+			rgb_rows_to_yuv420(row0, row1, W, k, &Y0[0], &Y1[0], &Cb[0], &Cr[0]);
+			for (int x = 0; x < W; x++) {
+				frame[(size_t)i*W + x] = (T)(Y0[x] * (1.f / 255.f));
+				if (i + 1 < H) frame[(size_t)(i + 1)*W + x] = (T)(Y1[x] * (1.f / 255.f));
+			}
+			for (int x = 0; x < Wc; x++) {
+				chroma[((size_t)j*Wc + x) * 2] = (T)(Cb[x] * (1.f / 255.f));
+				chroma[((size_t)j*Wc + x) * 2 + 1] = (T)(Cr[x] * (1.f / 255.f));
+			}
+		}
+	});
+}
+
+// planar 4:2:0 frame -> interleaved RGB frame in [0,1] (outputs that are not 4:2:0 streams), as yuv420_to_rgb with
+// bilinear chroma at the centered siting.
+template<typename T>
+void planar420_to_rgb(const T* frame, int W, int H, T* rgb) {
+
+	const int Wc = (W + 1) / 2, Hc = (H + 1) / 2;
+	const T* chroma = frame + (size_t)W*H;
+
+	for_row_blocks(H, STAGE_ENCODE, [&](int first, int last) {
+		std::vector<float> Y(W + 4), Cb(W + 4), Cr(W + 4), rowcb(Wc), rowcr(Wc), tmp(3 * W + 12);
+		for (int i = first; i < last; i++) {
+			for (int x = 0; x < W; x++) Y[x] = (float)frame[(size_t)i*W + x] * 255.f;
+			const int r0 = i >> 1, r1 = (i & 1) ? std::min(r0 + 1, Hc - 1) : std::max(r0 - 1, 0);
+			const T* c0 = chroma + (size_t)r0*Wc * 2;
+			const T* c1 = chroma + (size_t)r1*Wc * 2;
+			for (int x = 0; x < Wc; x++) {
+				rowcb[x] = (0.75f*(float)c0[2 * x] + 0.25f*(float)c1[2 * x]) * 255.f;
+				rowcr[x] = (0.75f*(float)c0[2 * x + 1] + 0.25f*(float)c1[2 * x + 1]) * 255.f;
+			}
+			upsample_chroma_row(&rowcb[0], Wc, W, true, CHROMA_CENTER, &Cb[0]);
+			upsample_chroma_row(&rowcr[0], Wc, W, true, CHROMA_CENTER, &Cr[0]);
+			ycbcr_row_to_rgb(&Y[0], &Cb[0], &Cr[0], W, rgb + (size_t)i*W * 3, &tmp[0]);
+		}
+	});
+}
+
+inline std::string y4m_header(const YUVFormat &fmt) {
+	char buf[128];
+	if (fmt.bitdepth > 8)
+		sprintf(buf, "%s W%d H%d F%d:%d Ip A1:1 C420p%d XYSCSS=420P%d\n", Y4M_MAGIC, fmt.W, fmt.H, fmt.fps_num, fmt.fps_den, fmt.bitdepth, fmt.bitdepth);
+	else
+		sprintf(buf, "%s W%d H%d F%d:%d Ip A1:1 C420jpeg XYSCSS=420JPEG\n", Y4M_MAGIC, fmt.W, fmt.H, fmt.fps_num, fmt.fps_den);
+	return std::string(buf);
+}
+
+
+// pipes and stdin/stdout are opened in text mode on Windows
+inline void set_binary_mode(int fd) {
+#ifdef _WIN32
+	_setmode(fd, _O_BINARY);
+#else
+	(void)fd;
+#endif
+}
+
+// "-" and "pipe:" are stdin/stdout, "pipe:N" is descriptor N (as in ffmpeg) ; -1 for regular files.
+inline int pipe_descriptor(const std::string &name, int std_fd) {
+	if (name == "-" || name == "pipe:") return std_fd;
+	if (name.compare(0, 5, "pipe:") == 0) return atoi(name.c_str() + 5);
+	return -1;
+}
+
+// cuts an existing file down to 'size' bytes (resuming an output) ; false if it is missing or shorter.
+inline bool truncate_file(const char* filename, long long size) {
+#ifdef _WIN32
+	int fd = _open(filename, _O_RDWR | _O_BINARY);
+	if (fd < 0) return false;
+	bool ok = _filelengthi64(fd) >= size && _chsize_s(fd, size) == 0;
+	_close(fd);
+	return ok;
+#else
+	struct stat st;
+	if (stat(filename, &st) != 0 || (long long)st.st_size < size) return false;
+	return truncate(filename, (off_t)size) == 0;
+#endif
+}
+
+// Moves stdout to a new descriptor for binary output, and points descriptor 1 to stderr,
+// so that log messages printed on stdout do not end up in the stream.
+inline int detach_stdout() {
+	std::cout.flush();
+	fflush(stdout);
+#ifdef _WIN32
+	int fd = _dup(1);
+	_dup2(2, 1);
+#else
+	int fd = dup(1);
+	dup2(2, 1);
+#endif
+	return fd;
+}
+
+
+// Write-only file with a single large aligned buffer ; data is produced directly into the buffer (reserve/commit),
+// and written in big chunks. With direct_io (Linux O_DIRECT), full aligned chunks bypass the page cache.
+class BufferedWriter {
+public:
+	BufferedWriter() : fd(-1), buffer(NULL), capacity(0), used(0), direct(false), error(false), written(0) {}
+	~BufferedWriter() { close(); }
+
+	bool open(const char* filename, size_t buffer_size = 32 << 20, bool direct_io = false, bool append = false) {
+		close();
+		error = false;
+		int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+#ifdef _WIN32
+		fd = _open(filename, flags | _O_BINARY, _S_IREAD | _S_IWRITE);
+		direct = false;
+#else
+#ifdef O_DIRECT
+		if (direct_io && !append) flags |= O_DIRECT;
+		direct = direct_io && !append;
+		fd = ::open(filename, flags, 0644);
+		if (fd < 0 && direct) { // filesystem without O_DIRECT support (tmpfs...)
+			direct = false;
+			fd = ::open(filename, flags & ~O_DIRECT, 0644);
+		}
+#else
+		direct = false;
+		fd = ::open(filename, flags, 0644);
+#endif
+#endif
+		if (fd < 0) {
+			std::cout << "cannot open " << filename << " for writing" << std::endl;
+			error = true;
+			return false;
+		}
+		grow(buffer_size);
+		return true;
+	}
+
+	// writes to an already open descriptor (pipe, stdout) ; it is closed by close().
+	bool open_fd(int fd, size_t buffer_size = 32 << 20) {
+		close();
+		set_binary_mode(fd);
+		this->fd = fd;
+		direct = false;
+		error = false;
+		grow(buffer_size);
+		return true;
+	}
+
+	// pointer to n writable bytes ; they are part of the file once commit(n) is called.
+	unsigned char* reserve(size_t n) {
+		if (used + n > capacity) {
+			flush(false);
+			if (used + n > capacity) grow(used + n);
+		}
+		return buffer + used;
+	}
+	void commit(size_t n) { used += n; written += n; }
+
+	void write(const void* data, size_t n) {
+		memcpy(reserve(n), data, n);
+		commit(n);
+	}
+
+	// false if some data could not be written.
+	bool close() {
+		if (fd >= 0) {
+			flush(true);
+#ifdef _WIN32
+			_close(fd);
+#else
+			::close(fd);
+#endif
+		}
+		fd = -1;
+		free_buffer();
+		return !error;
+	}
+
+	// writes all buffered bytes now (checkpoints) ; with direct_io, the unaligned tail ends O_DIRECT writes.
+	// false if some data could not be written.
+	bool sync() {
+		flush(true);
+		return !error;
+	}
+
+	bool is_open() const { return fd >= 0; }
+	// the file could not be opened, or a write failed : later data is discarded, the output is incomplete.
+	bool failed() const { return error; }
+	size_t bytes_written() const { return written; }
+
+private:
+	static const size_t ALIGN = 4096;
+
+	// writes the buffer ; only whole aligned blocks unless final (O_DIRECT requirement).
+	void flush(bool final) {
+		if (fd < 0 || used == 0) return;
+		if (error) {
+			used = 0;
+			return;
+		}
+		size_t n = used;
+		if (direct) {
+			if (final) {
+#if !defined(_WIN32) && defined(O_DIRECT)
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+#endif
+				direct = false;
+			} else {
+				n = (used / ALIGN) * ALIGN;
+			}
+		}
+		size_t done = 0;
+		while (done < n) {
+#ifdef _WIN32
+			int w = _write(fd, buffer + done, (unsigned int)std::min(n - done, (size_t)1 << 30));
+#else
+			ssize_t w = ::write(fd, buffer + done, n - done);
+#endif
+			if (w <= 0) {
+				std::cout << "write error" << std::endl;
+				error = true;
+				used = 0;
+				return;
+			}
+			done += w;
+		}
+		memmove(buffer, buffer + n, used - n);
+		used -= n;
+	}
+
+	void grow(size_t n) {
+		n = ((n + ALIGN - 1) / ALIGN) * ALIGN;
+		if (n <= capacity) return;
+		unsigned char* b;
+#ifdef _WIN32
+		b = (unsigned char*)_aligned_malloc(n, ALIGN);
+#else
+		void* p = NULL;
+		if (posix_memalign(&p, ALIGN, n) != 0) p = NULL;
+		b = (unsigned char*)p;
+#endif
+		if (used) memcpy(b, buffer, used);
+		free_buffer();
+		buffer = b;
+		capacity = n;
+	}
+
+	void free_buffer() {
+#ifdef _WIN32
+		if (buffer) _aligned_free(buffer);
+#else
+		free(buffer);
+#endif
+		buffer = NULL;
+		capacity = 0;
+	}
+
+	int fd;
+	unsigned char* buffer;
+	size_t capacity, used;
+	bool direct, error;
+	size_t written;
+};
+
+
+// Sequential reader on a descriptor (pipe, stdin) with a large buffer. Reads that are larger than
+// what is buffered go directly to the destination, so the memory used is bounded by the buffer size.
+class BufferedReader {
+public:
+	BufferedReader() : fd(-1), pos(0), end(0), at_eof(false) {}
+
+	void open_fd(int fd, size_t buffer_size = 8 << 20) {
+		set_binary_mode(fd);
+		this->fd = fd;
+		buffer.resize(buffer_size);
+		pos = end = 0;
+		at_eof = false;
+	}
+
+	// n bytes ; false if the stream ends before.
+	bool read(void* dst, size_t n) {
+		unsigned char* d = (unsigned char*)dst;
+		size_t avail = std::min(n, end - pos);
+		memcpy(d, &buffer[pos], avail);
+		pos += avail;
+		d += avail;
+		n -= avail;
+		if (n >= buffer.size()) {
+			while (n > 0) {
+				long r = raw_read(d, n);
+				if (r <= 0) return false;
+				d += r;
+				n -= r;
+			}
+			return true;
+		}
+		while (n > 0) {
+			if (pos == end && !fill()) return false;
+			avail = std::min(n, end - pos);
+			memcpy(d, &buffer[pos], avail);
+			pos += avail;
+			d += avail;
+			n -= avail;
+		}
+		return true;
+	}
+
+	// the next n bytes, without consuming them (n must fit in the buffer) ; NULL if the stream ends before.
+	const unsigned char* peek(size_t n) {
+		if (end - pos < n) {
+			memmove(&buffer[0], &buffer[pos], end - pos);
+			end -= pos;
+			pos = 0;
+			while (end < n) {
+				if (!fill()) return NULL;
+			}
+		}
+		return &buffer[pos];
+	}
+
+	// a line, '\n' included ; false at the end of the stream or if it is longer than max_len.
+	bool read_line(std::string &line, size_t max_len = 4096) {
+		line.clear();
+		while (line.size() < max_len) {
+			if (pos == end && !fill()) return false;
+			char c = (char)buffer[pos++];
+			line += c;
+			if (c == '\n') return true;
+		}
+		return false;
+	}
+
+	bool eof() const { return at_eof && pos == end; }
+
+private:
+	// appends to the buffered data
+	bool fill() {
+		if (at_eof) return false;
+		if (pos == end) pos = end = 0;
+		long r = raw_read(&buffer[end], buffer.size() - end);
+		if (r <= 0) {
+			at_eof = true;
+			return false;
+		}
+		end += r;
+		return true;
+	}
+
+	long raw_read(unsigned char* dst, size_t n) {
+#ifdef _WIN32
+		return _read(fd, dst, (unsigned int)std::min(n, (size_t)1 << 30));
+#else
+		return (long)::read(fd, dst, n);
+#endif
+	}
+
+	int fd;
+	std::vector<unsigned char> buffer;
+	size_t pos, end;
+	bool at_eof;
+};
+
+// 4:2:0 frames read from a pipe : a YUV4MPEG2 stream, or raw I420 frames of a given size.
+// Input and processed frames can be interleaved in a single stream (one source shared by two streamers).
+class YUVPipeSource {
+public:
+	YUVPipeSource(int fd, int W, int H, int bitdepth = 8) : is_y4m(false) {
+		reader.open_fd(fd);
+		const size_t magic_len = strlen(Y4M_MAGIC);
+		const unsigned char* head = reader.peek(magic_len);
+		if (head && memcmp(head, Y4M_MAGIC, magic_len) == 0) {
+			std::string header;
+			if (reader.read_line(header) && parse_y4m_header((const unsigned char*)header.data(), header.size(), fmt) > 0)
+				is_y4m = true;
+			else
+				fmt.W = fmt.H = 0;
+		} else {
+			fmt.W = W;
+			fmt.H = H;
+			fmt.bitdepth = bitdepth;
+		}
+		if (fmt.W <= 0 || fmt.H <= 0) {
+			std::cout << "pipe input : unknown frame size (give W and H for raw streams)" << std::endl;
+			fmt.W = fmt.H = 0;
+		}
+	}
+
+	// next frame ; the planes point into an internal buffer, valid until the next call.
+	bool next_frame(YUVPlanes &planes) {
+		if (fmt.W <= 0) return false;
+		if (is_y4m) {
+			std::string marker;
+			if (!reader.read_line(marker)) return false;
+			if (parse_y4m_frame_header((const unsigned char*)marker.data(), marker.size()) == 0) {
+				std::cout << "bad frame marker in y4m stream" << std::endl;
+				return false;
+			}
+		}
+		frame.resize(fmt.frame_size());
+		if (!reader.read(&frame[0], frame.size())) return false;
+
+		planes.fmt = fmt;
+		planes.plane[0] = &frame[0];
+		planes.plane[1] = planes.plane[0] + fmt.luma_size();
+		planes.plane[2] = planes.plane[1] + fmt.chroma_size();
+		planes.stride[0] = fmt.W;
+		planes.stride[1] = planes.stride[2] = fmt.chroma_W();
+		return true;
+	}
+
+	YUVFormat fmt;
+	bool is_y4m;
+
+private:
+	BufferedReader reader;
+	std::vector<unsigned char> frame;
+};
@@ -0,0 +1,309 @@
+// Microbenchmarks of the solver, warping, PatchMatch and I/O kernels, on deterministic synthetic frames
+// (a noisy texture seen by a camera that translates and rotates, with a cut halfway).
+//
+// benchmark.exe [--width 1280] [--height 720] [--threads 1,2,4,8] [--reps 5] [--frames 8] [--only name] [--csv file.csv] [--tmp prefix]
+//
+// Each case runs once to warm up, then --reps times ; the median is reported per call and per megapixel, for each
+// thread count (scheduler budget and OpenMP teams), with the speedup over the first thread count.
+// --only runs the cases whose name contains the given string. I/O cases write and read --frames frames in files
+// named after --tmp (default "bench_"), removed at the end.
+// Built with BENCHMARK_NO_VIDEO_IO, the I/O cases and FFGrab.h (libav, MSVC-only code) are left out : the solver,
+// warping and PatchMatch cases only need the solver headers and the PatchMatch sources.
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <omp.h>
+#include "regularization.h"
+#ifndef BENCHMARK_NO_VIDEO_IO
+#include "FFGrab.h"
+#endif
+#include "Synthetic.h"
+
+
+static const char* get_option(int argc, const char* argv[], const char* name, const char* default_value) {
+	for (int i=1; i<argc-1; i++) {
+		if (strncmp(argv[i], "--", 2)==0 && strcmp(argv[i]+2, name)==0)
+			return argv[i+1];
+	}
+	return default_value;
+}
+
+static int get_option(int argc, const char* argv[], const char* name, int default_value) {
+	const char* v = get_option(argc, argv, name, (const char*)NULL);
+	return v ? atoi(v) : default_value;
+}
+
+
+class Bench {
+public:
+	Bench(const std::vector<int> &threads, int reps, const std::string &only, const std::string &csvfile) : threads(threads), reps(std::max(1, reps)), only(only) {
+		if (!csvfile.empty()) {
+			csv.open(csvfile.c_str());
+			if (!csv) std::cout<<"cannot open "<<csvfile<<std::endl;
+			else csv<<"case,threads,ms,ms_per_mpix,speedup\n";
+		}
+		std::cout<<std::setw(28)<<std::left<<"case"<<std::right<<std::setw(8)<<"threads"<<std::setw(12)<<"ms"<<std::setw(12)<<"ms/MPix"<<std::setw(10)<<"speedup"<<std::endl;
+	}
+
+	bool selected(const std::string &name) const {
+		return only.empty() || name.find(only)!=std::string::npos;
+	}
+
+	// f() processes 'mpix' megapixels.
+	template<typename F>
+	void run(const std::string &name, double mpix, const F &f) {
+		if (!selected(name)) return;
+		double base = 0;
+		for (size_t t=0; t<threads.size(); t++) {
+			set_threads(threads[t]);
+			f();
+			std::vector<double> ms(reps);
+			for (int r=0; r<reps; r++) {
+				std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+				f();
+				ms[r] = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+			}
+			std::sort(ms.begin(), ms.end());
+			double med = ms[reps/2];
+			if (t==0) base = med;
+			std::cout<<std::setw(28)<<std::left<<name<<std::right<<std::setw(8)<<threads[t]<<std::fixed<<std::setprecision(2)
+				<<std::setw(12)<<med<<std::setw(12)<<med/mpix<<std::setw(10)<<base/med<<std::endl;
+			std::cout.unsetf(std::ios::fixed);
+			if (csv.is_open()) csv<<name<<","<<threads[t]<<","<<med<<","<<med/mpix<<","<<base/med<<"\n";
+		}
+	}
+
+	static void set_threads(int n) {
+		Scheduler::instance().set_budget(n);
+		omp_set_num_threads(n);
+	}
+
+private:
+	std::vector<int> threads;
+	int reps;
+	std::string only;
+	std::ofstream csv;
+};
+
+
+static std::vector<int> parse_threads(const char* list) {
+	std::vector<int> threads;
+	if (list) {
+		std::stringstream ss(list);
+		std::string item;
+		while (std::getline(ss, item, ','))
+			if (atoi(item.c_str())>0) threads.push_back(atoi(item.c_str()));
+	}
+	if (threads.empty()) { // 1, 2, 4, ... and all cores
+		int n = std::max(1, omp_get_num_procs());
+		for (int i=1; i<n; i*=2) threads.push_back(i);
+		threads.push_back(n);
+	}
+	return threads;
+}
+
+#ifndef BENCHMARK_NO_VIDEO_IO
+static int open_read(const std::string &filename) {
+#ifdef _WIN32
+	return _open(filename.c_str(), _O_RDONLY | _O_BINARY);
+#else
+	return open(filename.c_str(), O_RDONLY);
+#endif
+}
+
+static void close_fd(int fd) {
+#ifdef _WIN32
+	_close(fd);
+#else
+	close(fd);
+#endif
+}
+#endif
+
+
+int main(int argc, const char* argv[]) {
+
+	const int W = get_option(argc, argv, "width", 1280);
+	const int H = get_option(argc, argv, "height", 720);
+	const int nframes = std::max(2, get_option(argc, argv, "frames", 8));
+	const std::string tmp = get_option(argc, argv, "tmp", "bench_");
+	const double mpix = W*(double)H/1e6;
+	Bench bench(parse_threads(get_option(argc, argv, "threads", (const char*)NULL)), get_option(argc, argv, "reps", 5), get_option(argc, argv, "only", ""), get_option(argc, argv, "csv", ""));
+
+	// two consecutive frames, the exact flow between them, and the temporal terms of the solver system of solve_frame
+	SyntheticVideo video(W, H, nframes/2);
+	std::vector<float> prev(W*H*3), cur(W*H*3), flow(W*H*2), solution(W*H*3), rhs(W*H*3), diag(W*H);
+	video.frame(1, &prev[0]);
+	video.frame(2, &cur[0]);
+	video.backward_flow(2, &flow[0]);
+	SolverParams params;
+	for (int i=0; i<H; i++) {
+		for (int j=0; j<W; j++) {
+			int pix = i*W+j;
+			double w = get_weight(&cur[0], &prev[0], W, H, &flow[0], pix);
+			diag[pix] = 4 + w;
+			for (int k=0; k<3; k++) rhs[pix*3+k] = w*bilinear(&prev[k], W, H, flow[pix*2], flow[pix*2+1], 3);
+		}
+	}
+
+	// solver
+	bench.run("gauss_seidel_10it", mpix, [&]() {
+		solution = cur;
+		gauss_seidel(&solution[0], &cur[0], &diag[0], &rhs[0], W, H, 10);
+	});
+	bench.run("multiscale_solver", mpix, [&]() {
+		solution = cur;
+		multiscale_solver(&solution[0], &cur[0], W, H, &diag[0], &rhs[0], params.nlevels, params.niter);
+	});
+	// the same with the right-hand side and the diagonal stored in half floats (--solver-storage half)
+	std::vector<float16> rhs16(W*H*3), diag16(W*H);
+	store_values(&rhs[0], rhs.size(), &rhs16[0]);
+	store_values(&diag[0], diag.size(), &diag16[0]);
+	bench.run("gauss_seidel_10it_half", mpix, [&]() {
+		solution = cur;
+		gauss_seidel<float, 3, float16>(&solution[0], &cur[0], &diag16[0], &rhs16[0], W, H, 10);
+	});
+	bench.run("multiscale_solver_half", mpix, [&]() {
+		solution = cur;
+		multiscale_solver<float, 3, float16>(&solution[0], &cur[0], W, H, &diag16[0], &rhs16[0], params.nlevels, params.niter);
+	});
+
+	// 4 frames after frame 1 : one after the other (the recurrence), and jointly (--window 4)
+	const int K = 4;
+	std::vector<std::vector<float> > win_in(K, std::vector<float>(W*H*3)), win_flow(K, std::vector<float>(W*H*2)), win_sol(K);
+	std::vector<const float*> win_in_ptr(K), win_flow_ptr(K);
+	std::vector<float*> win_sol_ptr(K);
+	for (int f=0; f<K; f++) {
+		video.frame(2+f, &win_in[f][0]);
+		video.backward_flow(2+f, &win_flow[f][0]);
+		win_in_ptr[f] = &win_in[f][0];
+		win_flow_ptr[f] = &win_flow[f][0];
+	}
+	bench.run("solve_frame_x4", K*mpix, [&]() {
+		const float* previous = &prev[0];
+		for (int f=0; f<K; f++) {
+			win_sol[f] = win_in[f];
+			solve_frame(f>0 ? win_in_ptr[f-1] : &prev[0], win_in_ptr[f], win_in_ptr[f], previous, &win_sol[f][0], W, H, 1., false, win_flow_ptr[f], params, 2+f);
+			previous = &win_sol[f][0];
+		}
+	});
+	bench.run("solve_window_4", K*mpix, [&]() {
+		for (int f=0; f<K; f++) {
+			win_sol[f] = win_in[f];
+			win_sol_ptr[f] = &win_sol[f][0];
+		}
+		solve_window(&prev[0], &prev[0], &win_in_ptr[0], &win_in_ptr[0], &win_flow_ptr[0], &win_sol_ptr[0], K, W, H, 1., params);
+	});
+
+	// warping : weights and warped previous solution, as in the right-hand side of solve_frame
+	bench.run("warp_bilinear_weight", mpix, [&]() {
+		Scheduler::instance().parallel_for(0, H, [&](int i) {
+			for (int j=0; j<W; j++) {
+				int pix = i*W+j;
+				double w = get_weight(&cur[0], &prev[0], W, H, &flow[0], pix);
+				for (int k=0; k<3; k++) rhs[pix*3+k] = w*bilinear(&prev[k], W, H, flow[pix*2], flow[pix*2+1], 3);
+			}
+		}, STAGE_SOLVE);
+	});
+	std::vector<float> sys_rhs(W*H*3), sys_diag(W*H);
+	bench.run("build_system", mpix, [&]() { // the same lookups, fused, plus the Laplacian terms
+		build_system(&prev[0], &cur[0], &cur[0], &prev[0], &flow[0], W, H, 1., &sys_rhs[0], &sys_diag[0]);
+	});
+
+	// PatchMatch ; ALGO_CPU is sequential, ALGO_CPUTILED uses OpenMP
+	const int patch_sizes[] = { 5, 7, 11 };
+	const int algos[] = { ALGO_CPU, ALGO_CPUTILED };
+	const char* algo_names[] = { "cpu", "cputiled" };
+	std::vector<float> pmflow(W*H*2);
+	for (int a=0; a<2; a++) {
+		for (int s=0; s<3; s++) {
+			std::stringstream name;
+			name<<"patchmatch_"<<algo_names[a]<<"_p"<<patch_sizes[s];
+			bench.run(name.str(), mpix, [&]() {
+				opt_flow_patchmatch<float>(&cur[0], &prev[0], W, H, &pmflow[0], params.flow_iters, patch_sizes[s], algos[a]);
+			});
+		}
+	}
+
+#ifndef BENCHMARK_NO_VIDEO_IO
+	// I/O : each call writes or reads the whole sequence
+	std::vector<std::vector<float> > frames(nframes, std::vector<float>(W*H*3));
+	for (int t=0; t<nframes; t++) video.frame(t, &frames[t][0]);
+	const double io_mpix = mpix*nframes;
+	const std::string yuvfile = tmp + "video.y4m", imagefile = tmp + "000.png", mpgfile = tmp + "video.mpg";
+
+	bench.run("recorder_yuv", io_mpix, [&]() {
+		VideoRecorderYUV<float> rec(yuvfile.c_str(), W, H);
+		for (int t=0; t<nframes; t++) rec.addFrame(&frames[t][0]);
+		rec.finalize_video();
+	});
+	bench.run("recorder_image_png", io_mpix, [&]() {
+		VideoRecorderImage<float> rec(imagefile.c_str(), W, H);
+		for (int t=0; t<nframes; t++) rec.addFrame(&frames[t][0]);
+		rec.finalize_video();
+	});
+	bench.run("recorder_mpg", io_mpix, [&]() {
+		VideoRecorderMPG<float> rec(mpgfile.c_str(), W, H);
+		for (int t=0; t<nframes; t++) rec.addFrame(&frames[t][0]);
+		rec.finalize_video();
+	});
+
+	// the streamer cases read the files of the recorder cases ; they are written here if those did not run
+	if (!bench.selected("recorder_yuv") && (bench.selected("streamer_yuv") || bench.selected("streamer_pipe"))) {
+		VideoRecorderYUV<float> rec(yuvfile.c_str(), W, H);
+		for (int t=0; t<nframes; t++) rec.addFrame(&frames[t][0]);
+		rec.finalize_video();
+	}
+	if (!bench.selected("recorder_image_png") && bench.selected("streamer_image_png")) {
+		VideoRecorderImage<float> rec(imagefile.c_str(), W, H);
+		for (int t=0; t<nframes; t++) rec.addFrame(&frames[t][0]);
+		rec.finalize_video();
+	}
+	if (!bench.selected("recorder_mpg") && bench.selected("streamer_mpg")) {
+		VideoRecorderMPG<float> rec(mpgfile.c_str(), W, H);
+		for (int t=0; t<nframes; t++) rec.addFrame(&frames[t][0]);
+		rec.finalize_video();
+	}
+
+	std::vector<float> frame(W*H*3);
+	bench.run("streamer_yuv", io_mpix, [&]() {
+		VideoStreamerYUV<float> streamer(yuvfile, W, H);
+		for (int t=0; t<nframes; t++) streamer.get_next_frame(&frame[0]);
+	});
+	bench.run("streamer_pipe", io_mpix, [&]() {
+		int fd = open_read(yuvfile);
+		{
+			VideoStreamerPipe<float> streamer(std::shared_ptr<YUVPipeSource>(new YUVPipeSource(fd, W, H)));
+			for (int t=0; t<nframes; t++) streamer.get_next_frame(&frame[0]);
+		}
+		close_fd(fd);
+	});
+	bench.run("streamer_image_png", io_mpix, [&]() {
+		VideoStreamerImage<float> streamer(imagefile);
+		for (int t=0; t<nframes; t++) streamer.get_next_frame(&frame[0]);
+	});
+	bench.run("streamer_mpg", io_mpix, [&]() {
+		VideoStreamerMPG<float> streamer(mpgfile);
+		for (int t=0; t<nframes; t++) streamer.get_next_frame(&frame[0]);
+	});
+
+	std::remove(yuvfile.c_str());
+	std::remove(mpgfile.c_str());
+	std::string image = imagefile;
+	for (int t=0; t<nframes; t++) {
+		std::remove(image.c_str());
+		increment_file_number(image);
+	}
+#endif
+	return 0;
+}
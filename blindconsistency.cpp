@@ -0,0 +1,95 @@
+// C interface to the temporal consistency solver (see blindconsistency.h).
+
+#include <vector>
+#include <new>
+#include "blindconsistency.h"
+#include "regularization.h"
+
+
+struct BCContext {
+	int W, H;
+	double lambda;
+	SolverParams params;
+	bool first;
+	unsigned int frame; // since the last reset : seeds the random numbers of the flow
+	std::vector<float> prevInput, prevSolution, curInput, curProcessed, curSolution;
+};
+
+static const char* preset_name(int preset) {
+	switch (preset) {
+	case BC_PRESET_FAST: return "fast";
+	case BC_PRESET_MEDIUM: return "medium";
+	case BC_PRESET_SLOW: return "slow";
+	default: return "";
+	}
+}
+
+static void rgb24_to_float(const uint8_t* src, int linesize, float* dst, int W, int H) {
+	Scheduler::instance().parallel_for(0, H, [&](int i) {
+		const uint8_t* row = src + i*linesize;
+		for (int j=0; j<W*3; j++) {
+			dst[i*W*3+j] = row[j]/255.f;
+		}
+	}, STAGE_DECODE);
+}
+
+static void float_to_rgb24(const float* src, uint8_t* dst, int linesize, int W, int H) {
+	Scheduler::instance().parallel_for(0, H, [&](int i) {
+		uint8_t* row = dst + i*linesize;
+		for (int j=0; j<W*3; j++) {
+			row[j] = (uint8_t)std::min(255.f, std::max(0.f, src[i*W*3+j]*255.f+0.5f));
+		}
+	}, STAGE_ENCODE);
+}
+
+extern "C" BCContext* bc_alloc(int width, int height, double lambda, int flow_preset, int solver_preset) {
+	if (width<2 || height<2) return NULL;
+	BCContext* ctx = new (std::nothrow) BCContext();
+	if (!ctx) return NULL;
+	if (!set_flow_preset(ctx->params, preset_name(flow_preset)) || !set_solver_preset(ctx->params, preset_name(solver_preset))) {
+		delete ctx;
+		return NULL;
+	}
+	ctx->W = width;
+	ctx->H = height;
+	ctx->lambda = lambda;
+	ctx->first = true;
+	ctx->frame = 0;
+	size_t n = (size_t)width*height*3;
+	ctx->prevInput.resize(n);
+	ctx->prevSolution.resize(n);
+	ctx->curInput.resize(n);
+	ctx->curProcessed.resize(n);
+	ctx->curSolution.resize(n);
+	return ctx;
+}
+
+extern "C" int bc_process_rgb24(BCContext* ctx, const uint8_t* input, int input_linesize, const uint8_t* processed, int processed_linesize, uint8_t* out, int out_linesize) {
+	if (!ctx || !input || !processed || !out) return -1;
+	const int W = ctx->W, H = ctx->H;
+
+	rgb24_to_float(input, input_linesize, &ctx->curInput[0], W, H);
+	rgb24_to_float(processed, processed_linesize, &ctx->curProcessed[0], W, H);
+	ctx->curSolution = ctx->curProcessed;
+
+	solve_frame<float>(ctx->first ? NULL : &ctx->prevInput[0], &ctx->curInput[0], &ctx->curProcessed[0], &ctx->prevSolution[0], &ctx->curSolution[0], W, H, ctx->lambda, ctx->first, NULL, ctx->params, ctx->frame);
+
+	float_to_rgb24(&ctx->curSolution[0], out, out_linesize, W, H);
+	ctx->prevInput.swap(ctx->curInput);
+	ctx->prevSolution.swap(ctx->curSolution);
+	ctx->first = false;
+	ctx->frame++;
+	return 0;
+}
+
+extern "C" void bc_reset(BCContext* ctx) {
+	if (!ctx) return;
+	ctx->first = true;
+	ctx->frame = 0;
+}
+
+extern "C" void bc_free(BCContext** ctx) {
+	if (!ctx) return;
+	delete *ctx;
+	*ctx = NULL;
+}
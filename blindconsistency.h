@@ -0,0 +1,35 @@
+/* C interface to the temporal consistency solver, used by the libavfilter "blindconsistency" filter.
+ * Frames are packed RGB24 and are given in display order ; the context keeps the previous input frame and solution.
+ * libblindconsistency is blindconsistency.cpp and the patchmatch sources of stabilize.vcxproj (nn, patch, knn, simnn, vecnn, allegro_emu),
+ * built as a static library with OpenMP ; ffmpeg is then configured with --enable-gpl --enable-libblindconsistency.
+ */
+
+#ifndef BLINDCONSISTENCY_H
+#define BLINDCONSISTENCY_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum BCPreset { BC_PRESET_FAST, BC_PRESET_MEDIUM, BC_PRESET_SLOW };
+
+typedef struct BCContext BCContext;
+
+/* lambda : temporal weight ; flow_preset / solver_preset : BCPreset. Returns NULL on error. */
+BCContext* bc_alloc(int width, int height, double lambda, int flow_preset, int solver_preset);
+
+/* regularizes 'processed' against the previous frames ; 'out' may be 'processed'. Returns 0 on success. */
+int bc_process_rgb24(BCContext* ctx, const uint8_t* input, int input_linesize, const uint8_t* processed, int processed_linesize, uint8_t* out, int out_linesize);
+
+/* the next frame starts a new shot (it is not regularized against the previous one) */
+void bc_reset(BCContext* ctx);
+
+void bc_free(BCContext** ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -306,6 +306,7 @@
 #define CONFIG_INCOMPATIBLE_FORK_ABI 0
 #define CONFIG_LIBAACPLUS 0
 #define CONFIG_LIBASS 0
+#define CONFIG_LIBBLINDCONSISTENCY 0
 #define CONFIG_LIBBLURAY 0
 #define CONFIG_LIBCACA 0
 #define CONFIG_LIBCDIO 0
@@ -1131,6 +1132,7 @@
 #define CONFIG_BBOX_FILTER 1
 #define CONFIG_BLACKDETECT_FILTER 1
 #define CONFIG_BLACKFRAME_FILTER 1
+#define CONFIG_BLINDCONSISTENCY_FILTER 0
 #define CONFIG_BOXBLUR_FILTER 1
 #define CONFIG_COLORMATRIX_FILTER 1
 #define CONFIG_COPY_FILTER 1
@@ -416,6 +416,7 @@ CONFIG_GPL=yes
 !CONFIG_INCOMPATIBLE_FORK_ABI=yes
 !CONFIG_LIBAACPLUS=yes
 !CONFIG_LIBASS=yes
+!CONFIG_LIBBLINDCONSISTENCY=yes
 !CONFIG_LIBBLURAY=yes
 !CONFIG_LIBCACA=yes
 !CONFIG_LIBCDIO=yes
@@ -1241,6 +1242,7 @@ CONFIG_ALPHAMERGE_FILTER=yes
 CONFIG_BBOX_FILTER=yes
 CONFIG_BLACKDETECT_FILTER=yes
 CONFIG_BLACKFRAME_FILTER=yes
+!CONFIG_BLINDCONSISTENCY_FILTER=yes
 CONFIG_BOXBLUR_FILTER=yes
 CONFIG_COLORMATRIX_FILTER=yes
 CONFIG_COPY_FILTER=yes
@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2016 Nicolas Bonneel
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with FFmpeg; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * blind video temporal consistency (Bonneel et al. 2015) via libblindconsistency:
+ * makes the second input (a frame-by-frame processed video) temporally
+ * consistent, using the motion of the first input (the original video)
+ */
+
+#include <blindconsistency.h>
+
+#include "libavutil/opt.h"
+#include "libavutil/pixfmt.h"
+#include "avfilter.h"
+#include "bufferqueue.h"
+#include "formats.h"
+#include "internal.h"
+#include "video.h"
+
+typedef struct {
+    const AVClass *class;
+    double lambda;
+    int flow_preset;
+    int solver_preset;
+    int frame_requested;
+    struct FFBufQueue queue_orig;
+    struct FFBufQueue queue_proc;
+    BCContext *bc;
+} BlindConsistencyContext;
+
+#define OFFSET(x) offsetof(BlindConsistencyContext, x)
+#define FLAGS AV_OPT_FLAG_VIDEO_PARAM|AV_OPT_FLAG_FILTERING_PARAM
+
+static const AVOption blindconsistency_options[] = {
+    { "lambda", "set the temporal weight", OFFSET(lambda), AV_OPT_TYPE_DOUBLE, {.dbl=1}, 0, 1000, FLAGS },
+    { "flow",   "set the optical flow preset", OFFSET(flow_preset), AV_OPT_TYPE_INT, {.i64=BC_PRESET_MEDIUM}, BC_PRESET_FAST, BC_PRESET_SLOW, FLAGS, "preset" },
+    { "solver", "set the solver preset", OFFSET(solver_preset), AV_OPT_TYPE_INT, {.i64=BC_PRESET_MEDIUM}, BC_PRESET_FAST, BC_PRESET_SLOW, FLAGS, "preset" },
+    { "fast",   "", 0, AV_OPT_TYPE_CONST, {.i64=BC_PRESET_FAST},   INT_MIN, INT_MAX, FLAGS, "preset" },
+    { "medium", "", 0, AV_OPT_TYPE_CONST, {.i64=BC_PRESET_MEDIUM}, INT_MIN, INT_MAX, FLAGS, "preset" },
+    { "slow",   "", 0, AV_OPT_TYPE_CONST, {.i64=BC_PRESET_SLOW},   INT_MIN, INT_MAX, FLAGS, "preset" },
+    { NULL },
+};
+
+AVFILTER_DEFINE_CLASS(blindconsistency);
+
+static av_cold int init(AVFilterContext *ctx, const char *args)
+{
+    BlindConsistencyContext *bc = ctx->priv;
+
+    bc->class = &blindconsistency_class;
+    av_opt_set_defaults(bc);
+
+    if (args && *args)
+        return av_set_options_string(bc, args, "=", ":");
+    return 0;
+}
+
+static av_cold void uninit(AVFilterContext *ctx)
+{
+    BlindConsistencyContext *bc = ctx->priv;
+    ff_bufqueue_discard_all(&bc->queue_orig);
+    ff_bufqueue_discard_all(&bc->queue_proc);
+    bc_free(&bc->bc);
+}
+
+static int query_formats(AVFilterContext *ctx)
+{
+    static const enum AVPixelFormat pix_fmts[] = { AV_PIX_FMT_RGB24, AV_PIX_FMT_NONE };
+    ff_set_common_formats(ctx, ff_make_format_list(pix_fmts));
+    return 0;
+}
+
+static int config_output(AVFilterLink *outlink)
+{
+    AVFilterContext *ctx = outlink->src;
+    BlindConsistencyContext *bc = ctx->priv;
+    AVFilterLink *origlink = ctx->inputs[0];
+    AVFilterLink *proclink = ctx->inputs[1];
+
+    if (origlink->w != proclink->w || origlink->h != proclink->h) {
+        av_log(ctx, AV_LOG_ERROR,
+               "Input frame sizes do not match (%dx%d vs %dx%d).\n",
+               origlink->w, origlink->h,
+               proclink->w, proclink->h);
+        return AVERROR(EINVAL);
+    }
+
+    outlink->w = proclink->w;
+    outlink->h = proclink->h;
+    outlink->time_base = proclink->time_base;
+    outlink->sample_aspect_ratio = proclink->sample_aspect_ratio;
+    outlink->frame_rate = proclink->frame_rate;
+
+    bc_free(&bc->bc);
+    bc->bc = bc_alloc(outlink->w, outlink->h, bc->lambda, bc->flow_preset, bc->solver_preset);
+    if (!bc->bc)
+        return AVERROR(ENOMEM);
+    return 0;
+}
+
+static int start_frame(AVFilterLink *inlink, AVFilterBufferRef *picref) {return 0;}
+static int draw_slice(AVFilterLink *inlink, int y, int h, int slice_dir) {return 0;}
+
+static int end_frame(AVFilterLink *inlink)
+{
+    AVFilterContext *ctx = inlink->dst;
+    BlindConsistencyContext *bc = ctx->priv;
+
+    int is_proc = (inlink == ctx->inputs[1]);
+    struct FFBufQueue *queue =
+        (is_proc ? &bc->queue_proc : &bc->queue_orig);
+    ff_bufqueue_add(ctx, queue, inlink->cur_buf);
+    inlink->cur_buf = NULL;
+
+    while (1) {
+        AVFilterBufferRef *orig_buf, *proc_buf;
+        int ret;
+
+        if (!ff_bufqueue_peek(&bc->queue_orig, 0) ||
+            !ff_bufqueue_peek(&bc->queue_proc, 0)) break;
+
+        orig_buf = ff_bufqueue_get(&bc->queue_orig);
+        proc_buf = ff_bufqueue_get(&bc->queue_proc);
+
+        /* the processed frame is regularized in place */
+        if (bc_process_rgb24(bc->bc, orig_buf->data[0], orig_buf->linesize[0],
+                             proc_buf->data[0], proc_buf->linesize[0],
+                             proc_buf->data[0], proc_buf->linesize[0]) < 0) {
+            avfilter_unref_buffer(orig_buf);
+            avfilter_unref_buffer(proc_buf);
+            return AVERROR_EXTERNAL;
+        }
+        avfilter_unref_buffer(orig_buf);
+
+        ctx->outputs[0]->out_buf = proc_buf;
+        ret = ff_start_frame(ctx->outputs[0], avfilter_ref_buffer(proc_buf, ~0));
+        if (ret < 0)
+            return ret;
+        bc->frame_requested = 0;
+        if ((ret = ff_draw_slice(ctx->outputs[0], 0, proc_buf->video->h, 1)) < 0 ||
+            (ret = ff_end_frame(ctx->outputs[0])) < 0)
+            return ret;
+    }
+    return 0;
+}
+
+static int request_frame(AVFilterLink *outlink)
+{
+    AVFilterContext *ctx = outlink->src;
+    BlindConsistencyContext *bc = ctx->priv;
+    int in, ret;
+
+    bc->frame_requested = 1;
+    while (bc->frame_requested) {
+        in = ff_bufqueue_peek(&bc->queue_orig, 0) ? 1 : 0;
+        ret = ff_request_frame(ctx->inputs[in]);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+AVFilter avfilter_vf_blindconsistency = {
+    .name           = "blindconsistency",
+    .description    = NULL_IF_CONFIG_SMALL("Make the second input temporally consistent, "
+                      "using the motion of the first input."),
+    .init           = init,
+    .uninit         = uninit,
+    .priv_size      = sizeof(BlindConsistencyContext),
+    .query_formats  = query_formats,
+
+    .inputs    = (const AVFilterPad[]) {
+        { .name             = "original",
+          .type             = AVMEDIA_TYPE_VIDEO,
+          .start_frame      = start_frame,
+          .draw_slice       = draw_slice,
+          .end_frame        = end_frame,
+          .min_perms        = AV_PERM_READ | AV_PERM_PRESERVE },
+        { .name             = "processed",
+          .type             = AVMEDIA_TYPE_VIDEO,
+          .get_video_buffer = ff_null_get_video_buffer,
+          .start_frame      = start_frame,
+          .draw_slice       = draw_slice,
+          .end_frame        = end_frame,
+          .min_perms        = AV_PERM_READ | AV_PERM_WRITE | AV_PERM_PRESERVE },
+        { .name = NULL }
+    },
+    .outputs   = (const AVFilterPad[]) {
+      { .name               = "default",
+        .type               = AVMEDIA_TYPE_VIDEO,
+        .config_props       = config_output,
+        .request_frame      = request_frame },
+      { .name = NULL }
+    },
+    .priv_class = &blindconsistency_class,
+};
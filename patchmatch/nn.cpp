@@ -24,6 +24,7 @@ inline unsigned int rand2() {
   rand2_u = 18000 * (rand2_u & 65535) + (rand2_u >> 16);
   return (rand2_v << 16) + (rand2_u & 65535);
 }
+/* The searches below do not use this global state : they draw from rand_stream, see nn.h. */
 void srand2(unsigned seed) {
   rand2_u = seed;
   rand2_v = ~seed;
@@ -47,6 +48,16 @@ unsigned int randi(unsigned int u) {
 
 #define random() (rand()*(1.0/(RAND_MAX-1)))
 #define randomi(u) (randi(u)*(1.0/(RAND_MAX-1)))
+
+/* Streams of the counter-based PRNG : each is keyed by p->seed, then indexed by an iteration, row or pixel. */
+#define RAND_STREAM_ITER     1
+#define RAND_STREAM_INIT     2
+#define RAND_STREAM_SAMPLE   3
+#define RAND_STREAM_FULLRAND 4
+
+inline unsigned int rand_stream(Params *p, unsigned int stream, unsigned int counter) {
+  return rand_hash(rand_hash(p->seed, stream), counter);
+}
 #undef PATCH_W
 
 using namespace std;
@@ -55,21 +66,17 @@ using namespace std;
    Code dependent on patch size
    ---------------------------------------------------------------- */
 
-int last_cores = 0;
-
 void init_params(Params *p) {
   init_openmp(p);
 }
 
+/* The thread count is a per-thread setting, so it is set on each call (several threads may run PatchMatch).
+   Nested parallelism stays off : the callers already share the cores between concurrent PatchMatch runs. */
 void init_openmp(Params *p) {
-  if (p->cores != last_cores) {
-    last_cores = p->cores;
 #if USE_OPENMP
-    omp_set_num_threads(p->cores);
-    omp_set_nested(1);
-    omp_set_dynamic(0);
+  omp_set_num_threads(p->cores);
+  omp_set_dynamic(0);
 #endif
-  }
 }
 
 PATCHBITMAP *norm_image(double *accum, int w, int h) {
@@ -174,6 +181,7 @@ PATCHBITMAP *init_dist_n(Params *p, PATCHBITMAP *a, PATCHBITMAP *b, PATCHBITMAP
       //if (x == 1 && y == 1) { printf("1, 1 => %d, %d (%d)\n", xp, yp, row[x]); }
     }
   }
+  p->evals_init += (long long) (box.xmax-box.xmin)*(box.ymax-box.ymin);
   return ans;
 }
 
@@ -556,8 +564,9 @@ void nn_n(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
   int nn_iter = 0;
 
   int xmin = box.xmin, ymin = box.ymin, xmax = box.xmax, ymax = box.ymax;
+  long long nprop = 0, nsearch = 0;
   for (; nn_iter < p->nn_iters; nn_iter++) {
-    unsigned int iter_seed = rand();
+    unsigned int iter_seed = rand_stream(p, RAND_STREAM_ITER, nn_iter + offset_iter);
 
     int ystart = ymin, yfinal = ymax, ychange=1; // from up-left to bottom-right
     int xstart = xmin, xfinal = xmax, xchange=1;
@@ -615,6 +624,7 @@ void nn_n(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
 							{
                 // faster way to calculate error with known error( Neighbor(ax,ay), MatchInB(Neighbor(ax,ay)) )
 								int err0 = ((int *) annd->line[y])[x+dx]; 
+                nprop++;
 
                 int xa = dx, xb = 0;
                 if (dx > 0) { xa = 0; xb = dx; }
@@ -656,6 +666,7 @@ void nn_n(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
                      (!amask || !((int *) amask->bmp->line[y+dy])[x]))
                   )) {
                 int err0 = ((int *) annd->line[y+dy])[x];
+                nprop++;
 
                 int ya = dy, yb = 0;
                 if (dy > 0) { ya = 0; yb = dy; }
@@ -695,6 +706,7 @@ void nn_n(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
               xpp -= dx;
 
               if (!IS_WINDOW || window_constraint(p, a, b, x, y, xpp, ypp, ann_window, awinsize)) {
+                nprop++;
                 attempt_n<PATCH_W, IS_MASK, IS_WINDOW>(err, xbest, ybest, adata, b, xpp, ypp, bmask, region_masks, src_mask, p);
               }
             }
@@ -706,6 +718,7 @@ void nn_n(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
               ypp -= dy;
 
               if (!IS_WINDOW || window_constraint(p, a, b, x, y, xpp, ypp, ann_window, awinsize)) {
+                nprop++;
                 attempt_n<PATCH_W, IS_MASK, IS_WINDOW>(err, xbest, ybest, adata, b, xpp, ypp, bmask, region_masks, src_mask, p);
               }
             }
@@ -727,6 +740,7 @@ void nn_n(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
             seed = RANDI(seed);
             int ypp = ymin+seed%(ymax-ymin);
             if (!IS_WINDOW || window_constraint(p, a, b, x, y, xpp, ypp, ann_window, awinsize)) {
+              nsearch++;
               attempt_n<PATCH_W, IS_MASK, IS_WINDOW>(err, xbest, ybest, adata, b, xpp, ypp, bmask, region_masks, src_mask, p);
             }
           }
@@ -737,6 +751,8 @@ void nn_n(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
       }
     }
   }
+  p->evals_propagate += nprop;
+  p->evals_search += nsearch;
   printf("done nn_n, did %d iters, rs_max=%d\n", nn_iter, p->rs_max);
 }
 
@@ -767,7 +783,7 @@ void nn_n_gpucpu(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
     for (int jump = p->gpu_prop; jump >= 1; jump /= 2) {
       int last = (jump == 1 && nn_iter == p->nn_iters - 1);
       //printf("%d %d last: %d\n", nn_iter, jump, last);
-      unsigned int iter_seed = rand();
+      unsigned int iter_seed = rand_hash(rand_stream(p, RAND_STREAM_ITER, nn_iter + offset_iter), jump);
       #pragma omp parallel for schedule(dynamic, 10)
       for (int y = box.ymin; y < box.ymax; y++) {
         int adata[PATCH_W*PATCH_W];
@@ -896,7 +912,7 @@ void nn_n_cputiled(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
   Box box = get_abox(p, a, amask);
   int nn_iter = 0;
   for (; nn_iter < p->nn_iters; nn_iter++) {
-    unsigned int iter_seed = rand();
+    unsigned int iter_seed = rand_stream(p, RAND_STREAM_ITER, nn_iter + offset_iter);
 
     #pragma omp parallel num_threads(tiles)
     {
@@ -929,6 +945,7 @@ void nn_n_cputiled(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
       if (rs_max > max_mag) { rs_max = max_mag; }
 
       int adata[PATCH_W*PATCH_W];
+      long long nprop = 0, nsearch = 0;
       for (int y = ystart; y != yfinal; y += ychange) {
         int *annd_row = (int *) annd->line[y];
         int *amask_row = IS_MASK ? (amask ? (int *) amask->bmp->line[y]: NULL): NULL;
@@ -975,6 +992,7 @@ void nn_n_cputiled(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
                      )) 
 								{
                   int err0 = ((int *) annd->line[y])[x+dx];
+                  nprop++;
 
                   int xa = dx, xb = 0;
                   if (dx > 0) { xa = 0; xb = dx; }
@@ -1016,6 +1034,7 @@ void nn_n_cputiled(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
                     )) 
 								{
                   int err0 = ((int *) annd->line[y+dy])[x];
+                  nprop++;
 
                   int ya = dy, yb = 0;
                   if (dy > 0) { ya = 0; yb = dy; }
@@ -1056,6 +1075,7 @@ void nn_n_cputiled(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
                 xpp -= dx;
 
                 if (!IS_WINDOW || window_constraint(p, a, b, x, y, xpp, ypp, ann_window, awinsize)) {
+                  nprop++;
                   attempt_n<PATCH_W, IS_MASK, IS_WINDOW>(err, xbest, ybest, adata, b, xpp, ypp, bmask, region_masks, src_mask, p);
                 }
               }
@@ -1067,6 +1087,7 @@ void nn_n_cputiled(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
                 ypp -= dy;
 
                 if (!IS_WINDOW || window_constraint(p, a, b, x, y, xpp, ypp, ann_window, awinsize)) {
+                  nprop++;
                   attempt_n<PATCH_W, IS_MASK, IS_WINDOW>(err, xbest, ybest, adata, b, xpp, ypp, bmask, region_masks, src_mask, p);
                 }
               }
@@ -1091,6 +1112,7 @@ void nn_n_cputiled(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
               //int xpp = xmin+rand()%(xmax-xmin);
               //int ypp = ymin+rand()%(ymax-ymin);
               if (!IS_WINDOW || window_constraint(p, a, b, x, y, xpp, ypp, ann_window, awinsize)) {
+                nsearch++;
                 attempt_n<PATCH_W, IS_MASK, IS_WINDOW>(err, xbest, ybest, adata, b, xpp, ypp, bmask, region_masks, src_mask, p);
               }
             }
@@ -1110,6 +1132,10 @@ void nn_n_cputiled(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
 
         } // x
       } // y
+      #pragma omp atomic
+      p->evals_propagate += nprop;
+      #pragma omp atomic
+      p->evals_search += nsearch;
 
 #if SYNC_WRITEBACK
       #pragma omp barrier
@@ -1140,7 +1166,7 @@ void nn_n_proponly(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
   printf("in nn_n_proponly, masks are: %p %p %p, tiles=%d\n", amask, bmask, region_masks, tiles);
   Box box = get_abox(p, a, amask);
   for (int nn_iter = 0; nn_iter < p->nn_iters; nn_iter++) {
-    unsigned int iter_seed = rand();
+    unsigned int iter_seed = rand_stream(p, RAND_STREAM_ITER, nn_iter + offset_iter);
 
     #pragma omp parallel num_threads(tiles)
     {
@@ -1278,19 +1304,22 @@ void init_gauss_table() {
   }
 }
 
-double gauss1d(double mu, double sigma) {
+double gauss1d(double mu, double sigma, unsigned int &seed) {
   /* (From Python docs)
      When x and y are two variables from [0, 1), uniformly distributed, then
        cos(2*pi*x)*sqrt(-2*log(1-y))
        sin(2*pi*x)*sqrt(-2*log(1-y))
      are two *independent* variables with normal dist. (mu = 0, sigma = 1). */
-  return mu + COS_TABLE[rand()&(NTABLE-1)] * RAD_TABLE[rand()&(NTABLE-1)] * sigma;
+  unsigned int u = seed = RANDI(seed);
+  seed = RANDI(seed);
+  return mu + COS_TABLE[u&(NTABLE-1)] * RAD_TABLE[seed&(NTABLE-1)] * sigma;
 }
 
-void sample_gaussian(int &dx, int &dy, double sigma) {
+void sample_gaussian(int &dx, int &dy, double sigma, unsigned int &seed) {
   for (;;) {
-    int itheta = rand()&(NTABLE-1);
-    double r = gauss1d(0, sigma);
+    seed = RANDI(seed);
+    int itheta = seed&(NTABLE-1);
+    double r = gauss1d(0, sigma, seed);
     dx = (int) floor(COS_TABLE[itheta]*r+0.5);
     dy = (int) floor(SIN_TABLE[itheta]*r+0.5);
     if (dx != 0 || dy != 0) { break; }
@@ -1330,8 +1359,10 @@ void nn_n_fullrand(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
   #pragma omp parallel for schedule(static, 128)
   for (int ipixel = 0; ipixel < npixels; ipixel++) {
     int adata[PATCH_W*PATCH_W];
-    int seed = ((ipixel<<2)^(ipixel<<17))+1;
-    int x = xmin+rand()%(xmax-xmin), y = ymin+rand()%(ymax-ymin);
+    unsigned int seed = rand_stream(p, RAND_STREAM_FULLRAND, ipixel);
+    int x = xmin+seed%(xmax-xmin);
+    seed = RANDI(seed);
+    int y = ymin+seed%(ymax-ymin);
     int *amask_row = IS_MASK ? (amask ? (int *) amask->bmp->line[y]: NULL): NULL;
     if (IS_MASK && amask && amask_row[x]) { continue; }
 
@@ -1353,10 +1384,10 @@ void nn_n_fullrand(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
     }
     if (err == 0) { continue; }
 
-    if (random() < P_prop) {
+    if (rand_hash(seed, 0)*(1.0/4294967296.0) < P_prop) {
       /* Propagation */
       int dx, dy;
-      sample_gaussian(dx, dy, sigma_prop);
+      sample_gaussian(dx, dy, sigma_prop, seed);
       if ((unsigned) (x+dx) < (unsigned) (ann->w-PATCH_W) && (unsigned) (y+dy) < (unsigned) (ann->h-PATCH_W)) {
         int xpp, ypp;
         #pragma omp critical
@@ -1371,7 +1402,7 @@ void nn_n_fullrand(Params *p, PATCHBITMAP *a, PATCHBITMAP *b,
     } else {
       /* Random search */
       int dx, dy;
-      sample_gaussian(dx, dy, sigma_rs);
+      sample_gaussian(dx, dy, sigma_rs, seed);
       int xpp = xbest+dx, ypp = ybest+dy;
       attempt_n<PATCH_W, IS_MASK, IS_WINDOW>(err, xbest, ybest, adata, b, xpp, ypp, bmask, region_masks, src_mask, p);
     }
@@ -1502,8 +1533,10 @@ PATCHBITMAP *init_nn(Params *p, PATCHBITMAP *a, PATCHBITMAP *b, PATCHBITMAP *bma
         }
 				int idx = -1, iter = 0;
 				int xdest = -1, ydest = -1;
+        unsigned int seed = rand_stream(p, RAND_STREAM_SAMPLE, XY_TO_INT(x, y));
         for (; iter < max_iters; iter++) {
-          idx = rand() % sample[id].size();
+          idx = seed % sample[id].size();
+          seed = RANDI(seed);
           xdest = INT_TO_X(sample[id][idx]), ydest = INT_TO_Y(sample[id][idx]);
           if (window_constraint(p, a, b, x, y, xdest, ydest, ann_window, awinsize)) { break; }
         }
@@ -1533,7 +1566,7 @@ PATCHBITMAP *init_nn(Params *p, PATCHBITMAP *a, PATCHBITMAP *b, PATCHBITMAP *bma
     //fprintf(stderr, "init_nn openmp\n");
     #pragma omp parallel for schedule(static, 8)
     for (int y = box.ymin; y < box.ymax; y++) {
-      unsigned int seed = rand();
+      unsigned int seed = rand_stream(p, RAND_STREAM_INIT, y);
       int *row = (int *) bmp->line[y];
       int *arow = amask ? (int *) amask->bmp->line[y]: NULL;
       for (int x = box.xmin; x < box.xmax; x++) {
@@ -1578,7 +1611,7 @@ PATCHBITMAP *init_nn(Params *p, PATCHBITMAP *a, PATCHBITMAP *b, PATCHBITMAP *bma
           id = id0;
           if (sample[id].size() == 0) { row[x] = 0; continue; }
         }
-        int idx = rand() % sample[id].size();
+        int idx = rand_stream(p, RAND_STREAM_SAMPLE, XY_TO_INT(x, y)) % sample[id].size();
         row[x] = sample[id][idx];
       }
     }
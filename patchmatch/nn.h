@@ -105,6 +105,7 @@ class Params { public:
   int prefer_coherent;   /* Prefer coherent regions, bool, default false. */
   int allow_coherent;    /* This must be enabled for the previous flag to take effect. */
   int cores;             /* If > 1, use OpenMP. */
+  unsigned int seed;     /* Key of the random streams (rand_hash) : same seed and inputs => same field, whatever the threads. */
   int window_w;          /* Constraint search window width. */
   int window_h;          /* Constraint search window height. */
   int weight_r;          /* Multiplicative weights for R, G, B in distance computation. */
@@ -127,6 +128,9 @@ class Params { public:
   int do_inverse_enrich;
   int do_enrich;
 
+  /* Patch distances evaluated by init_dist and nn with these params, for profiling (propagation ones are incremental). */
+  long long evals_init, evals_propagate, evals_search;
+
   /* Defaults. */
   Params()
     :algo(ALGO_CPU),
@@ -149,6 +153,7 @@ class Params { public:
      prefer_coherent(0),
      allow_coherent(0),
      cores(2),
+     seed(0),
      window_w(INT_MAX),
      window_h(INT_MAX),
      weight_r(1),
@@ -163,7 +168,8 @@ class Params { public:
      enrich_iters(0),
      enrich_times(1),
      do_inverse_enrich(1),
-     do_enrich(1)
+     do_enrich(1),
+     evals_init(0), evals_propagate(0), evals_search(0)
      { }
 };
 
@@ -201,6 +207,16 @@ void destroy_region_masks(RegionMasks *m);
 /* PRNG without global variable, pass nonzero seed as argument. */
 #define RANDI(u) (18000 * ((u) & 65535) + ((u) >> 16))
 
+/* Counter-based PRNG : a hash of (key, counter) (splitmix64 finalizer), nonzero so that it can seed RANDI.
+   Iterations, rows and tiles draw their own streams from it, without state shared between threads. */
+inline unsigned int rand_hash(unsigned int key, unsigned int counter) {
+  unsigned long long z = (((unsigned long long) key << 32) | counter) + 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  unsigned int r = (unsigned int) ((z ^ (z >> 31)) >> 32);
+  return r ? r: 1;
+}
+
 PATCHBITMAP *norm_image(double *accum, int w, int h);
 PATCHBITMAP *norm_image(int *accum, int w, int h);
 
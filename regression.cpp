@@ -0,0 +1,415 @@
+// End-to-end regression harness : runs stabilize on a list of clips, records its speed and memory, and checks the output
+// against stored references.
+//
+// regression.exe clips.txt [--stabilize stabilize.exe] [--ref regression/] [--work regression_] [--update 1] [--report results.csv]
+//                [--psnr-min 40] [--ssim-min 0.98] [--warp-tolerance 0.05] [--max-slowdown 0] [--max-rss-increase 0]
+//
+// clips.txt : one clip per line, "name input processed lambda nbframes [stabilize options]" (# starts a comment).
+// "synthetic:WxH" as input (and "synthetic" as processed) generates a flickering synthetic clip of nbframes frames.
+// Outputs are written to <work><name>.y4m. For each clip, the harness measures :
+//  - frames/sec and peak resident memory of the stabilize process,
+//  - the warping error : mean squared difference between each output frame and the previous one warped by the backward
+//    flow solve_frame uses, weighted by the same occlusion weight (0 across cuts and disocclusions),
+//  - PSNR and SSIM (luma, 8x8 windows) against the reference output <ref><name>.y4m.
+// A clip fails when PSNR or SSIM fall below the thresholds, or when the warping error exceeds the reference one by more than
+// --warp-tolerance (relative) ; with --max-slowdown / --max-rss-increase (relative, 0 : off), also on speed and memory.
+// --update 1 stores the outputs and their measures (<ref><name>.txt) as the new references.
+// PatchMatch draws its random numbers from counters keyed by the frame index, so the flow only depends on the seed and the
+// inputs (not on the threads nor on --flow-lookahead) and outputs are reproducible : --psnr-min / --ssim-min only have to
+// absorb intentional changes (rounding, presets, solver changes), after which --update 1 stores the new references.
+// The exit code is the number of failed clips.
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <omp.h>
+#include "regularization.h"
+#include "FFGrab.h"
+#include "JobServer.h"
+#include "Synthetic.h"
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#endif
+
+
+static const char* get_option(int argc, const char* argv[], const char* name, const char* default_value) {
+	for (int i=1; i<argc-1; i++) {
+		if (strncmp(argv[i], "--", 2)==0 && strcmp(argv[i]+2, name)==0)
+			return argv[i+1];
+	}
+	return default_value;
+}
+
+static double get_option(int argc, const char* argv[], const char* name, double default_value) {
+	const char* v = get_option(argc, argv, name, (const char*)NULL);
+	return v ? atof(v) : default_value;
+}
+
+
+// runs a program (args[0]) and waits for it ; returns its exit code, -1 if it could not run.
+static int run_process(const std::vector<std::string> &args, double &peak_rss_mb) {
+	peak_rss_mb = 0;
+#ifdef _WIN32
+	std::string cmd;
+	for (size_t i=0; i<args.size(); i++) cmd += "\"" + args[i] + "\" ";
+	STARTUPINFOA si;
+	PROCESS_INFORMATION pi;
+	memset(&si, 0, sizeof(si));
+	si.cb = sizeof(si);
+	if (!CreateProcessA(NULL, &cmd[0], NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi)) return -1;
+	WaitForSingleObject(pi.hProcess, INFINITE);
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(pi.hProcess, &pmc, sizeof(pmc))) peak_rss_mb = pmc.PeakWorkingSetSize/1048576.;
+	DWORD code = (DWORD)-1;
+	GetExitCodeProcess(pi.hProcess, &code);
+	CloseHandle(pi.hThread);
+	CloseHandle(pi.hProcess);
+	return (int)code;
+#else
+	std::vector<char*> argv;
+	for (size_t i=0; i<args.size(); i++) argv.push_back(const_cast<char*>(args[i].c_str()));
+	argv.push_back(NULL);
+	pid_t pid = fork();
+	if (pid<0) return -1;
+	if (pid==0) {
+		execvp(argv[0], &argv[0]);
+		_exit(127);
+	}
+	int status;
+	struct rusage ru;
+	if (wait4(pid, &status, 0, &ru)<0) return -1;
+	peak_rss_mb = ru.ru_maxrss/1024.; // kB on Linux
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+}
+
+static bool ends_with(const std::string &s, const char* ext) {
+	size_t n = strlen(ext);
+	return s.size()>=n && s.compare(s.size()-n, n, ext)==0;
+}
+
+// same choice of streamer as stabilize, from the file extension
+static VideoStreamer<float>* open_streamer(const std::string &filename, int W, int H) {
+	if (ends_with(filename, ".yuv") || ends_with(filename, ".y4m")) return new VideoStreamerYUV<float>(filename, W, H);
+	if (ends_with(filename, ".png") || ends_with(filename, ".bmp") || ends_with(filename, ".jpg") || ends_with(filename, ".tga"))
+		return new VideoStreamerImage<float>(filename);
+	return new VideoStreamerMPG<float>(filename);
+}
+
+static bool write_synthetic_clip(const std::string &input, const std::string &processed, int W, int H, int nbframes) {
+	SyntheticVideo video(W, H, nbframes/2);
+	VideoRecorderYUV<float> inrec(input.c_str(), W, H), procrec(processed.c_str(), W, H);
+	if (!inrec.out.is_open() || !procrec.out.is_open()) return false;
+	std::vector<float> frame(W*H*3);
+	for (int t=0; t<nbframes; t++) {
+		video.frame(t, &frame[0]);
+		inrec.addFrame(&frame[0]);
+		video.processed_frame(t, &frame[0]);
+		procrec.addFrame(&frame[0]);
+	}
+	inrec.finalize_video();
+	procrec.finalize_video();
+	return true;
+}
+
+
+// weighted squared difference between 'cur' and 'prev' warped by the backward flow, and the sum of the weights.
+static void warping_error(const float* cur, const float* prev, const float* curInput, const float* prevInput, const float* flow, int W, int H, double &err, double &wsum) {
+	double e_sum = 0, w_sum = 0;
+	#pragma omp parallel for reduction(+:e_sum, w_sum)
+	for (int pix=0; pix<W*H; pix++) {
+		double w = get_weight(curInput, prevInput, W, H, flow, pix);
+		if (w==0) continue;
+		double e = 0;
+		for (int k=0; k<3; k++) e += sqr(cur[pix*3+k] - bilinear(prev+k, W, H, flow[pix*2], flow[pix*2+1], 3));
+		e_sum += w*e/3;
+		w_sum += w;
+	}
+	err = e_sum;
+	wsum = w_sum;
+}
+
+static double psnr(const float* a, const float* b, int n) {
+	double mse = 0;
+	for (int i=0; i<n; i++) mse += sqr((double)a[i] - (double)b[i]);
+	mse /= n;
+	return mse<1e-10 ? 100. : 10*log10(1./mse);
+}
+
+// mean SSIM of the luma over 8x8 windows, every 4 pixels.
+static double ssim(const float* a, const float* b, int W, int H) {
+	const double C1 = 0.01*0.01, C2 = 0.03*0.03;
+	double sum = 0;
+	int nb = 0;
+	for (int y=0; y+8<=H; y+=4) {
+		for (int x=0; x+8<=W; x+=4) {
+			double ma = 0, mb = 0, va = 0, vb = 0, cov = 0;
+			for (int i=y; i<y+8; i++) {
+				for (int j=x; j<x+8; j++) {
+					const float* pa = a + (i*W+j)*3;
+					const float* pb = b + (i*W+j)*3;
+					double la = 0.299*pa[0] + 0.587*pa[1] + 0.114*pa[2];
+					double lb = 0.299*pb[0] + 0.587*pb[1] + 0.114*pb[2];
+					ma += la; mb += lb;
+					va += la*la; vb += lb*lb; cov += la*lb;
+				}
+			}
+			ma /= 64; mb /= 64;
+			va = va/64 - ma*ma; vb = vb/64 - mb*mb; cov = cov/64 - ma*mb;
+			sum += ((2*ma*mb + C1)*(2*cov + C2))/((ma*ma + mb*mb + C1)*(va + vb + C2));
+			nb++;
+		}
+	}
+	return nb ? sum/nb : 1.;
+}
+
+
+struct ClipMeasures {
+	ClipMeasures() : frames(0), fps(0), peak_rss_mb(0), warp_error(0), warp_error_processed(0), psnr(0), ssim(0), has_reference(false) {}
+	int frames;
+	double fps, peak_rss_mb;
+	double warp_error, warp_error_processed; // of the output, and of the processed video (for comparison)
+	double psnr, ssim;                       // against the reference output
+	bool has_reference;
+
+	bool load(const std::string &filename) {
+		std::ifstream f(filename.c_str());
+		if (!f) return false;
+		std::string key;
+		double v;
+		while (f>>key>>v) {
+			if (key=="frames") frames = (int)v;
+			else if (key=="fps") fps = v;
+			else if (key=="peak_rss_mb") peak_rss_mb = v;
+			else if (key=="warp_error") warp_error = v;
+			else if (key=="warp_error_processed") warp_error_processed = v;
+		}
+		return true;
+	}
+
+	bool save(const std::string &filename) const {
+		std::ofstream f(filename.c_str());
+		f<<std::setprecision(10)<<"frames "<<frames<<"\nfps "<<fps<<"\npeak_rss_mb "<<peak_rss_mb<<"\nwarp_error "<<warp_error<<"\nwarp_error_processed "<<warp_error_processed<<"\n";
+		return (bool)f;
+	}
+};
+
+// reads the input, processed and output videos (and the reference output if there is one) and fills the quality measures.
+static bool measure_quality(const std::string &input, const std::string &processed, const std::string &output, const std::string &reference, int W, int H, const SolverParams &params, ClipMeasures &m) {
+	VideoStreamer<float>* in = open_streamer(input, W, H);
+	VideoStreamer<float>* proc = open_streamer(processed, W, H);
+	VideoStreamerYUV<float> out(output, 0, 0);
+	W = out.W;
+	H = out.H;
+	if (W==0 || in->W!=W || in->H!=H || proc->W!=W || proc->H!=H) {
+		std::cout<<"output size does not match the input"<<std::endl;
+		delete in;
+		delete proc;
+		return false;
+	}
+	VideoStreamerYUV<float>* ref = NULL;
+	std::ifstream reffile(reference.c_str());
+	if (reffile) {
+		reffile.close();
+		ref = new VideoStreamerYUV<float>(reference, 0, 0);
+		if (ref->W!=W || ref->H!=H) {
+			std::cout<<"reference "<<reference<<" has a different size"<<std::endl;
+			delete ref;
+			ref = NULL;
+		}
+	}
+
+	const int n = W*H*3;
+	std::vector<float> prevInput(n), curInput(n), prevProc(n), curProc(n), prevOut(n), curOut(n), refFrame(n), flow(W*H*2);
+	double err = 0, wsum = 0, err_proc = 0, wsum_proc = 0, psnr_sum = 0, ssim_sum = 0;
+	int nref = 0;
+	m.frames = 0;
+	while (out.get_next_frame(&curOut[0])) {
+		if (!in->get_next_frame(&curInput[0]) || !proc->get_next_frame(&curProc[0])) break;
+		if (m.frames>0) {
+			compute_backward_flow<float>(&prevInput[0], &curInput[0], &flow[0], W, H, params, m.frames);
+			double e, w;
+			warping_error(&curOut[0], &prevOut[0], &curInput[0], &prevInput[0], &flow[0], W, H, e, w);
+			err += e; wsum += w;
+			warping_error(&curProc[0], &prevProc[0], &curInput[0], &prevInput[0], &flow[0], W, H, e, w);
+			err_proc += e; wsum_proc += w;
+		}
+		if (ref && ref->get_next_frame(&refFrame[0])) {
+			psnr_sum += psnr(&curOut[0], &refFrame[0], n);
+			ssim_sum += ssim(&curOut[0], &refFrame[0], W, H);
+			nref++;
+		}
+		prevInput.swap(curInput);
+		prevProc.swap(curProc);
+		prevOut.swap(curOut);
+		m.frames++;
+	}
+	m.warp_error = wsum>0 ? err/wsum : 0;
+	m.warp_error_processed = wsum_proc>0 ? err_proc/wsum_proc : 0;
+	m.has_reference = ref && nref==m.frames && ref->nbframes==m.frames;
+	if (ref && !m.has_reference) std::cout<<"reference "<<reference<<" does not have the same number of frames"<<std::endl;
+	m.psnr = nref ? psnr_sum/nref : 0;
+	m.ssim = nref ? ssim_sum/nref : 0;
+	delete ref;
+	delete in;
+	delete proc;
+	return true;
+}
+
+static bool replace_file(const std::string &from, const std::string &to) {
+#ifdef _WIN32
+	std::remove(to.c_str()); // rename does not replace existing files
+#endif
+	return std::rename(from.c_str(), to.c_str())==0;
+}
+
+
+int main(int argc, const char* argv[]) {
+
+	if (argc<2) {
+		std::cout<<"usage: regression clips.txt [--stabilize stabilize.exe] [--ref regression/] [--work regression_] [--update 1] [--report results.csv]"<<std::endl;
+		return 1;
+	}
+#ifdef _WIN32
+	const std::string stabilize = get_option(argc, argv, "stabilize", "stabilize.exe");
+#else
+	const std::string stabilize = get_option(argc, argv, "stabilize", "./stabilize");
+#endif
+	const std::string refdir = get_option(argc, argv, "ref", "regression/");
+	const std::string work = get_option(argc, argv, "work", "regression_");
+	const bool update = get_option(argc, argv, "update", 0.)!=0;
+	const double psnr_min = get_option(argc, argv, "psnr-min", 40.);
+	const double ssim_min = get_option(argc, argv, "ssim-min", 0.98);
+	const double warp_tolerance = get_option(argc, argv, "warp-tolerance", 0.05);
+	const double max_slowdown = get_option(argc, argv, "max-slowdown", 0.);
+	const double max_rss_increase = get_option(argc, argv, "max-rss-increase", 0.);
+
+	std::ifstream clips(argv[1]);
+	if (!clips) {
+		std::cout<<"cannot open "<<argv[1]<<std::endl;
+		return 1;
+	}
+	std::ofstream report;
+	const char* report_file = get_option(argc, argv, "report", (const char*)NULL);
+	if (report_file) {
+		report.open(report_file);
+		report<<"clip,frames,fps,peak_rss_mb,warp_error,warp_error_processed,psnr,ssim,status\n";
+	}
+
+	int failed = 0;
+	std::string line;
+	while (std::getline(clips, line)) {
+		std::vector<std::string> args = split_command_line(line);
+		if (args.empty() || args[0][0]=='#') continue;
+		if (args.size()<5) {
+			std::cout<<"bad clip line: "<<line<<std::endl;
+			failed++;
+			continue;
+		}
+		const std::string name = args[0];
+		std::string input = args[1], processed = args[2];
+		const int nbframes = atoi(args[4].c_str());
+		std::vector<std::string> options(args.begin()+5, args.end());
+
+		int W = 0, H = 0;
+		if (input.compare(0, 10, "synthetic:")==0) {
+			if (sscanf(input.c_str()+10, "%dx%d", &W, &H)!=2 || W<16 || H<16) {
+				std::cout<<name<<": bad synthetic size "<<input<<std::endl;
+				failed++;
+				continue;
+			}
+			input = work + name + "_input.y4m";
+			processed = work + name + "_processed.y4m";
+			if (!write_synthetic_clip(input, processed, W, H, nbframes)) {
+				std::cout<<name<<": cannot write "<<input<<std::endl;
+				failed++;
+				continue;
+			}
+		} else if (options.size()>=2 && options[0].compare(0, 2, "--")!=0) { // raw .yuv inputs : W H
+			W = atoi(options[0].c_str());
+			H = atoi(options[1].c_str());
+		}
+
+		// the flow preset of the run is also used to measure the warping error
+		SolverParams params;
+		for (size_t i=0; i+1<options.size(); i++)
+			if (options[i]=="--flow-preset") set_flow_preset(params, options[i+1].c_str());
+
+		const std::string output = work + name + ".y4m";
+		std::vector<std::string> cmd;
+		cmd.push_back(stabilize);
+		cmd.push_back(input);
+		cmd.push_back(processed);
+		cmd.push_back(args[3]);
+		cmd.push_back(output);
+		cmd.push_back(args[4]);
+		cmd.insert(cmd.end(), options.begin(), options.end());
+
+		std::cout<<"=== "<<name<<std::endl;
+		ClipMeasures m;
+		std::chrono::high_resolution_clock::time_point t0 = std::chrono::high_resolution_clock::now();
+		int ret = run_process(cmd, m.peak_rss_mb);
+		double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - t0).count();
+
+		std::vector<std::string> failures;
+		if (ret!=0) {
+			std::stringstream s;
+			s<<"stabilize exited with "<<ret;
+			failures.push_back(s.str());
+		} else if (!measure_quality(input, processed, output, refdir + name + ".y4m", W, H, params, m)) {
+			failures.push_back("cannot read the output");
+		} else {
+			m.fps = seconds>0 ? m.frames/seconds : 0;
+			ClipMeasures ref;
+			if (update) {
+				if (!replace_file(output, refdir + name + ".y4m") || !m.save(refdir + name + ".txt"))
+					failures.push_back("cannot write the reference in " + refdir);
+			} else if (!m.has_reference || !ref.load(refdir + name + ".txt")) {
+				failures.push_back("no reference (run with --update 1)");
+			} else {
+				std::stringstream s;
+				if (m.frames!=ref.frames) s<<"frames: "<<m.frames<<" instead of "<<ref.frames<<"\n";
+				if (m.psnr<psnr_min) s<<"PSNR "<<m.psnr<<" < "<<psnr_min<<"\n";
+				if (m.ssim<ssim_min) s<<"SSIM "<<m.ssim<<" < "<<ssim_min<<"\n";
+				if (m.warp_error>ref.warp_error*(1+warp_tolerance)) s<<"warping error "<<m.warp_error<<" > "<<ref.warp_error<<" (+"<<100*warp_tolerance<<"%)\n";
+				if (max_slowdown>0 && m.fps<ref.fps*(1-max_slowdown)) s<<m.fps<<" fps < "<<ref.fps<<" fps (-"<<100*max_slowdown<<"%)\n";
+				if (max_rss_increase>0 && m.peak_rss_mb>ref.peak_rss_mb*(1+max_rss_increase)) s<<"peak memory "<<m.peak_rss_mb<<" MB > "<<ref.peak_rss_mb<<" MB (+"<<100*max_rss_increase<<"%)\n";
+				std::string failure;
+				while (std::getline(s, failure)) failures.push_back(failure);
+			}
+		}
+
+		const char* status = failures.empty() ? (update ? "UPDATED" : "OK") : "FAILED";
+		std::cout<<name<<": "<<m.frames<<" frames, "<<m.fps<<" fps, peak "<<m.peak_rss_mb<<" MB, warping error "<<m.warp_error<<" (processed: "<<m.warp_error_processed<<")";
+		if (m.has_reference && !update) std::cout<<", PSNR "<<m.psnr<<" dB, SSIM "<<m.ssim;
+		std::cout<<" : "<<status<<std::endl;
+		for (size_t i=0; i<failures.size(); i++) std::cout<<"  "<<failures[i]<<std::endl;
+		if (report.is_open())
+			report<<name<<","<<m.frames<<","<<m.fps<<","<<m.peak_rss_mb<<","<<m.warp_error<<","<<m.warp_error_processed<<","<<m.psnr<<","<<m.ssim<<","<<status<<"\n";
+		if (!failures.empty()) failed++;
+		if (!update) std::remove(output.c_str());
+		if (args[1].compare(0, 10, "synthetic:")==0) {
+			std::remove(input.c_str());
+			std::remove(processed.c_str());
+		}
+	}
+
+	if (failed) std::cout<<failed<<" clip(s) failed"<<std::endl;
+	else std::cout<<"no regression"<<std::endl;
+	return failed;
+}
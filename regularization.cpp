@@ -35,12 +35,22 @@
 
 #include <vector>
 
-#include "regularization.h"
+#include "TemporalConsistency.h"
+#include "Checkpoint.h"
+#include "JobServer.h"
 #include "FFGrab.h"
 #include <sstream>
 #include <string>
 #include <algorithm>
 #include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 using namespace std;
 
@@ -66,7 +76,351 @@ std::string extract_fileext(std::string &path) {
 	return fileext;
 }
 
-int main(int argc, const char* argv[]) {
+struct FrameSlot {
+	FrameSlot(int W, int H, int index) : input(W*H*3), processed(W*H*3), index(index) {}
+	std::vector<float> input, processed;
+	int index; // in the video : seeds the random numbers of the flow
+};
+
+// frames between two scene cuts. Shots are independent, so each one is solved on its own worker with its own prevSolution.
+// the input and output queues are bounded to max_buffered frames.
+struct Shot {
+	Shot() : input_done(false), output_done(false) {}
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<std::shared_ptr<FrameSlot> > input;
+	std::deque<std::vector<float> > output;
+	bool input_done, output_done;
+};
+
+void solve_shot(Shot* shot, int W, int H, float lambdaT, const SolverParams &params, int max_buffered, int omp_threads) {
+
+	omp_set_num_threads(omp_threads);
+	std::shared_ptr<FrameSlot> prev;
+	std::vector<float> prevSolution(W*H*3);
+	std::vector<float> curSolution(W*H*3);
+
+	for (;;) {
+		std::shared_ptr<FrameSlot> cur;
+		{
+			std::unique_lock<std::mutex> lock(shot->mutex);
+			while (shot->input.empty() && !shot->input_done) shot->cond.wait(lock);
+			if (shot->input.empty()) break;
+			cur = shot->input.front();
+			shot->input.pop_front();
+		}
+		shot->cond.notify_all();
+
+		curSolution = cur->processed;
+		solve_frame<float>(prev ? &prev->input[0] : NULL, &cur->input[0], &cur->processed[0], &prevSolution[0], &curSolution[0], W, H, lambdaT, !prev, NULL, params, cur->index);
+		prev = cur;
+		prevSolution = curSolution;
+
+		{
+			std::unique_lock<std::mutex> lock(shot->mutex);
+			while ((int)shot->output.size()>=max_buffered) shot->cond.wait(lock);
+			shot->output.push_back(curSolution);
+		}
+		shot->cond.notify_all();
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(shot->mutex);
+		shot->output_done = true;
+	}
+	shot->cond.notify_all();
+}
+
+// splits the video at scene cuts and solves up to 'workers' shots concurrently ; the outputs are written in order by a writer thread.
+void process_shots(VideoStreamer<float>* instreamer, VideoStreamer<float>* processedstreamer, VideoRecorder<float>* outputsRec, int nbframes, int W, int H, float lambdaT, const SolverParams &params, double scene_threshold, int workers, int max_buffered, JobStatus* status) {
+
+	ThreadPool pool(workers);
+	// each shot has its part of the threads of the job, for its OpenMP settings and its PatchMatch teams
+	int omp_threads = std::max(1, (params.flow_threads>0 ? params.flow_threads : Scheduler::instance().size())/workers);
+	SolverParams shot_params = params;
+	shot_params.flow_threads = omp_threads;
+	max_buffered = std::max(1, max_buffered);
+	SceneCutDetector detector(W, H, scene_threshold);
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<std::shared_ptr<Shot> > shots; // shots not entirely written yet
+	bool reading_done = false;
+
+	std::thread writer([&]() {
+		for (;;) {
+			std::shared_ptr<Shot> shot;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				while (shots.empty() && !reading_done) cond.wait(lock);
+				if (shots.empty()) return;
+				shot = shots.front();
+			}
+			for (;;) {
+				std::vector<float> frame;
+				{
+					std::unique_lock<std::mutex> lock(shot->mutex);
+					while (shot->output.empty() && !shot->output_done) shot->cond.wait(lock);
+					if (shot->output.empty()) break;
+					frame.swap(shot->output.front());
+					shot->output.pop_front();
+				}
+				shot->cond.notify_all();
+				outputsRec->addFrame(&frame[0]);
+				if (status) status->frame++;
+			}
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				shots.pop_front();
+			}
+			cond.notify_all();
+		}
+	});
+
+	std::shared_ptr<Shot> current;
+	for (int i=0; i<nbframes; i++) {
+
+		std::shared_ptr<FrameSlot> slot(new FrameSlot(W, H, i));
+		if (!instreamer->get_next_frame(&slot->input[0]) || !processedstreamer->get_next_frame(&slot->processed[0])) break;
+		bool cut = detector.is_cut(&slot->input[0]);
+
+		if (!current || cut) {
+			if (current) {
+				std::unique_lock<std::mutex> lock(current->mutex);
+				current->input_done = true;
+				current->cond.notify_all();
+			}
+			std::cout<<"shot starting at frame "<<i<<" over "<<nbframes<<std::endl;
+			current.reset(new Shot());
+			{
+				// bounds the number of shots held in memory
+				std::unique_lock<std::mutex> lock(mutex);
+				while ((int)shots.size()>=2*workers) cond.wait(lock);
+				shots.push_back(current);
+			}
+			cond.notify_all();
+			std::shared_ptr<Shot> shot = current;
+			pool.enqueue([shot, W, H, lambdaT, shot_params, max_buffered, omp_threads]() {
+				solve_shot(shot.get(), W, H, lambdaT, shot_params, max_buffered, omp_threads);
+			});
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(current->mutex);
+			while ((int)current->input.size()>=max_buffered) current->cond.wait(lock);
+			current->input.push_back(slot);
+		}
+		current->cond.notify_all();
+	}
+
+	if (current) {
+		std::unique_lock<std::mutex> lock(current->mutex);
+		current->input_done = true;
+		current->cond.notify_all();
+	}
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		reading_done = true;
+	}
+	cond.notify_all();
+	writer.join();
+}
+
+struct CheckpointOptions {
+	CheckpointOptions() : every(500), first_frame(0) {}
+	std::string file;                           // empty : no checkpoints
+	int every;                                  // frames written between checkpoints
+	int first_frame;                            // > 0 : resumed run, the inputs are positioned at this frame
+	std::vector<float> prevInput, prevSolution; // state of frame first_frame-1
+};
+
+// positions both inputs at 'frame' and reads the input frame before it ; interleaved pipes are read in their order.
+bool seek_inputs(VideoStreamer<float>* instreamer, VideoStreamer<float>* processedstreamer, int frame, bool interleaved, float* prevInput) {
+	if (interleaved) {
+		for (int i=0; i<frame-1; i++)
+			if (!instreamer->skip_frames(1) || !processedstreamer->skip_frames(1)) return false;
+	} else if (!instreamer->skip_frames(frame-1) || !processedstreamer->skip_frames(frame-1)) {
+		return false;
+	}
+	return instreamer->get_next_frame(prevInput) && processedstreamer->skip_frames(1);
+}
+
+// sequential recurrence over the frames, on a TemporalConsistencyEngine ; one recorder per lambda of opts.lambdas
+// (a single one for opts.lambda_t). Checkpoints are only written for a single output. With opts.yuv420, frames are read
+// and written as planar 4:2:0.
+void process_frames(VideoStreamer<float>* instreamer, VideoStreamer<float>* processedstreamer, const std::vector<VideoRecorder<float>*> &outputs, int nbframes, int W, int H, const EngineOptions &opts, JobStatus* status, const CheckpointOptions &ckpt) {
+
+	TemporalConsistencyEngine engine(W, H, opts);
+	VideoRecorder<float>* outputsRec = outputs[0];
+	const int size = engine.frame_size();
+	std::vector<float> curInput(size);
+	std::vector<float> curProcessed(size);
+	std::vector<float> curSolution(size*engine.nb_outputs());
+	int nwritten = ckpt.first_frame;
+	if (ckpt.first_frame>0) engine.resume(&ckpt.prevInput[0], &ckpt.prevSolution[0], ckpt.first_frame);
+
+	// the recorder is synced first, so that a checkpoint never counts frames that are not in the output
+	auto save_checkpoint = [&]() {
+		outputsRec->sync();
+		if (outputsRec->failed()) {
+			std::cout<<"the output could not be written, no checkpoint"<<std::endl;
+			return;
+		}
+		Checkpoint c;
+		c.W = W;
+		c.H = H;
+		c.frames_done = nwritten;
+		c.prevSolution.assign(curSolution.begin(), curSolution.begin()+W*H*3);
+		if (!c.save(ckpt.file)) std::cout<<"cannot write checkpoint "<<ckpt.file<<std::endl;
+	};
+	auto write_frame = [&]() {
+		{
+			ProfileFrame profile_frame(nwritten);
+			ProfileTimer timer(PROF_ENCODE);
+			for (size_t s=0; s<outputs.size(); s++) {
+				if (opts.yuv420) outputs[s]->addFrameYUV420(&curSolution[s*size], W, H);
+				else outputs[s]->addFrame(&curSolution[s*size]);
+			}
+		}
+		Profiler::instance().frame_done(nwritten);
+		nwritten++;
+		if (status) status->frame = nwritten;
+		if (!ckpt.file.empty() && nwritten%ckpt.every==0) save_checkpoint();
+	};
+
+	for (int i=ckpt.first_frame; i<nbframes; i++) {
+
+		if (outputsRec->failed()) break;
+		std::cout<<"processing frame "<<i<<" over "<<nbframes<<std::endl;
+		{
+			ProfileFrame profile_frame(i);
+			ProfileTimer timer(PROF_DECODE);
+			if (opts.yuv420) {
+				if (!instreamer->get_next_frame_yuv420(&curInput[0])) break;
+				if (!processedstreamer->get_next_frame_yuv420(&curProcessed[0])) break;
+			} else {
+				if (!instreamer->get_next_frame(&curInput[0])) break;
+				if (!processedstreamer->get_next_frame(&curProcessed[0])) break;
+			}
+		}
+
+		engine.push(&curInput[0], &curProcessed[0]);
+
+		while (engine.try_pop(&curSolution[0])) write_frame();
+	}
+
+	engine.finish();
+	while (engine.pop(&curSolution[0])) write_frame();
+	if (!ckpt.file.empty() && nwritten>ckpt.first_frame && nwritten%ckpt.every!=0) save_checkpoint();
+}
+
+// outputs written as one image file per frame
+bool is_image_output(std::string outfile) {
+	std::string ext = extract_fileext(outfile);
+	return ext.find("png")!=string::npos || ext.find("bmp")!=string::npos || ext.find("jpg")!=string::npos ||
+		ext.find("tga")!=string::npos || ext.find("pfm")!=string::npos;
+}
+
+// output file of a lambda of a sweep : "_l<lambda>" is inserted before the extension, and before the frame number (or
+// the %d pattern) of image sequences ("take2.y4m" -> "take2_l0.5.y4m", "out_0000.png" -> "out_l0.5_0000.png").
+std::string lambda_output_name(const std::string &outfile, double lambda) {
+	size_t dir = outfile.find_last_of("/\\");
+	size_t pos = outfile.find_last_of(".");
+	if (pos==std::string::npos || (dir!=std::string::npos && pos<dir)) pos = outfile.size();
+	size_t start = (dir==std::string::npos) ? 0 : dir+1;
+	if (is_image_output(outfile)) {
+		size_t pattern = outfile.find('%', start);
+		if (pattern!=std::string::npos) pos = pattern;
+		else while (pos>start && isdigit((unsigned char)outfile[pos-1])) pos--;
+		if (pos>start && (outfile[pos-1]=='_' || outfile[pos-1]=='-')) pos--;
+	}
+	std::stringstream tag;
+	tag<<"_l"<<lambda;
+	return outfile.substr(0, pos) + tag.str() + outfile.substr(pos);
+}
+
+// comma separated values ; empty if the list is missing or invalid.
+std::vector<double> parse_lambdas(const char* list) {
+	std::vector<double> lambdas;
+	if (!list) return lambdas;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		char* end;
+		double v = strtod(item.c_str(), &end);
+		if (item.empty() || *end!=0 || v<0) return std::vector<double>();
+		lambdas.push_back(v);
+	}
+	return lambdas;
+}
+
+// options are given after the positional arguments, as "--name value".
+int nb_positional_args(int argc, const char* argv[]) {
+	int n = 1;
+	while (n<argc && strncmp(argv[n], "--", 2)!=0) n++;
+	return n;
+}
+
+const char* get_option(int argc, const char* argv[], const char* name, const char* default_value) {
+	for (int i=1; i<argc-1; i++) {
+		if (strncmp(argv[i], "--", 2)==0 && strcmp(argv[i]+2, name)==0)
+			return argv[i+1];
+	}
+	return default_value;
+}
+
+int get_option(int argc, const char* argv[], const char* name, int default_value) {
+	const char* v = get_option(argc, argv, name, (const char*)NULL);
+	return v ? atoi(v) : default_value;
+}
+
+// recorder for 'outfile' (out_fd>=0 : a pipe) ; NULL if it cannot be opened. first_frame > 0 appends to the output of a resumed run.
+// threads : threads of the job, the default of --enc-threads
+VideoRecorder<float>* open_recorder(int argc, const char* argv[], std::string outfile, int out_fd, int W, int H, int fps_num, int fps_den, int first_frame, int threads) {
+	if (out_fd>=0) {
+		bool y4m = strcmp(get_option(argc, argv, "pipe-format", "y4m"), "raw")!=0;
+		return new VideoRecorderYUV<float>(out_fd, W, H, y4m, get_option(argc, argv, "yuv-bitdepth", 8), fps_num, fps_den);
+	} else if (extract_fileext(outfile).find("yuv")!=string::npos || extract_fileext(outfile).find("y4m")!=string::npos) {
+		VideoRecorderYUV<float>* yuvout = new VideoRecorderYUV<float>(outfile.c_str(), W, H, get_option(argc, argv, "yuv-bitdepth", 8), fps_num, fps_den, get_option(argc, argv, "direct-io", 0)!=0, first_frame);
+		if (!yuvout->out.is_open()) {
+			delete yuvout;
+			return NULL;
+		}
+		return yuvout;
+	} else {
+		if (is_image_output(outfile)) {
+			ImageEncodeOptions opts;
+			opts.compression_level = get_option(argc, argv, "png-level", -1);
+			opts.png_filter = get_option(argc, argv, "png-filter", 0);
+			opts.jpeg_quality = get_option(argc, argv, "jpeg-quality", 2);
+			return new VideoRecorderImage<float>(outfile.c_str(), W, H, get_option(argc, argv, "write-queue", 8), opts, first_frame);
+		} else {
+			if (first_frame>0) {
+				std::cout<<"cannot append to a compressed video : resume needs a .yuv, .y4m or image sequence output"<<std::endl;
+				return NULL;
+			}
+			EncoderOptions opts;
+			opts.threads = get_option(argc, argv, "enc-threads", threads);
+			opts.slices = get_option(argc, argv, "enc-slices", 0);
+			opts.crf = (float)atof(get_option(argc, argv, "crf", "-1"));
+			opts.lookahead = get_option(argc, argv, "lookahead", -1);
+			opts.preset = get_option(argc, argv, "preset", "");
+			opts.queue_depth = get_option(argc, argv, "enc-queue", 8);
+			int codec_id = 2; // mpeg2
+			const char* codec_name = get_option(argc, argv, "codec", (const char*)NULL);
+			if (codec_name) {
+				avcodec_register_all();
+				AVCodec* codec = avcodec_find_encoder_by_name(codec_name);
+				if (codec) codec_id = codec->id;
+				else std::cout<<"unknown encoder "<<codec_name<<", using mpeg2"<<std::endl;
+			}
+			return new VideoRecorderMPG<float>(outfile.c_str(), W, H, codec_id, opts);
+		}
+	}
+}
+
+// one run : input, processed, output files and options from the command line. status (may be NULL) receives the progress.
+int run_job(int argc, const char* argv[], JobStatus* status) {
 
 	
 	std::string infile(argv[1]);
@@ -75,34 +429,109 @@ int main(int argc, const char* argv[]) {
 	std::string outfile(argv[4]);
 	int nbframes = std::atoi(argv[5]); // max # frames to process
 
+	SolverParams params;
+	if (!set_flow_preset(params, get_option(argc, argv, "flow-preset", "medium")) || !set_solver_preset(params, get_option(argc, argv, "solver-preset", "medium"))) {
+		std::cout<<"unknown preset (fast, medium or slow)"<<std::endl;
+		return 1;
+	}
+	// threads of this run : the scheduler budget, or the share of a server job ; PatchMatch teams and the encoder use them
+	const int job_threads = status && status->threads>0 ? status->threads : Scheduler::instance().size();
+	params.flow_threads = job_threads;
+	// reduced resolution flow and solve (e.g. 0.5 or 0.25 for 4K), the correction is upsampled with a guided filter of that radius (0 : bilinear)
+	params.scale = std::min(1.f, std::max(0.05f, (float)atof(get_option(argc, argv, "solve-scale", "1"))));
+	params.guided_radius = get_option(argc, argv, "guided-radius", 0);
+	// incremental solve : tiles whose input and solution residual change less than that keep the previous solution (0 : off)
+	params.static_threshold = (float)atof(get_option(argc, argv, "static-threshold", "0"));
+	params.static_tile = get_option(argc, argv, "static-tile", 32);
+	// 16 bit storage : right-hand sides and pyramids of the solver in half floats, queued and previous frames in half or fixed point
+	StorageType frame_storage = STORAGE_FLOAT;
+	if (!parse_storage(get_option(argc, argv, "solver-storage", "float"), params.storage) || params.storage==STORAGE_FIXED16 || !parse_storage(get_option(argc, argv, "frame-storage", "float"), frame_storage)) {
+		std::cout<<"unknown storage (--solver-storage float or half, --frame-storage float, half or int16)"<<std::endl;
+		return 1;
+	}
+	if (params.storage==STORAGE_HALF && params.static_threshold>0) std::cout<<"--static-threshold needs --solver-storage float, not used"<<std::endl;
+	// 4:2:0 solve : luma at full resolution, chroma at quarter area, read and written without colour conversion for y4m/yuv and pipes
+	bool yuv420 = get_option(argc, argv, "yuv420", 0)!=0;
+	if (yuv420 && (params.scale<1 || params.static_threshold>0)) std::cout<<"--solve-scale and --static-threshold are not used with --yuv420"<<std::endl;
+	// sliding window : K frames solved jointly, the next window starting K - overlap frames later (batch jobs : more parallel work, more latency)
+	int window = std::max(1, get_option(argc, argv, "window", 1));
+	int window_overlap = get_option(argc, argv, "window-overlap", 1);
+	params.window_iters = std::max(1, get_option(argc, argv, "window-iters", params.window_iters));
+	params.window_tol = (float)atof(get_option(argc, argv, "window-tol", "0.001"));
+	if (window>1 && yuv420) {
+		std::cout<<"--window is not used with --yuv420"<<std::endl;
+		window = 1;
+	}
+	if (window>1 && (params.scale<1 || params.static_threshold>0 || params.storage!=STORAGE_FLOAT)) std::cout<<"--solve-scale, --static-threshold and --solver-storage are not used with --window"<<std::endl;
+
+	// lambda sweep : --lambdas 0.5,1,2 writes one output per value (named by lambda_output_name) in a single pass
+	const char* lambda_list = get_option(argc, argv, "lambdas", (const char*)NULL);
+	std::vector<double> lambdas = parse_lambdas(lambda_list);
+	if (lambda_list && lambdas.empty()) {
+		std::cout<<"invalid --lambdas "<<lambda_list<<" (comma separated values)"<<std::endl;
+		return 1;
+	}
+	if (!lambdas.empty() && pipe_descriptor(outfile, 1)>=0) {
+		std::cout<<"--lambdas needs file outputs, not a pipe"<<std::endl;
+		return 1;
+	}
+
 	VideoStreamer<float> *instreamer;
 	VideoStreamer<float> *processedstreamer;
-	VideoRecorder<float> *outputsRec;
 
-	int W, H;
-	if (argc>6) {
+	int W = 0, H = 0;
+	if (nb_positional_args(argc, argv)>7) {
 		W = atoi(argv[6]);
 		H = atoi(argv[7]);
 	}
 
-	if (extract_fileext(infile).find("yuv")!=string::npos) {
+	// pipes ("-", "pipe:N") : y4m or raw I420 streams. When input and processed name the same pipe, their frames are interleaved.
+	// frames written to stdout use the original descriptor, log messages go to stderr.
+	int in_fd = pipe_descriptor(infile, 0);
+	int processed_fd = pipe_descriptor(processedfile, 0);
+	int out_fd = pipe_descriptor(outfile, 1);
+	if (out_fd==1) out_fd = detach_stdout();
+	std::shared_ptr<YUVPipeSource> inpipe;
+
+	if (in_fd>=0) {
+		inpipe.reset(new YUVPipeSource(in_fd, W, H, get_option(argc, argv, "pipe-bitdepth", 8)));
+		instreamer = new VideoStreamerPipe<float>(inpipe);
+		W = instreamer->W;
+		H = instreamer->H;
+		if (W==0 || H==0) {
+			delete instreamer;
+			return 1;
+		}
+	} else if (extract_fileext(infile).find("yuv")!=string::npos || extract_fileext(infile).find("y4m")!=string::npos) {
 		instreamer = new VideoStreamerYUV<float>(infile, W, H);
+		W = instreamer->W;
+		H = instreamer->H;
+		if (W==0 || H==0) {
+			delete instreamer;
+			return 1;
+		}
 	} else {
 		if (extract_fileext(infile).find("png")!=string::npos || extract_fileext(infile).find("bmp")!=string::npos ||
 			extract_fileext(infile).find("jpg")!=string::npos || extract_fileext(infile).find("tga")!=string::npos) {
-			instreamer = new VideoStreamerImage<float>(infile);
+			instreamer = new VideoStreamerImage<float>(infile, get_option(argc, argv, "prefetch", 8));
+			W = instreamer->W;
+			H = instreamer->H;
 		} else {
 			instreamer = new VideoStreamerMPG<float>(infile);
 			W = instreamer->W;
 			H = instreamer->H;
 		}
 	}
-	if (extract_fileext(processedfile).find("yuv")!=string::npos) {
+	if (processed_fd>=0 && processed_fd==in_fd) {
+		processedstreamer = new VideoStreamerPipe<float>(inpipe);
+	} else if (processed_fd>=0) {
+		processedstreamer = new VideoStreamerPipe<float>(std::shared_ptr<YUVPipeSource>(new YUVPipeSource(processed_fd, W, H, get_option(argc, argv, "pipe-bitdepth", 8))));
+	} else if (extract_fileext(processedfile).find("yuv")!=string::npos || extract_fileext(processedfile).find("y4m")!=string::npos) {
 		processedstreamer = new VideoStreamerYUV<float>(processedfile, W, H);
 	} else {
 		if (extract_fileext(processedfile).find("png")!=string::npos || extract_fileext(processedfile).find("bmp")!=string::npos ||
 			extract_fileext(processedfile).find("jpg")!=string::npos || extract_fileext(processedfile).find("tga")!=string::npos) {
-			processedstreamer = new VideoStreamerImage<float>(processedfile);
+			processedstreamer = new VideoStreamerImage<float>(processedfile, get_option(argc, argv, "prefetch", 8));
 		} else {
 			processedstreamer = new VideoStreamerMPG<float>(processedfile);
 		}
@@ -111,48 +540,160 @@ int main(int argc, const char* argv[]) {
 
 	
 	nbframes = std::min(nbframes, std::min(instreamer->nbframes, processedstreamer->nbframes));
-
-	if (extract_fileext(outfile).find("yuv")!=string::npos) {
-		outputsRec = new VideoRecorderYUV<float>(outfile.c_str(), W, H);
-	} else {
-		if (extract_fileext(outfile).find("png")!=string::npos || extract_fileext(outfile).find("bmp")!=string::npos ||
-			extract_fileext(outfile).find("jpg")!=string::npos || extract_fileext(outfile).find("tga")!=string::npos) {
-			outputsRec = new VideoRecorderImage<float>(outfile.c_str(), W, H);
+	if (status) status->nbframes = nbframes;
+
+	// scene cut detection (0 : disabled) ; with several shot workers, shots are solved in parallel.
+	double scene_threshold = atof(get_option(argc, argv, "scene-threshold", "0"));
+	int shot_workers = get_option(argc, argv, "shot-workers", 1);
+	bool parallel_shots = shot_workers>1 && scene_threshold>0 && lambdas.empty() && !yuv420;
+	if (shot_workers>1 && !lambdas.empty()) std::cout<<"--lambdas is solved sequentially, --shot-workers ignored"<<std::endl;
+	if (shot_workers>1 && yuv420) std::cout<<"--yuv420 is solved sequentially, --shot-workers ignored"<<std::endl;
+
+	// checkpoints of the sequential recurrence ; --resume 1 continues from the checkpoint file, if there is one.
+	CheckpointOptions ckpt;
+	ckpt.file = get_option(argc, argv, "checkpoint", "");
+	ckpt.every = std::max(1, get_option(argc, argv, "checkpoint-every", 500));
+	if (parallel_shots && !ckpt.file.empty()) {
+		std::cout<<"checkpoints need sequential processing (--shot-workers 1), disabled"<<std::endl;
+		ckpt.file.clear();
+	}
+	if (!lambdas.empty() && !ckpt.file.empty()) {
+		std::cout<<"checkpoints hold a single solution, disabled with --lambdas"<<std::endl;
+		ckpt.file.clear();
+	}
+	if (yuv420 && !ckpt.file.empty()) {
+		std::cout<<"checkpoints hold RGB frames, disabled with --yuv420"<<std::endl;
+		ckpt.file.clear();
+	}
+	if (!ckpt.file.empty() && get_option(argc, argv, "resume", 0)) {
+		Checkpoint saved;
+		if (!saved.load(ckpt.file)) {
+			std::cout<<"no checkpoint in "<<ckpt.file<<", starting from the first frame"<<std::endl;
+		} else if (saved.W!=W || saved.H!=H) {
+			std::cout<<"checkpoint "<<ckpt.file<<" is for "<<saved.W<<"x"<<saved.H<<" frames"<<std::endl;
+			delete processedstreamer;
+			delete instreamer;
+			return 1;
+		} else if (saved.frames_done>=nbframes) {
+			std::cout<<"checkpoint "<<ckpt.file<<" : all "<<nbframes<<" frames already done"<<std::endl;
+			if (status) status->frame = nbframes;
+			delete processedstreamer;
+			delete instreamer;
+			return 0;
 		} else {
-			outputsRec = new VideoRecorderMPG<float>(outfile.c_str(), W, H);
+			std::cout<<"resuming at frame "<<saved.frames_done<<std::endl;
+			ckpt.prevInput.resize(W*H*3);
+			if (!seek_inputs(instreamer, processedstreamer, saved.frames_done, processed_fd>=0 && processed_fd==in_fd, &ckpt.prevInput[0])) {
+				std::cout<<"cannot seek the inputs to frame "<<saved.frames_done<<std::endl;
+				delete processedstreamer;
+				delete instreamer;
+				return 1;
+			}
+			ckpt.first_frame = saved.frames_done;
+			ckpt.prevSolution.swap(saved.prevSolution);
+			if (status) status->frame = ckpt.first_frame;
 		}
 	}
 
+	// frame rate of a y4m input is kept
+	int fps_num = 25, fps_den = 1;
+	VideoStreamerYUV<float>* yuvin = dynamic_cast<VideoStreamerYUV<float>*>(instreamer);
+	if (yuvin) {
+		fps_num = yuvin->fmt.fps_num;
+		fps_den = yuvin->fmt.fps_den;
+	}
+	if (inpipe && inpipe->is_y4m) {
+		fps_num = inpipe->fmt.fps_num;
+		fps_den = inpipe->fmt.fps_den;
+	}
 
-	std::vector<float> prevInput(W*H*3);
-	std::vector<float> curInput(W*H*3);
-
-	std::vector<float> curProcessed(W*H*3);
-
-	std::vector<float> prevSolution(W*H*3);
-	std::vector<float> curSolution(W*H*3);
-
-
-	for (int i=0; i<nbframes; i++) {
-
-		std::cout<<"processing frame "<<i<<" over "<<nbframes<<std::endl;
-		if (!instreamer->get_next_frame(&curInput[0])) break;
-		if (!processedstreamer->get_next_frame(&curProcessed[0])) break;
-
-		curSolution = curProcessed;
-		solve_frame<float>(&prevInput[0], &curInput[0], &curProcessed[0], &prevSolution[0], &curSolution[0], W, H, lambdaT, i==0);		
-
-		prevInput = curInput;
-		prevSolution = curSolution;		
+	std::vector<VideoRecorder<float>*> outputs;
+	for (size_t l=0; l<std::max((size_t)1, lambdas.size()); l++) {
+		VideoRecorder<float>* rec = open_recorder(argc, argv, lambdas.empty() ? outfile : lambda_output_name(outfile, lambdas[l]), out_fd, W, H, fps_num, fps_den, ckpt.first_frame, job_threads);
+		if (!rec) {
+			for (size_t i=0; i<outputs.size(); i++) delete outputs[i];
+			delete processedstreamer;
+			delete instreamer;
+			return 1;
+		}
+		outputs.push_back(rec);
+	}
 
-		outputsRec->addFrame(&curSolution[0]);
+	// tiled mode : --memory-cap MB bounds the memory of a run, frames too large for it are processed in overlapping tiles.
+	// Only the flow and solver buffers are tiled : the frames and the flow stay in memory at full resolution.
+	int memory_cap = get_option(argc, argv, "memory-cap", 0);
+	int latency = get_option(argc, argv, "latency", memory_cap>0 ? 2 : 8);
+	if (memory_cap>0 && yuv420) {
+		std::cout<<"--memory-cap is not used with --yuv420"<<std::endl;
+	} else if (memory_cap>0 && window>1) {
+		std::cout<<"--memory-cap is not used with --window"<<std::endl;
+	} else if (memory_cap>0) {
+		int held = parallel_shots ? 2*get_option(argc, argv, "shot-buffer", 32) : latency + 2;
+		params.tile_pixels = tile_pixels_for_memory(W, H, memory_cap, held);
+		if (params.tile_pixels>0) std::cout<<"tiled processing : tiles of at most "<<params.tile_pixels<<" pixels"<<std::endl;
+		if (params.tile_pixels==128*128) std::cout<<"--memory-cap "<<memory_cap<<" MB is too small for "<<W<<"x"<<H<<" frames, using the smallest tiles"<<std::endl;
+	}
 
+	if (parallel_shots) {
+		if (frame_storage!=STORAGE_FLOAT) std::cout<<"--frame-storage is not used with --shot-workers"<<std::endl;
+		if (window>1) std::cout<<"--window is not used with --shot-workers"<<std::endl;
+		process_shots(instreamer, processedstreamer, outputs[0], nbframes, W, H, lambdaT, params, scene_threshold, shot_workers, get_option(argc, argv, "shot-buffer", 32), status);
+	} else {
+		if (shot_workers>1 && lambdas.empty() && !yuv420) std::cout<<"--shot-workers needs --scene-threshold, processing sequentially"<<std::endl;
+		EngineOptions opts;
+		opts.lambda_t = lambdaT;
+		opts.lambdas = lambdas;
+		opts.flow_lookahead = get_option(argc, argv, "flow-lookahead", 0);
+		opts.flow_threads = get_option(argc, argv, "flow-threads", 0);
+		opts.scene_threshold = scene_threshold;
+		opts.max_latency = latency;
+		opts.solver = params;
+		opts.yuv420 = yuv420;
+		opts.frame_storage = frame_storage;
+		opts.window = window;
+		opts.window_overlap = window_overlap;
+		process_frames(instreamer, processedstreamer, outputs, nbframes, W, H, opts, status, ckpt);
 	}
 	
-	outputsRec->finalize_video();
-
-
-	return 0;
+	int ret = 0;
+	for (size_t l=0; l<outputs.size(); l++) {
+		outputs[l]->finalize_video();
+		if (outputs[l]->failed()) {
+			std::cout<<"the output is incomplete (write error)"<<std::endl;
+			ret = 1;
+		}
+		delete outputs[l];
+	}
+	delete processedstreamer;
+	delete instreamer;
+	return ret;
 }
 
+int main(int argc, const char* argv[]) {
+
+	// global thread budget, shared by the scheduler stages ; PatchMatch keeps OpenMP teams of at most that size.
+	int threads = get_option(argc, argv, "threads", get_option(argc, argv, "server-threads", omp_get_max_threads()));
+	Scheduler &sched = Scheduler::instance();
+	sched.set_budget(threads);
+	omp_set_num_threads(threads);
+	int write_threads = get_option(argc, argv, "write-threads", 0);
+	if (write_threads>0) sched.set_affinity(STAGE_ENCODE, 0, write_threads);
+
+	// per-stage timings : --profile file.jsonl|file.csv (one record per frame), --profile-summary 1 (totals only)
+	const char* profile_file = get_option(argc, argv, "profile", (const char*)NULL);
+	if (profile_file || get_option(argc, argv, "profile-summary", 0)) Profiler::instance().enable(profile_file ? profile_file : "");
+
+	// server mode : stabilize.exe --server spool_dir [--server-jobs N] [--server-threads T]
+	int ret = 0;
+	const char* spool_dir = get_option(argc, argv, "server", (const char*)NULL);
+	if (spool_dir) {
+		JobServer server(spool_dir, get_option(argc, argv, "server-jobs", 2), threads, run_job);
+		server.serve(get_option(argc, argv, "poll-ms", 500), get_option(argc, argv, "exit-when-idle", 0)!=0);
+	} else {
+		ret = run_job(argc, argv, NULL);
+	}
 
+	if (get_option(argc, argv, "sched-stats", 0)) sched.print_stats(std::cout);
+	if (Profiler::instance().is_enabled()) Profiler::instance().print_summary(std::cout);
+	return ret;
+}
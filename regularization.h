@@ -38,8 +38,87 @@
 
 #include <omp.h>
 #include <string>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include "CImg.h"
 #include "OptFlowPatchMatch.h"
+#include "ThreadPool.h"
+#include "Storage.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define REG_USE_SSE2 1
+#include <emmintrin.h>
+#else
+#define REG_USE_SSE2 0
+#endif
+
+
+
+// speed / quality settings ; the defaults are the ones of the paper's implementation.
+struct SolverParams {
+	SolverParams() : nlevels(5), niter(50), flow_iters(5), flow_threads(0), scale(1.f), guided_radius(0), static_threshold(0.f), static_tile(32), tile_pixels(0), storage(STORAGE_FLOAT), window_iters(15), window_tol(1e-3f) {}
+	int nlevels;       // pyramid levels of the multiscale solver
+	int niter;         // Jacobi iterations per level
+	int flow_iters;    // PatchMatch iterations
+	int flow_threads;  // OpenMP team of a PatchMatch search, reserved from the scheduler budget (0 : the whole budget)
+	float scale;       // < 1 : flow and solve at this fraction of the resolution, the correction (solution - processed) is upsampled
+	int guided_radius; // with scale < 1 : radius (full resolution pixels) of the guided filter that upsamples the correction, 0 : bilinear
+	float static_threshold; // > 0 : tiles below that change keep the previous solution, see solve_active_tiles
+	int static_tile;        // tile size (pixels) of the change detection
+	int tile_pixels;        // > 0 : larger frames are processed in overlapping tiles of at most that many pixels, see solve_tiled
+	StorageType storage;    // right-hand sides, diagonals and their pyramids : STORAGE_FLOAT or STORAGE_HALF (see solve_system)
+	int window_iters;       // maximum conjugate gradient iterations of solve_window
+	float window_tol;       // they stop when the preconditioned residual falls below that fraction of the initial one
+};
+
+// tiles of the tiled mode : square cores of 'core' pixels, extended by 'margin' pixels on each side (at most params.tile_pixels pixels).
+inline bool use_tiles(int W, int H, const SolverParams &params) {
+	return params.tile_pixels > 0 && (long long)W*H > params.tile_pixels;
+}
+inline void tile_layout(const SolverParams &params, int &core, int &margin) {
+	int side = std::max(128, (int)sqrt((double)params.tile_pixels));
+	margin = std::max(16, side/8);
+	core = side - 2*margin;
+}
+
+// tile size for a memory budget (megabytes) : the frames kept at full resolution come first ('frames_held' input and
+// processed pairs in the queues, 24 bytes per pixel each, plus the solutions and the flow, about 50 bytes per pixel), the
+// rest goes to the per-tile buffers of the flow and the solver (about 160 bytes per pixel). 0 if the whole frame fits.
+// Tiling only bounds these working buffers : frames are not streamed from disk, they stay in memory at full resolution,
+// as does the flow written by tiled_backward_flow, so the cap cannot go below the full term.
+inline int tile_pixels_for_memory(int W, int H, double megabytes, int frames_held) {
+	const double full = 24.*frames_held + 50., per_tile_pixel = 160.;
+	double left = megabytes*1024.*1024. - full*W*H;
+	if (left >= per_tile_pixel*W*H) return 0;
+	return (int)std::max(128.*128., left/per_tile_pixel);
+}
+
+// size of the flow and of the solve for params.scale ; the flow buffers keep their full resolution size.
+inline void reduced_size(int W, int H, const SolverParams &params, int &Ws, int &Hs) {
+	Ws = W;
+	Hs = H;
+	if (params.scale >= 1.f) return;
+	Ws = std::min(W, std::max(16, (int)(W*params.scale + 0.5f)));
+	Hs = std::min(H, std::max(16, (int)(H*params.scale + 0.5f)));
+}
+
+// presets "fast", "medium" (the defaults) and "slow" ; return false for an unknown name.
+inline bool set_flow_preset(SolverParams &params, const char* name) {
+	if (!strcmp(name, "fast")) params.flow_iters = 2;
+	else if (!strcmp(name, "medium")) params.flow_iters = 5;
+	else if (!strcmp(name, "slow")) params.flow_iters = 10;
+	else return false;
+	return true;
+}
+
+inline bool set_solver_preset(SolverParams &params, const char* name) {
+	if (!strcmp(name, "fast")) { params.nlevels = 3; params.niter = 20; params.window_iters = 8; }
+	else if (!strcmp(name, "medium")) { params.nlevels = 5; params.niter = 50; params.window_iters = 15; }
+	else if (!strcmp(name, "slow")) { params.nlevels = 6; params.niter = 100; params.window_iters = 30; }
+	else return false;
+	return true;
+}
 
 
 template<typename T>
@@ -54,6 +133,61 @@ T bilinear(const T* table, int W, int H, float x, float y, int stride = 1) {
 template<typename T>
 static inline T sqr(T x) { return x*x; };
 
+// e^-x for x >= 0 : 2^-x*log2(e) as exponent bits times a polynomial for the fractional part in [-0.5, 0.5] (relative error < 1e-5).
+// Branch-free apart from the cutoff, so loops using it vectorize.
+static inline float fast_exp_neg(float x) {
+	if (x > 87.f) return 0.f;
+	float t = -x*1.44269504f;
+	float n = floor(t + 0.5f), f = t - n;
+	float p = 1.f + f*(0.69314718f + f*(0.24022651f + f*(0.05550411f + f*(0.00961813f + f*(0.00133336f + f*0.00015404f)))));
+	int bits = ((int)n + 127) << 23;
+	float scale;
+	memcpy(&scale, &bits, sizeof(scale));
+	return p*scale;
+}
+
+#if REG_USE_SSE2
+// fast_exp_neg on 4 values, with the same operations in the same order (same results).
+static inline __m128 fast_exp_neg_ps(__m128 x) {
+	const __m128 t = _mm_mul_ps(_mm_xor_ps(x, _mm_set1_ps(-0.f)), _mm_set1_ps(1.44269504f));
+	const __m128 r = _mm_add_ps(t, _mm_set1_ps(0.5f));
+	__m128 n = _mm_cvtepi32_ps(_mm_cvttps_epi32(r));
+	n = _mm_sub_ps(n, _mm_and_ps(_mm_cmpgt_ps(n, r), _mm_set1_ps(1.f))); // floor
+	const __m128 f = _mm_sub_ps(t, n);
+	__m128 p = _mm_add_ps(_mm_set1_ps(0.00133336f), _mm_mul_ps(f, _mm_set1_ps(0.00015404f)));
+	p = _mm_add_ps(_mm_set1_ps(0.00961813f), _mm_mul_ps(f, p));
+	p = _mm_add_ps(_mm_set1_ps(0.05550411f), _mm_mul_ps(f, p));
+	p = _mm_add_ps(_mm_set1_ps(0.24022651f), _mm_mul_ps(f, p));
+	p = _mm_add_ps(_mm_set1_ps(0.69314718f), _mm_mul_ps(f, p));
+	p = _mm_add_ps(_mm_set1_ps(1.f), _mm_mul_ps(f, p));
+	const __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(127)), 23));
+	return _mm_and_ps(_mm_cmple_ps(x, _mm_set1_ps(87.f)), _mm_mul_ps(p, scale));
+}
+
+// 4 RGB pixels : RGBR GBRG BRGB <-> RRRR GGGG BBBB
+static inline void deinterleave3_ps(const float* src, __m128 &R, __m128 &G, __m128 &B) {
+	const __m128 in0 = _mm_loadu_ps(src), in1 = _mm_loadu_ps(src + 4), in2 = _mm_loadu_ps(src + 8);
+	R = _mm_shuffle_ps(in0, _mm_shuffle_ps(in1, in2, _MM_SHUFFLE(1, 1, 2, 2)), _MM_SHUFFLE(2, 0, 3, 0));
+	G = _mm_shuffle_ps(_mm_shuffle_ps(in0, in1, _MM_SHUFFLE(0, 0, 1, 1)), _mm_shuffle_ps(in1, in2, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0));
+	B = _mm_shuffle_ps(_mm_shuffle_ps(in0, in1, _MM_SHUFFLE(1, 1, 2, 2)), _mm_shuffle_ps(in2, in2, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0));
+}
+static inline void interleave3_ps(__m128 R, __m128 G, __m128 B, __m128 &out0, __m128 &out1, __m128 &out2) {
+	const __m128 t0 = _mm_unpacklo_ps(R, G), t1 = _mm_unpackhi_ps(R, G);
+	const __m128 a = _mm_shuffle_ps(B, t0, _MM_SHUFFLE(2, 2, 0, 0));
+	const __m128 b = _mm_shuffle_ps(t0, B, _MM_SHUFFLE(1, 1, 3, 3));
+	const __m128 c = _mm_shuffle_ps(B, t1, _MM_SHUFFLE(2, 2, 2, 2));
+	const __m128 d = _mm_shuffle_ps(t1, B, _MM_SHUFFLE(3, 3, 3, 3));
+	out0 = _mm_shuffle_ps(t0, a, _MM_SHUFFLE(2, 0, 1, 0));
+	out1 = _mm_shuffle_ps(b, t1, _MM_SHUFFLE(1, 0, 2, 0));
+	out2 = _mm_shuffle_ps(c, d, _MM_SHUFFLE(2, 0, 2, 0));
+}
+
+// channel 'off' of the 4 pixels at offsets q[] of an RGB image
+static inline __m128 gather4_ps(const float* a, const int* q, int off) {
+	return _mm_setr_ps(a[q[0]+off], a[q[1]+off], a[q[2]+off], a[q[3]+off]);
+}
+#endif
+
 template<typename T>
 double get_weight(const T* cur_frame, const T* prev_frame, int W, int H, const float* flow, int pix) {
 
@@ -73,115 +207,1064 @@ double get_weight(const T* cur_frame, const T* prev_frame, int W, int H, const f
 }
 
 
+// n values of a stored row as T : in place when they are stored as T, converted into 'tmp' (vectorized) otherwise.
 template<typename T>
-void gauss_seidel(T* result_init, const T* processed, const T* diag, const T* rhs, const int W, const int H, const int niter) {
+inline const T* stored_row(const T* row, int, std::vector<T> &) { return row; }
+inline const float* stored_row(const float16* row, int n, std::vector<float> &tmp) {
+	tmp.resize(n);
+	load_values(row, n, &tmp[0]);
+	return &tmp[0];
+}
 
-	std::vector<T> tmp(W*H*3);
+// NC : values per pixel (3 : RGB, 1 and 2 : the luma and chroma planes of the 4:2:0 solve).
+// S : storage of diag and rhs (T, or float16 : see Storage.h) ; the iterates stay in T, rows are converted as they are read.
+template<typename T, int NC = 3, typename S = T>
+void gauss_seidel(T* result_init, const T* processed, const S* diag, const S* rhs, const int W, const int H, const int niter) {
+
+	std::vector<T> tmp(W*H*NC);
 	T *pxA = result_init, *pxB = &tmp[0];
 
+	Scheduler &sched = Scheduler::instance();
 	for (int iter = 0; iter<niter; iter++) {
 
-#pragma omp parallel for
-		for (int i = 0; i < H; i++) {
+		sched.parallel_for(0, H, [&](int i) {
+			std::vector<T> diag_tmp, rhs_tmp;
+			const T* diag_row = stored_row(diag + i*W, W, diag_tmp);
+			const T* rhs_row = stored_row(rhs + i*W*NC, W*NC, rhs_tmp);
 			for (int j = 0; j < W; j++) {
-				for (int k = 0; k < 3; k++) {
-					int p = (i*W+j)*3+k;
-					const T up = i>0?pxA[p - 3*W]:0.;
-					const T down = i<(H-1)?pxA[p + 3*W]:0.;
-					const T left = j>0?pxA[p - 3]:0.;
-					const T right = j<(W-1)?pxA[p + 3]:0.;
-
-					int laplace = 4;
-					if (i == 0 || i == H - 1) laplace--;
-					if (j == 0 || j == W - 1) laplace--;
-					pxB[p] =  up + down + left + right + rhs[p];
+				const double invdiag = 1./diag_row[j];
+				for (int k = 0; k < NC; k++) {
+					int p = (i*W+j)*NC+k;
+					const T up = i>0?pxA[p - NC*W]:0.;
+					const T down = i<(H-1)?pxA[p + NC*W]:0.;
+					const T left = j>0?pxA[p - NC]:0.;
+					const T right = j<(W-1)?pxA[p + NC]:0.;
+					const T sum = up + down + left + right + rhs_row[j*NC+k];
+					pxB[p] = (T)(sum*invdiag);
 				}
 			}
-		}
-
-#pragma omp parallel for
-		for (int i = 0; i < W*H; i++) {
-			double invdiag = 1./diag[i];
-			pxB[i*3] *= invdiag;
-			pxB[i*3+1] *= invdiag;
-			pxB[i*3+2] *= invdiag;
-		}
+		}, STAGE_SOLVE);
 
 		std::swap(pxA, pxB);
 	}
+	Profiler::instance().add_count(PROF_SOLVER_SWEEPS, niter);
+	Profiler::instance().add_count(PROF_SOLVER_PIXELS, (long long)niter*W*H);
 
 	if (niter % 2 == 0) {
-		memcpy(result_init, &tmp[0], W*H*3*sizeof(result_init[0]));
+		memcpy(result_init, &tmp[0], W*H*NC*sizeof(result_init[0]));
 	}
 
 }
 
 
+// interleaved images (3 values per pixel by default) ; interpolation as in CImg::resize (2 : moving average, 3 : linear).
 template<typename T>
-void multiscale_solver(T* result_init, const T* processed, int W, int H, const T* diag, const T* rhs) {
+void resize_interleaved(const T* src, int W, int H, T* dst, int Wdst, int Hdst, int interpolation, int channels = 3) {
+	cimg_library::CImg<T> img(src, channels, W, H, 1, false);
+	img.resize(channels, Wdst, Hdst, 1, interpolation);
+	memcpy(dst, img.data(), (size_t)Wdst*Hdst*channels*sizeof(T));
+}
 
-	int nlevels = 5;
+// mean over the (2r+1)x(2r+1) window clipped to the image, with running sums : rows, then columns by blocks.
+inline void box_mean(const float* src, int W, int H, int r, float* dst) {
+	std::vector<float> tmp(W*H);
+	Scheduler &sched = Scheduler::instance();
+	sched.parallel_for(0, H, [&](int i) {
+		const float* row = src + i*W;
+		double sum = 0;
+		for (int j = 0; j < std::min(r, W); j++) sum += row[j];
+		for (int j = 0; j < W; j++) {
+			if (j+r < W) sum += row[j+r];
+			if (j-r-1 >= 0) sum -= row[j-r-1];
+			tmp[i*W+j] = (float)(sum/(std::min(W-1, j+r) - std::max(0, j-r) + 1));
+		}
+	}, STAGE_SOLVE);
+	const int block = 64;
+	sched.parallel_for(0, (W+block-1)/block, [&](int b) {
+		const int j0 = b*block, j1 = std::min(W, j0+block);
+		std::vector<double> sum(j1-j0, 0.);
+		for (int i = 0; i < std::min(r, H); i++)
+			for (int j = j0; j < j1; j++) sum[j-j0] += tmp[i*W+j];
+		for (int i = 0; i < H; i++) {
+			const float n = (float)(std::min(H-1, i+r) - std::max(0, i-r) + 1);
+			for (int j = j0; j < j1; j++) {
+				if (i+r < H) sum[j-j0] += tmp[(i+r)*W+j];
+				if (i-r-1 >= 0) sum[j-j0] -= tmp[(i-r-1)*W+j];
+				dst[i*W+j] = (float)(sum[j-j0]/n);
+			}
+		}
+	}, STAGE_SOLVE);
+}
+
+// guided filter (He et al. 2010) of the 3 channels of p, guided by the luminance of 'guide' : p follows the edges of the guide.
+template<typename T>
+void guided_filter(const T* guide, T* p, int W, int H, int r, float eps) {
+	const int n = W*H;
+	std::vector<float> I(n), II(n), mean_I(n), mean_II(n), pc(n), Ip(n), mean_p(n), mean_Ip(n);
+	for (int i = 0; i < n; i++) {
+		I[i] = (float)(0.299*guide[i*3] + 0.587*guide[i*3+1] + 0.114*guide[i*3+2]);
+		II[i] = I[i]*I[i];
+	}
+	box_mean(&I[0], W, H, r, &mean_I[0]);
+	box_mean(&II[0], W, H, r, &mean_II[0]);
+	for (int k = 0; k < 3; k++) {
+		for (int i = 0; i < n; i++) {
+			pc[i] = (float)p[i*3+k];
+			Ip[i] = I[i]*pc[i];
+		}
+		box_mean(&pc[0], W, H, r, &mean_p[0]);
+		box_mean(&Ip[0], W, H, r, &mean_Ip[0]);
+		// a and b reuse pc and Ip
+		for (int i = 0; i < n; i++) {
+			float a = (mean_Ip[i] - mean_I[i]*mean_p[i])/(mean_II[i] - mean_I[i]*mean_I[i] + eps);
+			pc[i] = a;
+			Ip[i] = mean_p[i] - a*mean_I[i];
+		}
+		box_mean(&pc[0], W, H, r, &mean_p[0]);
+		box_mean(&Ip[0], W, H, r, &mean_Ip[0]);
+		for (int i = 0; i < n; i++) p[i*3+k] = (T)(mean_p[i]*I[i] + mean_Ip[i]);
+	}
+}
+
+
+// a level of the pyramid of diag or rhs (linear interpolation, as the solution) ; float16 ones are resized in float.
+template<typename T>
+void resize_stored(const T* src, int C, int W, int H, int Wdst, int Hdst, std::vector<T> &dst) {
+	cimg_library::CImg<T> img(src, C, W, H, 1, false);
+	img.resize(C, Wdst, Hdst, 1, 3);
+	dst.assign(img.data(), img.data() + C*Wdst*Hdst);
+}
+template<typename T>
+void resize_stored(const float16* src, int C, int W, int H, int Wdst, int Hdst, std::vector<float16> &dst) {
+	cimg_library::CImg<float> img(C, W, H, 1);
+	load_values(src, (size_t)C*W*H, img.data());
+	img.resize(C, Wdst, Hdst, 1, 3);
+	dst.resize(C*Wdst*Hdst);
+	store_values(img.data(), dst.size(), &dst[0]);
+}
+
+// S : storage of diag, rhs and their pyramid levels (see gauss_seidel) ; the full resolution level uses them in place.
+template<typename T, int NC = 3, typename S = T>
+void multiscale_solver(T* result_init, const T* processed, int W, int H, const S* diag, const S* rhs, int nlevels = 5, int niter = 50) {
 
-	std::vector<T> downscaled_result(W*H*3);
-	memcpy(&downscaled_result[0], result_init, W*H*3*sizeof(T));
 	for (int i=nlevels; i>=0; i--) {
+		ProfileTimer timer(PROF_SOLVE_LEVEL0 + std::min(i, PROFILE_MAX_LEVELS-1));
 		int Wdst = W>>i;
 		int Hdst = H>>i;
-		cimg_library::CImg<T> res_down(result_init, 3, W, H, 1, false); // shared images pose problem for resize
-		cimg_library::CImg<T> processed_down(processed, 3, W, H, 1, false);
-		cimg_library::CImg<T> diag_down(diag, 1, W, H, 1, false);
-		cimg_library::CImg<T> rhs_down(rhs, 3, W, H, 1, false);
+		cimg_library::CImg<T> res_down(result_init, NC, W, H, 1, false); // shared images pose problem for resize
+		cimg_library::CImg<T> processed_down(processed, NC, W, H, 1, false);
+		std::vector<S> diag_level, rhs_level;
+		const S *diag_down = diag, *rhs_down = rhs;
+		if (Wdst!=W || Hdst!=H) {
+			resize_stored<T>(diag, 1, W, H, Wdst, Hdst, diag_level);
+			resize_stored<T>(rhs, NC, W, H, Wdst, Hdst, rhs_level);
+			diag_down = &diag_level[0];
+			rhs_down = &rhs_level[0];
+		}
+
+		res_down.resize(NC, Wdst, Hdst, 1, 3);  // 3: linear ; 2:moving average ; 5: bicubic		
+		processed_down.resize(NC, Wdst, Hdst, 1, 3);
+
+		gauss_seidel<T, NC, S>(res_down.data(), processed_down.data(), diag_down, rhs_down, Wdst, Hdst, niter);
+
+		res_down.resize(NC, W, H, 1, 3);
+		memcpy(result_init, res_down.data(), W*H*NC*sizeof(T));
+	}
+}
+
+
+
+// build_system for several systems sharing the inputs and the flow (lambda sweeps) : one per lambda_t[s] and prevSolutions[s].
+// The footprint, the temporal weight and the Laplacian of curProcessed are computed once per pixel, only the warped previous
+// solutions differ between the systems.
+template<typename T>
+void build_systems(const T* prevInput, const T* curInput, const T* curProcessed, const T* const* prevSolutions, const float* flow, int W, int H, const double* lambda_t, int nsystems, T* const* rhs, T* const* diag) {
+
+	const float inv_2s2 = 1.f/(2.f*0.05f*0.05f); // s = 0.05, as in get_weight
+	Scheduler::instance().parallel_for(0, H, [&](int i) {
+		for (int j = 0; j < W; j++) {
+			const int pix = i*W+j;
+			const float x = flow[pix*2], y = flow[pix*2+1];
+			float w = 0, w00 = 0, w01 = 0, w10 = 0, w11 = 0;
+			int p00 = 0, p01 = 0, p10 = 0, p11 = 0;
+			if (x > 2 && x < W-2 && y > 2 && y < H-2) {
+				const int xi = (int)x, yi = (int)y;
+				const float fx = x - xi, fy = y - yi;
+				w00 = (1.f-fx)*(1.f-fy); w01 = fx*(1.f-fy); w10 = (1.f-fx)*fy; w11 = fx*fy;
+				p00 = (yi*W+xi)*3; p01 = p00+3; p10 = p00+3*W; p11 = p10+3;
+				float d = 0;
+				for (int k = 0; k < 3; k++) {
+					float v = w00*prevInput[p00+k] + w01*prevInput[p01+k] + w10*prevInput[p10+k] + w11*prevInput[p11+k];
+					d += sqr(v - (float)curInput[pix*3+k]);
+				}
+				w = fast_exp_neg(d*inv_2s2);
+			}
+
+			int laplace = 4;
+			if (i == 0 || i == H - 1) laplace--;
+			if (j == 0 || j == W - 1) laplace--;
+			T lap[3];
+			for (int k = 0; k < 3; k++) {
+				const int p = pix*3+k;
+				const T up = i>0?curProcessed[p - 3*W]:0;
+				const T down = i<(H-1)?curProcessed[p + 3*W]:0;
+				const T left = j>0?curProcessed[p - 3]:0;
+				const T right = j<(W-1)?curProcessed[p + 3]:0;
+				lap[k] = laplace*curProcessed[p] - up - down - left - right;
+			}
+
+			for (int s = 0; s < nsystems; s++) {
+				const float ws = (float)lambda_t[s]*w;
+				const T* prevSolution = prevSolutions[s];
+				T* r = rhs[s] + pix*3;
+				float warped[3] = { 0, 0, 0 };
+				if (w > 0) {
+					for (int k = 0; k < 3; k++)
+						warped[k] = w00*prevSolution[p00+k] + w01*prevSolution[p01+k] + w10*prevSolution[p10+k] + w11*prevSolution[p11+k];
+				}
+				for (int k = 0; k < 3; k++) r[k] = lap[k] + ws*warped[k];
+				diag[s][pix] = laplace + ws;
+			}
+		}
+	}, STAGE_SOLVE);
+}
+
+// SIMD part of build_system : pixels [j0, j1) of row i, which must be interior (0 < i < H-1, 0 < j0, j1 < W-1) ; returns the
+// first pixel left to the scalar loop. Only RGB float systems have one (SSE2, 4 pixels at a time) : the others return j0.
+template<typename T, int NC, int NI, typename S>
+inline int build_system_simd(const T*, const T*, const T*, const T*, const float*, int, int, float, float, int, int j0, int, S*, S*, int) {
+	return j0;
+}
+#if REG_USE_SSE2
+// same operations as the scalar loop, in the same order, so that results do not depend on the column. The bilinear
+// footprints are gathered ; lanes whose flow is within 2 pixels of the border read the footprint of (0,0) and get a zero weight.
+template<>
+inline int build_system_simd<float, 3, 3, float>(const float* prevInput, const float* curInput, const float* curProcessed, const float* prevSolution, const float* flow, int W, int H, float lambda, float inv_2s2,
+	int i, int j0, int j1, float* rhs, float* diag, int qoff) {
+	const __m128 two = _mm_set1_ps(2.f), xmax = _mm_set1_ps((float)(W-2)), ymax = _mm_set1_ps((float)(H-2)), one = _mm_set1_ps(1.f), four = _mm_set1_ps(4.f);
+	const __m128 vlambda = _mm_set1_ps(lambda), vinv = _mm_set1_ps(inv_2s2);
+	const int q01 = 3, q10 = 3*W, q11 = 3*W+3;
+	int j = j0;
+	for (; j + 4 <= j1; j += 4) {
+		const int pix = i*W+j;
+		const __m128 f0 = _mm_loadu_ps(flow + pix*2), f1 = _mm_loadu_ps(flow + pix*2 + 4);
+		const __m128 x = _mm_shuffle_ps(f0, f1, _MM_SHUFFLE(2, 0, 2, 0)), y = _mm_shuffle_ps(f0, f1, _MM_SHUFFLE(3, 1, 3, 1));
+		const __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpgt_ps(x, two), _mm_cmplt_ps(x, xmax)), _mm_and_ps(_mm_cmpgt_ps(y, two), _mm_cmplt_ps(y, ymax)));
+		const __m128 xc = _mm_and_ps(inside, x), yc = _mm_and_ps(inside, y);
+		const __m128i xi = _mm_cvttps_epi32(xc), yi = _mm_cvttps_epi32(yc);
+		const __m128 fx = _mm_sub_ps(xc, _mm_cvtepi32_ps(xi)), fy = _mm_sub_ps(yc, _mm_cvtepi32_ps(yi));
+		const __m128 w00 = _mm_mul_ps(_mm_sub_ps(one, fx), _mm_sub_ps(one, fy)), w01 = _mm_mul_ps(fx, _mm_sub_ps(one, fy));
+		const __m128 w10 = _mm_mul_ps(_mm_sub_ps(one, fx), fy), w11 = _mm_mul_ps(fx, fy);
+		int xs[4], ys[4], q[4];
+		_mm_storeu_si128((__m128i*)xs, xi);
+		_mm_storeu_si128((__m128i*)ys, yi);
+		for (int l = 0; l < 4; l++) q[l] = (ys[l]*W + xs[l])*3;
+
+		__m128 cur[3], warped[3];
+		deinterleave3_ps(curInput + pix*3, cur[0], cur[1], cur[2]);
+		__m128 d = _mm_setzero_ps();
+		for (int k = 0; k < 3; k++) {
+			__m128 v = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(w00, gather4_ps(prevInput, q, k)), _mm_mul_ps(w01, gather4_ps(prevInput, q, q01+k))),
+				_mm_mul_ps(w10, gather4_ps(prevInput, q, q10+k))), _mm_mul_ps(w11, gather4_ps(prevInput, q, q11+k)));
+			v = _mm_sub_ps(v, cur[k]);
+			d = k == 0 ? _mm_mul_ps(v, v) : _mm_add_ps(d, _mm_mul_ps(v, v));
+			warped[k] = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(w00, gather4_ps(prevSolution, q, k)), _mm_mul_ps(w01, gather4_ps(prevSolution, q, q01+k))),
+				_mm_mul_ps(w10, gather4_ps(prevSolution, q, q10+k))), _mm_mul_ps(w11, gather4_ps(prevSolution, q, q11+k)));
+			warped[k] = _mm_and_ps(inside, warped[k]);
+		}
+		const __m128 w = _mm_and_ps(inside, _mm_mul_ps(vlambda, fast_exp_neg_ps(_mm_mul_ps(d, vinv))));
+
+		__m128 temporal[3];
+		interleave3_ps(_mm_mul_ps(w, warped[0]), _mm_mul_ps(w, warped[1]), _mm_mul_ps(w, warped[2]), temporal[0], temporal[1], temporal[2]);
+		const float* c = curProcessed + pix*3;
+		float* r = rhs + (qoff+j)*3;
+		for (int m = 0; m < 3; m++) {
+			__m128 lap = _mm_sub_ps(_mm_mul_ps(four, _mm_loadu_ps(c + 4*m)), _mm_loadu_ps(c + 4*m - 3*W));
+			lap = _mm_sub_ps(_mm_sub_ps(_mm_sub_ps(lap, _mm_loadu_ps(c + 4*m + 3*W)), _mm_loadu_ps(c + 4*m - 3)), _mm_loadu_ps(c + 4*m + 3));
+			_mm_storeu_ps(r + 4*m, _mm_add_ps(lap, temporal[m]));
+		}
+		_mm_storeu_ps(diag + qoff+j, _mm_add_ps(four, w));
+	}
+	return j;
+}
+#endif
+
+// right-hand side and diagonal of the system of solve_frame, in a single pass. The bilinear footprint of the backward flow
+// is computed once per pixel and gives both the temporal weight (get_weight, on prevInput) and the warped previous solution.
+// Flows within 2 pixels of the border have a zero weight, so the footprint never needs clamping.
+// With a rectangle [x0,x1)x[y0,y1), only its rows are built, in rhs and diag of (x1-x0)*(y1-y0) pixels (tiled mode).
+// NC : values per pixel of the processed frame and the solutions, NI : of the inputs that give the weights (4:2:0 solve).
+// S : storage of rhs and diag (see gauss_seidel).
+template<typename T, int NC = 3, int NI = NC, typename S = T>
+void build_system(const T* prevInput, const T* curInput, const T* curProcessed, const T* prevSolution, const float* flow, int W, int H, double lambda_t, S* rhs, S* diag,
+	int x0 = 0, int y0 = 0, int x1 = -1, int y1 = -1) {
+
+	if (x1 < 0) x1 = W;
+	if (y1 < 0) y1 = H;
+	const int bw = x1 - x0;
+	const float inv_2s2 = 1.f/(2.f*0.05f*0.05f); // s = 0.05, as in get_weight
+	const float lambda = (float)lambda_t;
+	Scheduler::instance().parallel_for(y0, y1, [&](int i) {
+		// interior pixels [ja, jb) go through build_system_simd first
+		const int ja = std::max(x0, 1), jb = (i > 0 && i < H-1) ? std::min(x1, W-1) : ja;
+		for (int j = x0; j < x1; j++) {
+			if (j == ja && jb > ja) {
+				j = build_system_simd<T, NC, NI, S>(prevInput, curInput, curProcessed, prevSolution, flow, W, H, lambda, inv_2s2, i, ja, jb, rhs, diag, (i-y0)*bw - x0);
+				if (j >= x1) break;
+			}
+			const int pix = i*W+j, q = (i-y0)*bw + j-x0;
+			const float x = flow[pix*2], y = flow[pix*2+1];
+			float w = 0, warped[NC] = { 0 };
+			if (x > 2 && x < W-2 && y > 2 && y < H-2) {
+				const int xi = (int)x, yi = (int)y;
+				const float fx = x - xi, fy = y - yi;
+				const float w00 = (1.f-fx)*(1.f-fy), w01 = fx*(1.f-fy), w10 = (1.f-fx)*fy, w11 = fx*fy;
+				const int q00 = yi*W+xi, q01 = q00+1, q10 = q00+W, q11 = q10+1;
+				float d = 0;
+				for (int k = 0; k < NI; k++) {
+					float v = w00*prevInput[q00*NI+k] + w01*prevInput[q01*NI+k] + w10*prevInput[q10*NI+k] + w11*prevInput[q11*NI+k];
+					d += sqr(v - (float)curInput[pix*NI+k]);
+				}
+				w = lambda*fast_exp_neg(d*inv_2s2);
+				for (int k = 0; k < NC; k++)
+					warped[k] = w00*prevSolution[q00*NC+k] + w01*prevSolution[q01*NC+k] + w10*prevSolution[q10*NC+k] + w11*prevSolution[q11*NC+k];
+			}
+
+			int laplace = 4;
+			if (i == 0 || i == H - 1) laplace--;
+			if (j == 0 || j == W - 1) laplace--;
+			for (int k = 0; k < NC; k++) {
+				const int p = pix*NC+k;
+				const T up = i>0?curProcessed[p - NC*W]:0;
+				const T down = i<(H-1)?curProcessed[p + NC*W]:0;
+				const T left = j>0?curProcessed[p - NC]:0;
+				const T right = j<(W-1)?curProcessed[p + NC]:0;
+				rhs[q*NC+k] = store_value<S>(laplace*curProcessed[p] - up - down - left - right + w*warped[k]);
+			}
+			diag[q] = store_value<S>(laplace + w);
+		}
+	}, STAGE_SOLVE);
+}
+
+
+// copies the rectangle [x0,x1)x[y0,y1) of an interleaved image.
+template<typename T>
+void crop_interleaved(const T* src, int W, int x0, int y0, int x1, int y1, T* dst, int channels = 3) {
+	for (int i = y0; i < y1; i++)
+		memcpy(&dst[(i-y0)*(x1-x0)*channels], &src[(i*W+x0)*channels], (x1-x0)*channels*sizeof(T));
+}
+
+// PatchMatch on overlapping tiles (tiled mode) : each tile searches its core extended by the margin, so that only the
+// core and motions up to the margin are needed at once ; the flows of the cores are kept, in frame coordinates.
+template<typename T>
+void tiled_backward_flow(const T* prevInput, const T* curInput, float* optflowBackward, int W, int H, const SolverParams &params, unsigned int seed = 0) {
+	int core, margin;
+	tile_layout(params, core, margin);
+	unsigned int tile = 0;
+	for (int ty = 0; ty < H; ty += core) {
+		for (int tx = 0; tx < W; tx += core, tile++) {
+			const int x0 = std::max(0, tx-margin), y0 = std::max(0, ty-margin), x1 = std::min(W, tx+core+margin), y1 = std::min(H, ty+core+margin);
+			const int bw = x1-x0, bh = y1-y0;
+			std::vector<T> prevTile(bw*bh*3), curTile(bw*bh*3);
+			std::vector<float> flow(bw*bh*2);
+			crop_interleaved(prevInput, W, x0, y0, x1, y1, &prevTile[0]);
+			crop_interleaved(curInput, W, x0, y0, x1, y1, &curTile[0]);
+			opt_flow_patchmatch<T>(&curTile[0], &prevTile[0], bw, bh, &flow[0], params.flow_iters, 7, ALGO_CPU, rand_hash(seed, tile), params.flow_threads);
+			for (int i = ty; i < std::min(H, ty+core); i++) {
+				for (int j = tx; j < std::min(W, tx+core); j++) {
+					const int q = (i-y0)*bw + j-x0;
+					optflowBackward[(i*W+j)*2] = flow[q*2] + x0;
+					optflowBackward[(i*W+j)*2+1] = flow[q*2+1] + y0;
+				}
+			}
+		}
+	}
+}
+
+// backward flow (from curInput to prevInput) ; only depends on the inputs, so it can be computed ahead of the solve.
+// With params.scale < 1, the flow is computed and stored at reduced_size(). seed keys the random search (the frame index).
+template<typename T>
+void compute_backward_flow(const T* prevInput, const T* curInput, float* optflowBackward, int W, int H, const SolverParams &params = SolverParams(), unsigned int seed = 0) {
+	int Ws, Hs;
+	reduced_size(W, H, params, Ws, Hs);
+	if (Ws<W || Hs<H) {
+		std::vector<T> prevSmall(Ws*Hs*3), curSmall(Ws*Hs*3);
+		resize_interleaved(prevInput, W, H, &prevSmall[0], Ws, Hs, 2);
+		resize_interleaved(curInput, W, H, &curSmall[0], Ws, Hs, 2);
+		SolverParams full = params;
+		full.scale = 1.f;
+		compute_backward_flow(&prevSmall[0], &curSmall[0], optflowBackward, Ws, Hs, full, seed);
+		return;
+	}
+	if (use_tiles(W, H, params)) {
+		tiled_backward_flow(prevInput, curInput, optflowBackward, W, H, params, seed);
+		return;
+	}
+	opt_flow_patchmatch<T>(curInput, prevInput, W, H, optflowBackward, params.flow_iters, 7, ALGO_CPU, seed, params.flow_threads);
+}
+
+// solves the system restricted to the rectangle [x0,x1)x[y0,y1) : the pixels around it are held to their value in
+// curSolution, which also holds the initial guess. rhs and diag start at the first pixel of the rectangle, with rows of
+// 'stride' pixels.
+template<typename T>
+void solve_rect(T* curSolution, const T* curProcessed, int W, int H, int x0, int y0, int x1, int y1, const T* rhs, const T* diag, int stride, const SolverParams &params) {
+
+	const int bw = x1-x0, bh = y1-y0;
+	std::vector<T> sol(bw*bh*3), proc(bw*bh*3), b(bw*bh*3), d(bw*bh);
+	for (int i = 0; i < bh; i++) {
+		for (int j = 0; j < bw; j++) {
+			const int pix = (y0+i)*W + x0+j, q = i*bw+j, r = i*stride+j;
+			d[q] = diag[r];
+			for (int k = 0; k < 3; k++) {
+				const int p = pix*3+k;
+				sol[q*3+k] = curSolution[p];
+				proc[q*3+k] = curProcessed[p];
+				// neighbours outside the rectangle are fixed : they move to the right-hand side
+				T v = rhs[r*3+k];
+				if (i==0 && y0>0) v += curSolution[p-3*W];
+				if (i==bh-1 && y1<H) v += curSolution[p+3*W];
+				if (j==0 && x0>0) v += curSolution[p-3];
+				if (j==bw-1 && x1<W) v += curSolution[p+3];
+				b[q*3+k] = v;
+			}
+		}
+	}
+	int nlevels = params.nlevels;
+	while (nlevels > 0 && (std::min(bw, bh)>>nlevels) < 2) nlevels--;
+	multiscale_solver(&sol[0], &proc[0], bw, bh, &d[0], &b[0], nlevels, params.niter);
+	for (int i = 0; i < bh; i++)
+		memcpy(&curSolution[((y0+i)*W + x0)*3], &sol[i*bw*3], bw*3*sizeof(T));
+}
+
+// incremental solve for static areas (params.static_threshold > 0). A tile is static when its flow is the identity (within
+// half a pixel, except where it points to the zero weight border), its input did not change and the previous solution
+// already has the gradients of curProcessed (|Laplacian(curProcessed - prevSolution)| : the residual of the system at
+// prevSolution) ; static tiles keep prevSolution.
+// The other tiles, plus a one tile halo, are grouped into disjoint rectangles, each solved as a sub-system whose border
+// is held to the pixels around it. curSolution holds the initial guess. Returns false without solving when more than half
+// of the frame is active : the caller then solves the whole frame.
+template<typename T>
+bool solve_active_tiles(const T* prevInput, const T* curInput, const T* curProcessed, const T* prevSolution, const float* flow, int W, int H, const T* diag, const T* rhs, T* curSolution, const SolverParams &params) {
 
-		res_down.resize(3, Wdst, Hdst, 1, 3);  // 3: linear ; 2:moving average ; 5: bicubic		
-		processed_down.resize(3, Wdst, Hdst, 1, 3);
-		diag_down.resize(1, Wdst, Hdst, 1, 3);
-		rhs_down.resize(3, Wdst, Hdst, 1, 3);
+	const int tile = std::max(16, params.static_tile);
+	const int TW = (W+tile-1)/tile, TH = (H+tile-1)/tile;
+	const float thr = params.static_threshold;
+	std::vector<char> changed(TW*TH, 0);
+	Scheduler::instance().parallel_for(0, TH, [&](int ti) {
+		for (int tj = 0; tj < TW; tj++) {
+			bool c = false;
+			for (int i = ti*tile; i < std::min(H, (ti+1)*tile) && !c; i++) {
+				for (int j = tj*tile; j < std::min(W, (tj+1)*tile) && !c; j++) {
+					const int pix = i*W+j;
+					const float x = flow[pix*2], y = flow[pix*2+1];
+					if (x > 2 && x < W-2 && y > 2 && y < H-2 && (std::abs(x-j) > 0.5f || std::abs(y-i) > 0.5f)) c = true;
+					for (int k = 0; k < 3 && !c; k++) {
+						const int p = pix*3+k;
+						float r = 0; // Laplacian of curProcessed - prevSolution, with the boundary of build_system
+						int n = 0;
+						if (i>0) { r -= curProcessed[p-3*W] - prevSolution[p-3*W]; n++; }
+						if (i<H-1) { r -= curProcessed[p+3*W] - prevSolution[p+3*W]; n++; }
+						if (j>0) { r -= curProcessed[p-3] - prevSolution[p-3]; n++; }
+						if (j<W-1) { r -= curProcessed[p+3] - prevSolution[p+3]; n++; }
+						r += n*(curProcessed[p] - prevSolution[p]);
+						if (std::abs(curInput[p]-prevInput[p]) > thr || std::abs(r) > thr) c = true;
+					}
+				}
+			}
+			changed[ti*TW+tj] = c;
+		}
+	}, STAGE_SOLVE);
 
-		gauss_seidel(res_down.data(), processed_down.data(), diag_down.data(), rhs_down.data(), Wdst, Hdst, 50);
+	// active tiles : changed ones and their halo
+	std::vector<char> active(TW*TH, 0);
+	int nactive = 0;
+	for (int ti = 0; ti < TH; ti++) {
+		for (int tj = 0; tj < TW; tj++) {
+			for (int di = -1; di <= 1 && !active[ti*TW+tj]; di++)
+				for (int dj = -1; dj <= 1; dj++)
+					if (ti+di>=0 && ti+di<TH && tj+dj>=0 && tj+dj<TW && changed[(ti+di)*TW+tj+dj]) active[ti*TW+tj] = 1;
+			nactive += active[ti*TW+tj];
+		}
+	}
+	if (2*nactive > TW*TH) return false;
 
-		res_down.resize(3, W, H, 1, 3);
-		memcpy(result_init, res_down.data(), W*H*3*sizeof(T));
+	// bounding rectangles (in tiles) of the rows of active tiles, merged until no two of them touch
+	struct Rect { int x0, y0, x1, y1; };
+	std::vector<Rect> rects;
+	for (int ti = 0; ti < TH; ti++) {
+		for (int tj = 0; tj < TW; tj++) {
+			if (!active[ti*TW+tj]) continue;
+			Rect r = { tj, ti, tj+1, ti+1 };
+			while (tj+1 < TW && active[ti*TW+tj+1]) r.x1 = ++tj + 1;
+			rects.push_back(r);
+		}
+	}
+	for (bool merged = true; merged;) {
+		merged = false;
+		for (size_t a = 0; a < rects.size() && !merged; a++) {
+			for (size_t b = a+1; b < rects.size() && !merged; b++) {
+				Rect &ra = rects[a], &rb = rects[b];
+				if (ra.x0 <= rb.x1 && rb.x0 <= ra.x1 && ra.y0 <= rb.y1 && rb.y0 <= ra.y1) {
+					ra.x0 = std::min(ra.x0, rb.x0); ra.y0 = std::min(ra.y0, rb.y0);
+					ra.x1 = std::max(ra.x1, rb.x1); ra.y1 = std::max(ra.y1, rb.y1);
+					rects.erase(rects.begin()+b);
+					merged = true;
+				}
+			}
+		}
 	}
+
+	// static pixels keep the previous solution ; they are the border of the rectangles
+	std::vector<char> inside(TW*TH, 0);
+	for (size_t r = 0; r < rects.size(); r++)
+		for (int ti = rects[r].y0; ti < rects[r].y1; ti++)
+			for (int tj = rects[r].x0; tj < rects[r].x1; tj++) inside[ti*TW+tj] = 1;
+	Scheduler::instance().parallel_for(0, H, [&](int i) {
+		for (int j = 0; j < W; j++)
+			if (!inside[(i/tile)*TW+j/tile]) memcpy(&curSolution[(i*W+j)*3], &prevSolution[(i*W+j)*3], 3*sizeof(T));
+	}, STAGE_SOLVE);
+
+	for (size_t r = 0; r < rects.size(); r++) {
+		const int x0 = rects[r].x0*tile, y0 = rects[r].y0*tile, x1 = std::min(W, rects[r].x1*tile), y1 = std::min(H, rects[r].y1*tile);
+		solve_rect(curSolution, curProcessed, W, H, x0, y0, x1, y1, &rhs[(y0*W+x0)*3], &diag[y0*W+x0], W, params);
+	}
+	return true;
 }
 
+// tiled mode, for frames above params.tile_pixels : a coarse solve of the whole frame at a resolution that fits in a tile
+// gives the initial guess and the boundary conditions, then the tiles are solved in raster order, each on its core extended
+// by the margin, with the pixels around it held to the coarse solution or to the cores already solved. Only the cores
+// are kept. The system of a tile is built for the tile alone, so no full resolution right-hand side is allocated.
+template<typename T>
+void solve_tiled(const T* prevInput, const T* curInput, const T* curProcessed, const T* prevSolution, T* curSolution, int W, int H, double lambda_t, const float* flow, const SolverParams &params) {
+
+	// coarse solve ; the flow is subsampled and rescaled
+	const double f = std::min(1., sqrt((double)params.tile_pixels/((double)W*H)));
+	const int Wc = std::max(16, (int)(W*f)), Hc = std::max(16, (int)(H*f));
+	{
+		const int nc = Wc*Hc*3;
+		std::vector<T> prevIn(nc), curIn(nc), curProc(nc), prevSol(nc), sol(nc);
+		std::vector<float> flowc(Wc*Hc*2);
+		resize_interleaved(prevInput, W, H, &prevIn[0], Wc, Hc, 2);
+		resize_interleaved(curInput, W, H, &curIn[0], Wc, Hc, 2);
+		resize_interleaved(curProcessed, W, H, &curProc[0], Wc, Hc, 2);
+		resize_interleaved(prevSolution, W, H, &prevSol[0], Wc, Hc, 2);
+		const float sx = (float)Wc/W, sy = (float)Hc/H;
+		for (int i = 0; i < Hc; i++) {
+			for (int j = 0; j < Wc; j++) {
+				const int pix = std::min(H-1, (int)((i+0.5f)/sy))*W + std::min(W-1, (int)((j+0.5f)/sx));
+				flowc[(i*Wc+j)*2] = flow[pix*2]*sx;
+				flowc[(i*Wc+j)*2+1] = flow[pix*2+1]*sy;
+			}
+		}
+		std::vector<T> rhs(nc), diag(Wc*Hc);
+		build_system(&prevIn[0], &curIn[0], &curProc[0], &prevSol[0], &flowc[0], Wc, Hc, lambda_t*(double)W*H/((double)Wc*Hc), &rhs[0], &diag[0]);
+		sol = curProc;
+		multiscale_solver(&sol[0], &curProc[0], Wc, Hc, &diag[0], &rhs[0], params.nlevels, params.niter);
+		for (int i = 0; i < nc; i++) sol[i] -= curProc[i];
+		resize_interleaved(&sol[0], Wc, Hc, curSolution, W, H, 3);
+		for (int i = 0; i < W*H*3; i++) curSolution[i] += curProcessed[i];
+	}
 
+	int core, margin;
+	tile_layout(params, core, margin);
+	std::vector<T> sol;
+	for (int ty = 0; ty < H; ty += core) {
+		for (int tx = 0; tx < W; tx += core) {
+			const int x0 = std::max(0, tx-margin), y0 = std::max(0, ty-margin), x1 = std::min(W, tx+core+margin), y1 = std::min(H, ty+core+margin);
+			const int bw = x1-x0, bh = y1-y0;
+			std::vector<T> rhs(bw*bh*3), diag(bw*bh);
+			{
+				ProfileTimer rhs_timer(PROF_RHS);
+				build_system(prevInput, curInput, curProcessed, prevSolution, flow, W, H, lambda_t, &rhs[0], &diag[0], x0, y0, x1, y1);
+			}
+			// the margins are solved too, but only the core is kept : the next tiles see the coarse solution there
+			sol.resize(bw*bh*3);
+			crop_interleaved(curSolution, W, x0, y0, x1, y1, &sol[0]);
+			solve_rect(curSolution, curProcessed, W, H, x0, y0, x1, y1, &rhs[0], &diag[0], bw, params);
+			for (int i = y0; i < y1; i++) {
+				for (int j = x0; j < x1; j++) {
+					if (i >= ty && i < ty+core && j >= tx && j < tx+core) continue;
+					memcpy(&curSolution[(i*W+j)*3], &sol[((i-y0)*bw + j-x0)*3], 3*sizeof(T));
+				}
+			}
+		}
+	}
+}
+
+// builds and solves the system of one solution with rhs and diag stored as S (params.storage) : float16 halves their
+// memory traffic in the Jacobi sweeps, which are bandwidth-bound.
+template<typename T, typename S>
+void solve_system(const T* prevInput, const T* curInput, const T* curProcessed, const T* prevSolution, T* curSolution, int W, int H, double lambda_t, const float* flow, const SolverParams &params) {
+	std::vector<S> rhs(W*H*3), diag(W*H);
+	{
+		ProfileTimer rhs_timer(PROF_RHS);
+		build_system<T, 3, 3, S>(prevInput, curInput, curProcessed, prevSolution, flow, W, H, lambda_t, &rhs[0], &diag[0]);
+	}
+	multiscale_solver<T, 3, S>(curSolution, curProcessed, W, H, &diag[0], &rhs[0], params.nlevels, params.niter);
+}
 
+// solves the frame for several temporal weights at once (multi-lambda sweeps) : solution s regularizes curProcessed against
+// prevSolutions[s] with lambda_t[s]. The flow and the temporal weights are shared, the solves run in parallel.
+// if precomputedFlow is NULL, the backward flow is computed here, with the random numbers of 'seed' (the frame index).
 template<typename T>
-void solve_frame(const T* prevInput, const T* curInput, const T* curProcessed, const T* prevSolution, T* curSolution, int W, int H, double lambda_t, bool isFirstFrame) {
+void solve_frames(const T* prevInput, const T* curInput, const T* curProcessed, const T* const* prevSolutions, T* const* curSolutions, int W, int H, const double* lambda_t, int nsolutions, bool isFirstFrame, const float* precomputedFlow = NULL, const SolverParams &params = SolverParams(), unsigned int seed = 0) {
 
 	if (isFirstFrame) {
-		memcpy(curSolution, curProcessed, W*H*3*sizeof(T));
+		for (int s = 0; s < nsolutions; s++) memcpy(curSolutions[s], curProcessed, W*H*3*sizeof(T));
+		return;
+	}
+
+	std::vector<float> flowStorage;
+	const float* optflowBackward = precomputedFlow;
+	if (!optflowBackward) {
+		int Ws, Hs;
+		reduced_size(W, H, params, Ws, Hs);
+		flowStorage.resize(Ws*Hs*2);
+		compute_backward_flow<T>(prevInput, curInput, &flowStorage[0], W, H, params, seed);
+		optflowBackward = &flowStorage[0];
+	}
+
+	// reduced resolution : solve on downscaled frames, then add the upsampled corrections to the processed frame
+	int Ws, Hs;
+	reduced_size(W, H, params, Ws, Hs);
+	if (Ws<W || Hs<H) {
+		const int ns = Ws*Hs*3;
+		std::vector<T> prevIn(ns), curIn(ns), curProc(ns), correction(W*H*3);
+		std::vector<std::vector<T> > prevSol(nsolutions, std::vector<T>(ns)), sol(nsolutions, std::vector<T>(ns));
+		std::vector<const T*> prevSolPtr(nsolutions);
+		std::vector<T*> solPtr(nsolutions);
+		std::vector<double> lambdas(nsolutions);
+		resize_interleaved(prevInput, W, H, &prevIn[0], Ws, Hs, 2);
+		resize_interleaved(curInput, W, H, &curIn[0], Ws, Hs, 2);
+		resize_interleaved(curProcessed, W, H, &curProc[0], Ws, Hs, 2);
+		for (int s = 0; s < nsolutions; s++) {
+			resize_interleaved(prevSolutions[s], W, H, &prevSol[s][0], Ws, Hs, 2);
+			sol[s] = curProc;
+			prevSolPtr[s] = &prevSol[s][0];
+			solPtr[s] = &sol[s][0];
+			// the gradient term does not change with the resolution, the temporal one is a sum over pixels : lambda keeps their balance
+			lambdas[s] = lambda_t[s]*(double)W*H/((double)Ws*Hs);
+		}
+		SolverParams full = params;
+		full.scale = 1.f;
+		solve_frames(&prevIn[0], &curIn[0], &curProc[0], &prevSolPtr[0], &solPtr[0], Ws, Hs, &lambdas[0], nsolutions, false, optflowBackward, full);
+		for (int s = 0; s < nsolutions; s++) {
+			for (int i = 0; i < ns; i++) sol[s][i] -= curProc[i];
+			resize_interleaved(&sol[s][0], Ws, Hs, &correction[0], W, H, 3);
+			if (params.guided_radius > 0) guided_filter(curInput, &correction[0], W, H, params.guided_radius, 1e-3f);
+			for (int i = 0; i < W*H*3; i++) curSolutions[s][i] = curProcessed[i] + correction[i];
+		}
+		return;
+	}
+
+	if (use_tiles(W, H, params)) {
+		for (int s = 0; s < nsolutions; s++)
+			solve_tiled(prevInput, curInput, curProcessed, prevSolutions[s], curSolutions[s], W, H, lambda_t[s], optflowBackward, params);
+		return;
+	}
+
+	// half precision systems, solved one per task (the static tiles and build_systems need float ones)
+	const int frame = Profiler::current_frame();
+	if (params.storage==STORAGE_HALF) {
+		Scheduler::instance().parallel_for(0, nsolutions, [&](int s) {
+			ProfileFrame profile_frame(frame);
+			solve_system<T, float16>(prevInput, curInput, curProcessed, prevSolutions[s], curSolutions[s], W, H, lambda_t[s], optflowBackward, params);
+		}, STAGE_SOLVE, 1);
 		return;
 	}
 
-	std::vector<float> optflowBackward(W*H*2);	
-	opt_flow_patchmatch<T>(curInput, prevInput, W, H, &optflowBackward[0]);
-	
 	//build RHS and weights
-	std::vector<T> rhs(W*H*3, 0.);
-	std::vector<T> diag(W*H, 0.);
-#pragma omp parallel for
-	for (int i = 0; i < H; i++) {
+	std::vector<std::vector<T> > rhs(nsolutions, std::vector<T>(W*H*3)), diag(nsolutions, std::vector<T>(W*H));
+	std::vector<T*> rhsPtr(nsolutions), diagPtr(nsolutions);
+	for (int s = 0; s < nsolutions; s++) {
+		rhsPtr[s] = &rhs[s][0];
+		diagPtr[s] = &diag[s][0];
+	}
+	ProfileTimer rhs_timer(PROF_RHS);
+	if (nsolutions==1) build_system(prevInput, curInput, curProcessed, prevSolutions[0], optflowBackward, W, H, lambda_t[0], rhsPtr[0], diagPtr[0]);
+	else build_systems(prevInput, curInput, curProcessed, prevSolutions, optflowBackward, W, H, lambda_t, nsolutions, &rhsPtr[0], &diagPtr[0]);
+	rhs_timer.stop();
+
+	auto solve = [&](int s) {
+		if (params.static_threshold > 0 && solve_active_tiles(prevInput, curInput, curProcessed, prevSolutions[s], optflowBackward, W, H, &diag[s][0], &rhs[s][0], curSolutions[s], params)) return;
+		multiscale_solver(curSolutions[s], curProcessed, W, H, &diag[s][0], &rhs[s][0], params.nlevels, params.niter);
+	};
+	if (nsolutions==1) {
+		solve(0);
+		return;
+	}
+	// the solves are independent ; each one also splits its Jacobi sweeps on the scheduler
+	Scheduler::instance().parallel_for(0, nsolutions, [&](int s) {
+		ProfileFrame profile_frame(frame);
+		solve(s);
+	}, STAGE_SOLVE, 1);
+}
+
+// if precomputedFlow is NULL, the backward flow is computed here, with the random numbers of 'seed' (the frame index).
+template<typename T>
+void solve_frame(const T* prevInput, const T* curInput, const T* curProcessed, const T* prevSolution, T* curSolution, int W, int H, double lambda_t, bool isFirstFrame, const float* precomputedFlow = NULL, const SolverParams &params = SolverParams(), unsigned int seed = 0) {
+	solve_frames(prevInput, curInput, curProcessed, &prevSolution, &curSolution, W, H, &lambda_t, 1, isFirstFrame, precomputedFlow, params, seed);
+}
+
+
+// the system of solve_window : per frame and pixel, the temporal weight (lambda included, 0 : no link) and the
+// bilinear footprint of the flow in the frame before, the transposed footprints (for each pixel, the pixels of the next
+// frame that read it, with their coefficient) and the diagonal of the system, which preconditions the solve.
+struct WindowSystem {
+	int W, H, K;
+	std::vector<float> weight, coef, diag; // K*W*H, K*W*H*4, K*W*H
+	std::vector<int> foot;                 // K*W*H : top left pixel of the footprint
+	std::vector<std::vector<int> > start, readers; // frames 1..K-1 : readers[f][start[f][p]..start[f][p+1]) read pixel p of frame f-1
+	std::vector<std::vector<float> > reader_coef;
+};
+
+// from the temporal weights of the K frames (zero where the flow is close to the border, see build_system) and their flows.
+inline void build_window_system(const float* weight, const float* const* flows, int K, int W, int H, WindowSystem &sys) {
+	const int N = W*H;
+	sys.W = W; sys.H = H; sys.K = K;
+	sys.weight.resize((size_t)K*N); sys.coef.resize((size_t)K*N*4); sys.diag.resize((size_t)K*N); sys.foot.resize((size_t)K*N);
+	sys.start.assign(K, std::vector<int>()); sys.readers.assign(K, std::vector<int>()); sys.reader_coef.assign(K, std::vector<float>());
+	Scheduler::instance().parallel_for(0, K, [&](int f) {
+		const float* fl = flows[f];
+		const float* w = weight + (size_t)f*N;
+		std::vector<int> count(f>0 ? N+1 : 0, 0);
+		for (int p = 0; p < N; p++) {
+			const size_t q = (size_t)f*N + p;
+			const float x = fl[p*2], y = fl[p*2+1];
+			float* c = &sys.coef[q*4];
+			if (w[p] > 0) {
+				const int xi = (int)x, yi = (int)y;
+				const float fx = x - xi, fy = y - yi;
+				c[0] = (1.f-fx)*(1.f-fy); c[1] = fx*(1.f-fy); c[2] = (1.f-fx)*fy; c[3] = fx*fy;
+				sys.foot[q] = yi*W+xi;
+				sys.weight[q] = w[p];
+				if (f>0) { count[sys.foot[q]+1]++; count[sys.foot[q]+2]++; count[sys.foot[q]+W+1]++; count[sys.foot[q]+W+2]++; }
+			} else {
+				c[0] = c[1] = c[2] = c[3] = 0;
+				sys.foot[q] = 0;
+				sys.weight[q] = 0;
+			}
+		}
+		if (f==0) return;
+		for (int p = 0; p < N; p++) count[p+1] += count[p];
+		std::vector<int> &readers = sys.readers[f];
+		std::vector<float> &reader_coef = sys.reader_coef[f];
+		readers.resize(count[N]);
+		reader_coef.resize(count[N]);
+		sys.start[f] = count;
+		for (int p = 0; p < N; p++) {
+			const size_t q = (size_t)f*N + p;
+			if (sys.weight[q]==0) continue;
+			const int taps[4] = { sys.foot[q], sys.foot[q]+1, sys.foot[q]+W, sys.foot[q]+W+1 };
+			for (int k = 0; k < 4; k++) {
+				readers[count[taps[k]]] = p;
+				reader_coef[count[taps[k]]++] = sys.coef[q*4+k];
+			}
+		}
+	}, STAGE_SOLVE, 1);
+
+	Scheduler::instance().parallel_for(0, K*H, [&](int t) {
+		const int f = t/H, i = t%H;
 		for (int j = 0; j < W; j++) {
-			double w = lambda_t * get_weight(curInput, prevInput, W, H, &optflowBackward[0], i*W+j);
+			const int p = i*W+j;
 			int laplace = 4;
 			if (i == 0 || i == H - 1) laplace--;
 			if (j == 0 || j == W - 1) laplace--;
+			float d = laplace + sys.weight[(size_t)f*N + p];
+			if (f < K-1) {
+				const std::vector<int> &start = sys.start[f+1];
+				for (int r = start[p]; r < start[p+1]; r++) d += sqr(sys.reader_coef[f+1][r])*sys.weight[(size_t)(f+1)*N + sys.readers[f+1][r]];
+			}
+			sys.diag[(size_t)f*N + p] = d;
+		}
+	}, STAGE_SOLVE);
+}
 
-			int pix = i*W+j;
+// y = A x for the system of a window (3 values per pixel) ; 'link' is a temporary of the size of x.
+// A x = Laplacian(x_f) + weight_f*(x_f - warp(x_{f-1})) - adjoint warp of weight_{f+1}*(x_{f+1} - warp(x_f)), frame by
+// frame (x_{-1}, the anchor, is fixed : its term is in the right-hand side). Also returns the row sums of x.y in 'dots'.
+template<typename T>
+void window_apply(const WindowSystem &sys, const T* x, T* y, T* link, double* dots) {
+	const int W = sys.W, H = sys.H, N = W*H, K = sys.K;
+	Scheduler &sched = Scheduler::instance();
+	sched.parallel_for(0, K*H, [&](int t) {
+		const int f = t/H, i = t%H;
+		const T* prev = f>0 ? x + (size_t)(f-1)*N*3 : x;
+		for (int j = 0; j < W; j++) {
+			const size_t q = (size_t)f*N + i*W+j;
+			const float w = sys.weight[q];
+			if (w==0) {
+				link[q*3] = link[q*3+1] = link[q*3+2] = 0;
+				continue;
+			}
+			const float* c = &sys.coef[q*4];
+			const int q00 = sys.foot[q], q01 = q00+1, q10 = q00+W, q11 = q10+1;
 			for (int k = 0; k < 3; k++) {
-				int p = pix*3+k;
-				const T upProcessed = i>0?curProcessed[p - 3*W]:0.;
-				const T downProcessed = i<(H-1)?curProcessed[p + 3*W]:0.;
-				const T leftProcessed = j>0?curProcessed[p - 3]:0.;
-				const T rightProcessed = j<(W-1)?curProcessed[p + 3]:0.;
-				const T backward_color = bilinear(&prevSolution[k], W, H, optflowBackward[pix * 2], optflowBackward[pix * 2 + 1], 3);
-				rhs[p] = laplace*curProcessed[p] - upProcessed - downProcessed - leftProcessed - rightProcessed  + w * backward_color;
+				const float warped = f>0 ? c[0]*prev[q00*3+k] + c[1]*prev[q01*3+k] + c[2]*prev[q10*3+k] + c[3]*prev[q11*3+k] : 0.f;
+				link[q*3+k] = (T)(w*(x[q*3+k] - warped));
 			}
-			diag[i*W+j] = laplace + w;
 		}
+	}, STAGE_SOLVE);
+	sched.parallel_for(0, K*H, [&](int t) {
+		const int f = t/H, i = t%H;
+		const T* next = link + ((size_t)f+1)*N*3;
+		double dot = 0;
+		for (int j = 0; j < W; j++) {
+			const int p = i*W+j;
+			const size_t q = (size_t)f*N + p;
+			int laplace = 4;
+			if (i == 0 || i == H - 1) laplace--;
+			if (j == 0 || j == W - 1) laplace--;
+			float adjoint[3] = { 0, 0, 0 };
+			if (f < K-1) {
+				const std::vector<int> &start = sys.start[f+1];
+				for (int r = start[p]; r < start[p+1]; r++) {
+					const float c = sys.reader_coef[f+1][r];
+					const int s = sys.readers[f+1][r];
+					for (int k = 0; k < 3; k++) adjoint[k] += c*next[s*3+k];
+				}
+			}
+			for (int k = 0; k < 3; k++) {
+				const size_t v = q*3+k;
+				const T up = i>0?x[v - 3*W]:0;
+				const T down = i<(H-1)?x[v + 3*W]:0;
+				const T left = j>0?x[v - 3]:0;
+				const T right = j<(W-1)?x[v + 3]:0;
+				y[v] = (T)(laplace*x[v] - up - down - left - right + link[v] - adjoint[k]);
+				dot += (double)x[v]*y[v];
+			}
+		}
+		dots[t] = dot;
+	}, STAGE_SOLVE);
+}
+
+// preconditioned conjugate gradients on the system of a window, from the initial guess in x : at most niter iterations,
+// until the preconditioned residual norm falls below tol times the initial one. The final ratio goes to the profiler.
+template<typename T>
+void window_pcg(const WindowSystem &sys, const T* b, T* x, int niter, double tol) {
+	const int H = sys.H, N = sys.W*sys.H, rows = sys.K*H;
+	const size_t n = (size_t)sys.K*N*3;
+	std::vector<T> r(n), z(n), p(n), q(n), link(n);
+	std::vector<double> dots(rows);
+	Scheduler &sched = Scheduler::instance();
+	auto sum = [&]() { double s = 0; for (int t = 0; t < rows; t++) s += dots[t]; return s; };
+
+	window_apply(sys, x, &q[0], &link[0], &dots[0]);
+	sched.parallel_for(0, rows, [&](int t) {
+		double dot = 0;
+		for (size_t v = (size_t)t*sys.W*3; v < (size_t)(t+1)*sys.W*3; v++) {
+			r[v] = b[v] - q[v];
+			z[v] = p[v] = r[v]/sys.diag[v/3];
+			dot += (double)r[v]*z[v];
+		}
+		dots[t] = dot;
+	}, STAGE_SOLVE);
+	double rz = sum();
+	const double rz0 = rz;
+
+	int iter = 0;
+	const double stop = std::max(1e-14, tol*tol)*rz0; // rz is the squared norm
+	for (; iter < niter && rz > stop; iter++) {
+		window_apply(sys, &p[0], &q[0], &link[0], &dots[0]);
+		const double pq = sum();
+		if (pq <= 0) break;
+		const double alpha = rz/pq;
+		sched.parallel_for(0, rows, [&](int t) {
+			double dot = 0;
+			for (size_t v = (size_t)t*sys.W*3; v < (size_t)(t+1)*sys.W*3; v++) {
+				x[v] += (T)(alpha*p[v]);
+				r[v] -= (T)(alpha*q[v]);
+				z[v] = r[v]/sys.diag[v/3];
+				dot += (double)r[v]*z[v];
+			}
+			dots[t] = dot;
+		}, STAGE_SOLVE);
+		const double rz_next = sum(), beta = rz_next/rz;
+		rz = rz_next;
+		sched.parallel_for(0, rows, [&](int t) {
+			for (size_t v = (size_t)t*sys.W*3; v < (size_t)(t+1)*sys.W*3; v++) p[v] = z[v] + (T)(beta*p[v]);
+		}, STAGE_SOLVE);
+	}
+	Profiler::instance().add_count(PROF_SOLVER_SWEEPS, iter);
+	Profiler::instance().add_count(PROF_SOLVER_PIXELS, (long long)iter*sys.K*N);
+	Profiler::instance().add_count(PROF_WINDOW_SOLVES, 1);
+	Profiler::instance().add_count(PROF_WINDOW_RESIDUAL_PPM, rz0 > 0 ? (long long)(1e6*sqrt(std::max(0., rz)/rz0) + 0.5) : 0);
+}
+
+// sliding window mode : solves K consecutive frames jointly instead of one after the other. Frame f of the window is
+// regularized against frame f-1 through flows[f] (its backward flow), frame 0 against the fixed anchor (the last solution
+// before the window). Unlike the recurrence, a frame also sees the frames after it, and each solve has K frames of
+// parallel work. The space-time system is solved at full resolution by conjugate gradients preconditioned by its
+// diagonal (at most params.window_iters iterations, see window_pcg), from the initial guess in solutions[f] : the processed
+// frames, or the previous window's solution for the frames it overlaps. The solution stays close to that guess : on a
+// 640x360 clip, windows of 4, 15 iterations leave about 1% of the initial residual (30 : 0.1%) and the output stays
+// within 62 dB (luma PSNR) of the converged solve ; --profile-summary reports window_residual_ppm. The pyramid of multiscale_solver would not help : its coarse levels reuse the full resolution
+// right-hand side, and a window, held by the anchor alone, amplifies that error.
+// params.scale, the tiled mode, the static tiles and params.storage are not used.
+template<typename T>
+void solve_window(const T* anchorInput, const T* anchorSolution, const T* const* inputs, const T* const* processed, const float* const* flows, T* const* solutions, int K, int W, int H, double lambda_t, const SolverParams &params) {
+
+	const int N = W*H;
+	std::vector<float> weight((size_t)K*N);
+	std::vector<T> rhs((size_t)K*N*3);
+	{
+		ProfileTimer rhs_timer(PROF_RHS);
+		const float inv_2s2 = 1.f/(2.f*0.05f*0.05f); // s = 0.05, as in get_weight
+		Scheduler::instance().parallel_for(0, K*H, [&](int t) {
+			const int f = t/H, i = t%H;
+			const T* prevInput = f>0 ? inputs[f-1] : anchorInput;
+			const T* curInput = inputs[f];
+			const T* curProcessed = processed[f];
+			const float* flow = flows[f];
+			for (int j = 0; j < W; j++) {
+				const int pix = i*W+j;
+				const float x = flow[pix*2], y = flow[pix*2+1];
+				float w = 0, warped[3] = { 0, 0, 0 };
+				if (x > 2 && x < W-2 && y > 2 && y < H-2) {
+					const int xi = (int)x, yi = (int)y;
+					const float fx = x - xi, fy = y - yi;
+					const float w00 = (1.f-fx)*(1.f-fy), w01 = fx*(1.f-fy), w10 = (1.f-fx)*fy, w11 = fx*fy;
+					const int q00 = (yi*W+xi)*3, q01 = q00+3, q10 = q00+3*W, q11 = q10+3;
+					float d = 0;
+					for (int k = 0; k < 3; k++) {
+						float v = w00*prevInput[q00+k] + w01*prevInput[q01+k] + w10*prevInput[q10+k] + w11*prevInput[q11+k];
+						d += sqr(v - (float)curInput[pix*3+k]);
+					}
+					w = (float)lambda_t*fast_exp_neg(d*inv_2s2);
+					if (f==0) {
+						for (int k = 0; k < 3; k++)
+							warped[k] = w00*anchorSolution[q00+k] + w01*anchorSolution[q01+k] + w10*anchorSolution[q10+k] + w11*anchorSolution[q11+k];
+					}
+				}
+				weight[(size_t)f*N + pix] = w;
+
+				int laplace = 4;
+				if (i == 0 || i == H - 1) laplace--;
+				if (j == 0 || j == W - 1) laplace--;
+				for (int k = 0; k < 3; k++) {
+					const int p = pix*3+k;
+					const T up = i>0?curProcessed[p - 3*W]:0;
+					const T down = i<(H-1)?curProcessed[p + 3*W]:0;
+					const T left = j>0?curProcessed[p - 3]:0;
+					const T right = j<(W-1)?curProcessed[p + 3]:0;
+					rhs[(size_t)f*N*3 + p] = laplace*curProcessed[p] - up - down - left - right + w*warped[k];
+				}
+			}
+		}, STAGE_SOLVE);
 	}
 
-	multiscale_solver(curSolution, curProcessed, W, H, &diag[0], &rhs[0]);
+	ProfileTimer timer(PROF_SOLVE_LEVEL0);
+	WindowSystem system;
+	build_window_system(&weight[0], flows, K, W, H, system);
+	std::vector<T> x((size_t)K*N*3);
+	for (int f = 0; f < K; f++) memcpy(&x[(size_t)f*N*3], solutions[f], N*3*sizeof(T));
+	window_pcg(system, &rhs[0], &x[0], params.window_iters, params.window_tol);
+	for (int f = 0; f < K; f++) memcpy(solutions[f], &x[(size_t)f*N*3], N*3*sizeof(T));
+}
+
+
+// 4:2:0 solve : frames in the planar 4:2:0 layout of YUVIO.h (W*H luma values, then Cb and Cr interleaved at
+// (W+1)/2 x (H+1)/2). Luma is solved at full resolution and chroma at quarter area, with no colour conversion.
+// The flow and the weights use 3 channel guides : (Y, Cb, Cr) with the chroma replicated at full resolution, and
+// (2x2 mean of Y, Cb, Cr) at chroma resolution ; either can be NULL.
+template<typename T>
+void yuv420_guides(const T* frame, int W, int H, T* full, T* half) {
+	const int Wc = (W+1)/2, Hc = (H+1)/2;
+	const T* chroma = frame + W*H;
+	if (full) {
+		Scheduler::instance().parallel_for(0, H, [&](int i) {
+			for (int j = 0; j < W; j++) {
+				const int c = ((i/2)*Wc + j/2)*2;
+				full[(i*W+j)*3] = frame[i*W+j];
+				full[(i*W+j)*3+1] = chroma[c];
+				full[(i*W+j)*3+2] = chroma[c+1];
+			}
+		}, STAGE_SOLVE);
+	}
+	if (half) {
+		Scheduler::instance().parallel_for(0, Hc, [&](int i) {
+			const int r0 = 2*i, r1 = std::min(2*i+1, H-1);
+			for (int j = 0; j < Wc; j++) {
+				const int c0 = 2*j, c1 = std::min(2*j+1, W-1);
+				const int p = i*Wc+j;
+				half[p*3] = (T)(0.25f*(frame[r0*W+c0] + frame[r0*W+c1] + frame[r1*W+c0] + frame[r1*W+c1]));
+				half[p*3+1] = chroma[p*2];
+				half[p*3+2] = chroma[p*2+1];
+			}
+		}, STAGE_SOLVE);
+	}
+}
+
+// backward flow of the 4:2:0 solve, at full resolution (params.scale and the tiled mode are not used).
+template<typename T>
+void compute_backward_flow_420(const T* prevInput, const T* curInput, float* optflowBackward, int W, int H, const SolverParams &params = SolverParams(), unsigned int seed = 0) {
+	std::vector<T> prevGuide(W*H*3), curGuide(W*H*3);
+	yuv420_guides<T>(prevInput, W, H, &prevGuide[0], NULL);
+	yuv420_guides<T>(curInput, W, H, &curGuide[0], NULL);
+	opt_flow_patchmatch<T>(&curGuide[0], &prevGuide[0], W, H, optflowBackward, params.flow_iters, 7, ALGO_CPU, seed, params.flow_threads);
+}
+
+// builds and solves one plane of solve_frames_420 (NC values per pixel), with rhs and diag stored as S.
+template<typename T, int NC, typename S>
+void solve_plane_420(const T* prevGuide, const T* curGuide, const T* curProcessed, const T* prevSolution, T* curSolution, const float* flow, int W, int H, double lambda_t, int nlevels, int niter) {
+	std::vector<S> rhs(W*H*NC), diag(W*H);
+	{
+		ProfileTimer rhs_timer(PROF_RHS);
+		build_system<T, NC, 3, S>(prevGuide, curGuide, curProcessed, prevSolution, flow, W, H, lambda_t, &rhs[0], &diag[0]);
+	}
+	multiscale_solver<T, NC, S>(curSolution, curProcessed, W, H, &diag[0], &rhs[0], nlevels, niter);
 }
 
+// solve_frames on 4:2:0 frames. The chroma flow is the mean of the luma flows of each 2x2 block, in chroma coordinates
+// (centered siting) ; as for params.scale, lambda is scaled by the ratio of the pixel counts. The luma and chroma
+// systems of all the solutions are solved in parallel. params.scale, the tiled mode and the static tiles are not used.
+template<typename T>
+void solve_frames_420(const T* prevInput, const T* curInput, const T* curProcessed, const T* const* prevSolutions, T* const* curSolutions, int W, int H, const double* lambda_t, int nsolutions, bool isFirstFrame, const float* precomputedFlow = NULL, const SolverParams &params = SolverParams(), unsigned int seed = 0) {
+
+	const int Wc = (W+1)/2, Hc = (H+1)/2, luma = W*H;
+	if (isFirstFrame) {
+		for (int s = 0; s < nsolutions; s++) memcpy(curSolutions[s], curProcessed, (luma + Wc*Hc*2)*sizeof(T));
+		return;
+	}
+
+	std::vector<float> flowStorage;
+	const float* flow = precomputedFlow;
+	if (!flow) {
+		flowStorage.resize(W*H*2);
+		compute_backward_flow_420<T>(prevInput, curInput, &flowStorage[0], W, H, params, seed);
+		flow = &flowStorage[0];
+	}
+
+	std::vector<T> prevFull(W*H*3), curFull(W*H*3), prevHalf(Wc*Hc*3), curHalf(Wc*Hc*3);
+	std::vector<float> flowHalf(Wc*Hc*2);
+	yuv420_guides<T>(prevInput, W, H, &prevFull[0], &prevHalf[0]);
+	yuv420_guides<T>(curInput, W, H, &curFull[0], &curHalf[0]);
+	Scheduler::instance().parallel_for(0, Hc, [&](int i) {
+		const int r0 = 2*i, r1 = std::min(2*i+1, H-1);
+		for (int j = 0; j < Wc; j++) {
+			const int c0 = 2*j, c1 = std::min(2*j+1, W-1);
+			for (int k = 0; k < 2; k++) {
+				const float x = 0.25f*(flow[(r0*W+c0)*2+k] + flow[(r0*W+c1)*2+k] + flow[(r1*W+c0)*2+k] + flow[(r1*W+c1)*2+k]);
+				flowHalf[(i*Wc+j)*2+k] = (x - 0.5f)*0.5f;
+			}
+		}
+	}, STAGE_SOLVE);
+
+	// task 2s : luma of solution s, 2s+1 : its chroma ; the chroma pyramid stops one level earlier, at the same coarsest size
+	const int frame = Profiler::current_frame();
+	Scheduler::instance().parallel_for(0, 2*nsolutions, [&](int t) {
+		ProfileFrame profile_frame(frame);
+		const int s = t/2;
+		const bool stored = params.storage==STORAGE_HALF;
+		if (t%2 == 0) {
+			if (stored) solve_plane_420<T, 1, float16>(&prevFull[0], &curFull[0], curProcessed, prevSolutions[s], curSolutions[s], flow, W, H, lambda_t[s], params.nlevels, params.niter);
+			else solve_plane_420<T, 1, T>(&prevFull[0], &curFull[0], curProcessed, prevSolutions[s], curSolutions[s], flow, W, H, lambda_t[s], params.nlevels, params.niter);
+		} else {
+			const double lambda = lambda_t[s]*(double)W*H/((double)Wc*Hc);
+			const int nlevels = std::max(0, params.nlevels-1);
+			if (stored) solve_plane_420<T, 2, float16>(&prevHalf[0], &curHalf[0], curProcessed + luma, prevSolutions[s] + luma, curSolutions[s] + luma, &flowHalf[0], Wc, Hc, lambda, nlevels, params.niter);
+			else solve_plane_420<T, 2, T>(&prevHalf[0], &curHalf[0], curProcessed + luma, prevSolutions[s] + luma, curSolutions[s] + luma, &flowHalf[0], Wc, Hc, lambda, nlevels, params.niter);
+		}
+	}, STAGE_SOLVE, 1);
+}
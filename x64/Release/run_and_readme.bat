@@ -1,8 +1,30 @@
 REM usage: stabilize.exe input_video per_frame_processed_video temporal_weight output_file max_frames width height
-REM input_video, per_frame_processed_video and output_file can be image sequences (put the first file ; files should be numbered), MPEG/AVI files (or anything supported by ffmpeg), or YUV files
+REM input_video, per_frame_processed_video and output_file can be image sequences (put the first file ; files should be numbered), MPEG/AVI files (or anything supported by ffmpeg), or YUV / Y4M files
 REM temporal weight around 1.0
 REM max_frames is the  max number of frames to process (use any large number to process the whole video)
 REM width and height are optional for images/mpeg files. For YUV files, mandatory and indicates the frame width/height.
+REM .y4m (YUV4MPEG2) files carry their own frame size, so width and height can be omitted for them too.
+REM options go after the positional arguments: --yuv-bitdepth 10 writes 10 bit yuv/y4m output, --direct-io 1 bypasses the OS cache when writing yuv/y4m (Linux).
+REM image sequences can also be given as a printf-style pattern (frame_%%05d.png) ; --prefetch N decodes the next N images in parallel (default 8).
+REM image outputs are encoded in the background, with at most --write-queue frames pending (default 8) ; --write-threads N queues the encoding tasks on N of the scheduler threads first. PNG speed/size: --png-level 0..9 and --png-filter 0..5 (0 none ... 4 paeth, 5 mixed). JPEG: --jpeg-quality 1..31. .pfm outputs keep float precision.
+REM video outputs are encoded on a background thread: --codec libx264 (default mpeg2video), --enc-threads N (default: the --threads budget), --enc-slices N, --preset veryfast, --crf 18, --lookahead N, --enc-queue N (frames buffered for the encoder).
+REM --threads N sets the global thread budget (default: all cores) shared by decoding, flow, solving and encoding tasks. PatchMatch keeps its own OpenMP teams : while a flow runs, its team's threads are reserved from the budget (scheduler workers wait), so flows and tasks together stay within N. --sched-stats 1 prints the per-stage task counts and busy times at the end.
+REM --flow-lookahead K computes the optical flows of the next K frames as scheduler tasks while the current frame is solved (default 0: sequential) ; each flow uses a PatchMatch team of --flow-threads OpenMP threads (default: budget/(K+1)), reserved from the --threads budget while it runs. --latency N: frames queued for the solver (default 8).
+REM --checkpoint FILE writes the solver state and the output progress every --checkpoint-every frames (default 500) ; after a crash or a preemption, run the same command with --resume 1 to continue from it (.yuv, .y4m and image outputs are appended to ; sequential processing only). Without a checkpoint file, --resume 1 starts from the first frame.
+REM --flow-preset and --solver-preset (fast, medium, slow ; default medium) trade quality for speed : PatchMatch iterations (2/5/10), solver pyramid levels and iterations (3x20, 5x50, 6x100). The same solver is available as an ffmpeg filter, see blindconsistency.h.
+REM --solve-scale F (e.g. 0.5 or 0.25 for 4K ; default 1) computes the flow and the solve at that fraction of the resolution and adds the upsampled correction (solution - processed) to the full resolution frame ; --guided-radius R (full resolution pixels, e.g. 4-8 ; default 0: bilinear) upsamples it with a guided filter on the input, so that it follows its edges.
+REM --lambdas L1,L2,... (e.g. 0.5,1,2,4) sweeps the temporal weight in a single pass : one output per value, named by inserting "_l<value>" before the extension, or before the frame number of image sequences (take2.y4m -> take2_l0.5.y4m, out_0000.png -> out_l0.5_0000.png). The flow and the temporal weights are shared and the solves run in parallel ; the lambda argument is ignored, and the outputs must be files (no pipe, no checkpoints, no --shot-workers).
+REM --static-threshold F (e.g. 0.01 ; default 0: off) solves incrementally : tiles of --static-tile N pixels (default 32) whose flow is the identity, whose input changed less than F and where the previous solution already fits the processed frame keep the previous solution ; the solver only runs on the other tiles and a one tile halo around them. Large speedups on locked-off shots (talking heads, surveillance).
+REM --memory-cap MB (e.g. 4096 for 8K on small workers ; default 0: none) bounds the memory of a run : frames whose working set does not fit are processed in overlapping tiles (flow and solve), after a coarse solve of the whole frame that gives the boundary conditions. --latency defaults to 2 with a cap. The cap is approximate, and includes the full resolution frames that stay in memory : only the flow and solver buffers are tiled, the frames (queues, solutions) and the flow are kept at full resolution in memory, not streamed from disk, so a cap below their size gives the smallest tiles but is exceeded.
+REM --yuv420 1 solves in YCbCr : luma at full resolution and the two chroma planes at quarter area, about half the solver work. y4m/yuv files and pipes are read and written as 4:2:0 without colour conversion (other inputs and outputs are converted). Sequential only : no checkpoints, --shot-workers, --solve-scale, --static-threshold nor --memory-cap.
+REM --solver-storage half stores the right-hand sides, diagonals and pyramid levels of the solver in 16 bit floats (computations stay in 32 bit), which cuts the memory traffic of the solver sweeps ; not with --static-threshold. --frame-storage half|int16 holds the queued frames and the previous input and solution in 16 bit (int16 : fixed point, 1/8192 steps ; with half, the inputs still use int16 since the flow needs their 8 bit levels), halving the memory of --latency and --flow-lookahead queues. Default float for both. F16C conversions need an AVX2 build.
+REM --window K (e.g. 4 ; default 1: frame by frame) solves K consecutive frames jointly (each frame also sees the frames after it) by conjugate gradients (at most --window-iters N iterations, 8/15/30 with the solver presets, stopping earlier once the residual is below --window-tol times the initial one, default 0.001 ; --profile-summary 1 reports the mean final residual as window_residual_ppm / window_solves), then slides the window by K minus --window-overlap frames (default 1 : the last frame is solved again with the next ones) ; more parallel work per solve and better quality, for more latency and memory (batch jobs). Not with --yuv420, --solve-scale, --memory-cap tiles, --static-threshold or --solver-storage half.
+REM benchmark.exe (benchmark.cpp) times the solver, warping, PatchMatch and I/O kernels on synthetic frames, see the header of benchmark.cpp for its options. Only the MSVC project is provided : there is no Linux build target, FFGrab.h and the bundled CImg.h are written for MSVC. The solver, warping and PatchMatch cases do compile with g++ (-fopenmp -DBENCHMARK_NO_VIDEO_IO -D__int64="long long" -Dcimg_display=0, with patchmatch/nn.cpp, allegro_emu.cpp and patch.cpp) once the loop variable t of CImg::draw_spline (textured version), which shadows a template parameter, is renamed ; numbers taken that way are not reproducible from this repository alone.
+REM --scene-threshold S (0..1, e.g. 0.4 ; default 0: disabled) detects scene cuts with the score of ffmpeg's select filter ; the first frame of a shot is not regularized against the previous shot. With --shot-workers N, up to N shots are solved in parallel (--shot-buffer frames queued per shot, default 32) and written in order.
+REM pipes: use - (stdin/stdout) or pipe:N (descriptor N) as file names. Inputs are y4m or raw I420 streams (raw: give W H, --pipe-bitdepth for >8 bit) ; giving the same pipe for input and processed reads interleaved frames (input, processed, input, ...). Output to a pipe is y4m (--pipe-format raw for I420) ; logs then go to stderr.
+REM e.g.: ffmpeg -i in.mp4 -f yuv4mpegpipe - | mytool | stabilize.exe - - 1.0 - 100000 | ffmpeg -i - out.mp4
+REM server mode: stabilize.exe --server spool_dir [--server-jobs 2] [--server-threads T] [--poll-ms 500] [--exit-when-idle 1] processes the NAME.job files dropped in spool_dir (one line: the arguments of a normal run), several at a time, sharing T threads. Jobs are renamed NAME.running then NAME.done / NAME.failed ; NAME.progress holds "frames_written total".
+REM --profile times.jsonl (or times.csv) writes per-frame timings of each stage (decode, convert, flow, rhs, solver levels, encode) and counters (patch distances, solver sweeps) ; --profile-summary 1 prints only the totals at the end.
 REM for best quality, export in YUV and /then/ use ffmpeg to compress in mp4 ; the mp4 our tool produce may not even export well to Premiere or other softwares.
 
 REM example: